@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __BitPlaneEngine_H
+#define __BitPlaneEngine_H
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include <itkImage.h>
+#include <itkSimpleFastMutexLock.h>
+
+#include "map.h"
+#include "BitPlanes.h"
+#include "StapleEM.h"
+
+namespace staple
+{
+
+/**
+ * BitPlaneEngine - STAPLE engine over bit-packed binary raters (see staple::estimate).
+ *
+ * The votes of each rater (staple::isVote) are packed into a common::BitPlane.
+ * The STAPLE weight of a voxel only depends on its vote pattern (bit i set when
+ * rater i votes foreground), so instead of visiting voxels every iteration the
+ * engine counts each distinct pattern once up front:
+ *   - voxels where all raters agree are counted with popcounts of the AND / OR
+ *     of the rater words,
+ *   - the remaining (disagreement) voxels are collected into a sorted
+ *     histogram of vote patterns.
+ * A rater voxel that is neither a vote nor background (a label other than 0 and
+ * 1) is a vote against that does not count towards the rater's specificity.
+ * Raters with such voxels get a second plane of them, and the histogram keys the
+ * pattern of those "stray" raters along with the votes.
+ * The E-step weights each pattern with per-byte lookup tables of the rater
+ * likelihoods (one table per 8 raters), and the M-step sums are the pattern
+ * counts times those weights.  Voxels are only visited again to write the output.
+ *
+ * Supports up to 64 raters.
+ */
+template < class ImageType >
+class BitPlaneEngine
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef itk::Image<float, ImageType::ImageDimension> WeightImageType;
+  typedef typename WeightImageType::Pointer WeightImagePointer;
+  typedef common::BitWord Pattern;
+  typedef std::pair<Pattern, Pattern> Key; // votes, stray raters
+  typedef std::pair<Key, size_t> PatternCount;
+  typedef std::vector<PatternCount> Histogram;
+
+  static const size_t MaximumRaters = 64;
+  static const size_t BlockWords = 1024;
+
+  BitPlaneEngine(const std::vector<ImagePointer> & raters, size_t numThreads, double confidenceWeight = 1.0)
+  :numThreads_(numThreads),
+   confidenceWeight_(confidenceWeight),
+   allOnes_(0),
+   allZeros_(0),
+   mode_(HISTOGRAM)
+  {
+    reference_ = WeightImageType::New();
+    reference_->SetRegions( raters[0]->GetLargestPossibleRegion() );
+    reference_->SetOrigin( raters[0]->GetOrigin() );
+    reference_->SetSpacing( raters[0]->GetSpacing() );
+    reference_->SetDirection( raters[0]->GetDirection() );
+
+    const size_t voxels = raters[0]->GetBufferedRegion().GetNumberOfPixels();
+    for(size_t i=0; i<raters.size(); ++i)
+    {
+      buffers_.push_back( raters[i]->GetBufferPointer() );
+      planes_.push_back( common::BitPlane(voxels) );
+      strays_.push_back( common::BitPlane(voxels) );
+    }
+    mode_ = PACK;
+    common::each<BitPlaneEngine>::run( *this, jobs(), numThreads_ );
+    buffers_.clear();
+    bool stray = false;
+    for(size_t i=0; i<strays_.size() && !stray; ++i) stray = strays_[i].count() > 0;
+    if(!stray) strays_.clear();
+
+    mode_ = HISTOGRAM;
+    partialHistograms_.assign( jobs(), Histogram() );
+    partialOnes_.assign( jobs(), 0 );
+    partialZeros_.assign( jobs(), 0 );
+    common::each<BitPlaneEngine>::run( *this, jobs(), numThreads_ );
+    mergeHistograms();
+  }
+
+  /** start from these weights instead of the mean vote (warm start). */
+  void SetInitialWeights(const WeightImagePointer & initial) { initial_ = initial; }
+
+  size_t raters() const { return planes_.size(); }
+  size_t voxels() const { return planes_[0].voxels(); }
+
+  /** number of distinct vote patterns among the voxels where raters disagree. */
+  size_t patterns() const { return histogram_.size(); }
+
+  /**
+   * the STAPLE estimate for the parameters of the last step, or the initial weights
+   * (the mean vote unless SetInitialWeights was called) when no step has run.
+   */
+  WeightImagePointer GetOutput()
+  {
+    WeightImagePointer output = WeightImageType::New();
+    output->SetRegions( reference_->GetLargestPossibleRegion() );
+    output->Allocate();
+    output->SetOrigin( reference_->GetOrigin() );
+    output->SetSpacing( reference_->GetSpacing() );
+    output->SetDirection( reference_->GetDirection() );
+    if(alpha_.empty() && initial_.IsNotNull())
+    {
+      const float * initial = initial_->GetBufferPointer();
+      std::copy( initial, initial + planes_[0].voxels(), output->GetBufferPointer() );
+      return output;
+    }
+    output_ = output->GetBufferPointer();
+    mode_ = OUTPUT;
+    common::each<BitPlaneEngine>::run( *this, jobs(), numThreads_ );
+    output_ = 0;
+    return output;
+  }
+
+  Statistics seed(Parameters & params)
+  {
+    const size_t R = planes_.size();
+    const double voxels = planes_[0].voxels();
+
+    // prior: mean vote over all voxels, as the itk filter sums it in float.
+    double voteSum = static_cast<double>(allOnes_);
+    for(size_t h=0; h<histogram_.size(); ++h)
+    {
+      const float mean = static_cast<float>( static_cast<double>( common::popcount(histogram_[h].first.first) ) / R );
+      voteSum += mean * static_cast<double>(histogram_[h].second);
+    }
+    params.prior = ( voteSum / voxels ) * confidenceWeight_;
+    prior_ = params.prior;
+    alpha_.clear(); // no step yet, the output is the seed
+    beta_.clear();
+
+    if(initial_.IsNotNull())
+    {
+      mode_ = SEED;
+      partialStats_.assign( jobs(), Statistics() );
+      common::each<BitPlaneEngine>::run( *this, jobs(), numThreads_ );
+      Statistics stats;
+      for(size_t j=0; j<partialStats_.size(); ++j) stats.add( partialStats_[j] );
+      return stats;
+    }
+
+    // mean vote, which is also a function of the pattern only.
+    std::vector<double> weights( histogram_.size() );
+    for(size_t h=0; h<histogram_.size(); ++h)
+    {
+      weights[h] = static_cast<float>( static_cast<double>( common::popcount(histogram_[h].first.first) ) / R );
+    }
+    return accumulate( weights, 1.0, 0.0 );
+  }
+
+  Statistics step(const Parameters & params)
+  {
+    makeTables(params);
+    std::vector<double> weights( histogram_.size() );
+    for(size_t h=0; h<histogram_.size(); ++h)
+    {
+      weights[h] = weight( histogram_[h].first.first );
+    }
+    const Pattern all = planes_.size() == MaximumRaters ? ~Pattern(0) : ( Pattern(1) << planes_.size() ) - 1;
+    return accumulate( weights, weight(all), weight(0) );
+  }
+
+  // common::each interface, one block of words per job.
+  void operator()(size_t job)
+  {
+    const size_t first = job * BlockWords;
+    const size_t last = std::min( first + BlockWords, planes_[0].words() );
+    switch(mode_)
+    {
+      case PACK:
+        packBlock( first, last );
+        break;
+      case HISTOGRAM:
+        histogramBlock( job, first, last );
+        break;
+      case SEED:
+        seedBlock( job, first, last );
+        break;
+      case OUTPUT:
+        outputBlock( first, last );
+        break;
+    }
+  }
+
+private:
+  enum Mode
+  {
+    PACK,
+    HISTOGRAM,
+    SEED,
+    OUTPUT
+  };
+
+  size_t jobs() const { return ( planes_[0].words() + BlockWords - 1 ) / BlockWords; }
+
+  /** the stray voxels of rater i in word k. */
+  common::BitWord stray(size_t i, size_t k) const { return strays_.empty() ? 0 : strays_[i][k]; }
+
+  /** pack words [first,last) of every rater into its vote and stray planes. */
+  void packBlock(size_t first, size_t last)
+  {
+    const size_t voxels = planes_[0].voxels();
+    for(size_t i=0; i<buffers_.size(); ++i)
+    {
+      common::BitWord * votes = planes_[i].data();
+      common::BitWord * strays = strays_[i].data();
+      for(size_t k=first; k<last; ++k)
+      {
+        const PixelType * in = buffers_[i] + k * common::BitsPerWord;
+        const size_t n = std::min( common::BitsPerWord, voxels - k * common::BitsPerWord );
+        common::BitWord v = 0, o = 0;
+        for(size_t b=0; b<n; ++b)
+        {
+          const bool vote = isVote( in[b] );
+          v |= static_cast<common::BitWord>( vote ) << b;
+          o |= static_cast<common::BitWord>( !vote && !isBackground( in[b] ) ) << b;
+        }
+        votes[k] = v;
+        strays[k] = o;
+      }
+    }
+  }
+
+  /** patterns of planes (one bit per rater) of the voxels in mask, for word k. */
+  static void patternsOf(const std::vector<common::BitPlane> & planes, size_t k, common::BitWord mask, Pattern * patterns)
+  {
+    for(size_t i=0; i<planes.size(); ++i)
+    {
+      common::BitWord w = planes[i][k] & mask;
+      while(w)
+      {
+        patterns[ common::lowestBit(w) ] |= Pattern(1) << i;
+        w &= w - 1;
+      }
+    }
+  }
+
+  void histogramBlock(size_t job, size_t first, size_t last)
+  {
+    std::vector<Key> found;
+    Pattern patterns[common::BitsPerWord];
+    Pattern strays[common::BitsPerWord];
+    size_t ones = 0, zeros = 0;
+    for(size_t k=first; k<last; ++k)
+    {
+      const common::BitWord valid = planes_[0].valid(k);
+      common::BitWord any = 0, every = valid, anyStray = 0;
+      for(size_t i=0; i<planes_.size(); ++i)
+      {
+        any |= planes_[i][k];
+        every &= planes_[i][k];
+        anyStray |= stray( i, k );
+      }
+      ones += common::popcount( every );
+      zeros += common::popcount( ~any & ~anyStray & valid );
+      common::BitWord disagree = ( any | anyStray ) & ~every & valid;
+      if(!disagree) continue;
+
+      std::fill( patterns, patterns + common::BitsPerWord, Pattern(0) );
+      std::fill( strays, strays + common::BitsPerWord, Pattern(0) );
+      patternsOf( planes_, k, disagree, patterns );
+      if(anyStray) patternsOf( strays_, k, disagree, strays );
+      while(disagree)
+      {
+        const unsigned int b = common::lowestBit(disagree);
+        found.push_back( Key( patterns[b], strays[b] ) );
+        disagree &= disagree - 1;
+      }
+    }
+    partialOnes_[job] = ones;
+    partialZeros_[job] = zeros;
+    compress( found, partialHistograms_[job] );
+  }
+
+  /** sort a list of patterns into a histogram. */
+  static void compress(std::vector<Key> & found, Histogram & histogram)
+  {
+    std::sort( found.begin(), found.end() );
+    histogram.clear();
+    for(size_t n=0; n<found.size(); ++n)
+    {
+      if(histogram.empty() || histogram.back().first != found[n])
+        histogram.push_back( PatternCount( found[n], 0 ) );
+      ++histogram.back().second;
+    }
+  }
+
+  void mergeHistograms()
+  {
+    Histogram all;
+    allOnes_ = allZeros_ = 0;
+    for(size_t j=0; j<partialHistograms_.size(); ++j)
+    {
+      all.insert( all.end(), partialHistograms_[j].begin(), partialHistograms_[j].end() );
+      Histogram().swap( partialHistograms_[j] );
+      allOnes_ += partialOnes_[j];
+      allZeros_ += partialZeros_[j];
+    }
+    std::sort( all.begin(), all.end() );
+    histogram_.clear();
+    for(size_t n=0; n<all.size(); ++n)
+    {
+      if(histogram_.empty() || histogram_.back().first != all[n].first)
+        histogram_.push_back( PatternCount( all[n].first, 0 ) );
+      histogram_.back().second += all[n].second;
+    }
+  }
+
+  /** M-step sums for the given weights of the histogram entries and the unanimous voxels. */
+  Statistics accumulate(const std::vector<double> & weights, double onesWeight, double zerosWeight) const
+  {
+    const size_t R = planes_.size();
+    Statistics stats(R);
+    const double ones = static_cast<double>(allOnes_);
+    const double zeros = static_cast<double>(allZeros_);
+    stats.wsum = ones * onesWeight + zeros * zerosWeight;
+    stats.wcsum = ones * ( 1.0 - onesWeight ) + zeros * ( 1.0 - zerosWeight );
+    for(size_t i=0; i<R; ++i)
+    {
+      stats.pnum[i] = ones * onesWeight;
+      stats.qnum[i] = zeros * ( 1.0 - zerosWeight );
+    }
+    for(size_t h=0; h<histogram_.size(); ++h)
+    {
+      const double count = static_cast<double>( histogram_[h].second );
+      const double w = count * weights[h];
+      const double wc = count * ( 1.0 - weights[h] );
+      stats.wsum += w;
+      stats.wcsum += wc;
+      const Pattern pattern = histogram_[h].first.first;
+      const Pattern strays = histogram_[h].first.second;
+      for(size_t i=0; i<R; ++i)
+      {
+        if( ( pattern >> i ) & 1 )        stats.pnum[i] += w;
+        else if( !( ( strays >> i ) & 1 ) ) stats.qnum[i] += wc;
+      }
+    }
+    return stats;
+  }
+
+  /** per-byte likelihood tables: alpha (truth is foreground) and beta (background) of 8 raters. */
+  void makeTables(const Parameters & params)
+  {
+    const size_t R = planes_.size();
+    const size_t chunks = ( R + 7 ) / 8;
+    alpha_.assign( chunks * 256, 1.0 );
+    beta_.assign( chunks * 256, 1.0 );
+    for(size_t c=0; c<chunks; ++c)
+    {
+      const size_t raters = std::min<size_t>( 8, R - 8*c );
+      for(size_t byte=0; byte<256; ++byte)
+      {
+        double a = 1.0, b = 1.0;
+        for(size_t j=0; j<raters; ++j)
+        {
+          const double p = params.sensitivity[8*c + j];
+          const double q = params.specificity[8*c + j];
+          if( ( byte >> j ) & 1 ) { a *= p;       b *= 1.0 - q; }
+          else                    { a *= 1.0 - p; b *= q; }
+        }
+        alpha_[c*256 + byte] = a;
+        beta_[c*256 + byte] = b;
+      }
+    }
+  }
+
+  /** E-step weight of a vote pattern, stored as float like the output; the mean vote before the first step. */
+  double weight(Pattern pattern) const
+  {
+    if(alpha_.empty()) return static_cast<float>( static_cast<double>( common::popcount(pattern) ) / planes_.size() );
+    double a = 1.0, b = 1.0;
+    const size_t chunks = alpha_.size() / 256;
+    for(size_t c=0; c<chunks; ++c)
+    {
+      const size_t byte = static_cast<size_t>( ( pattern >> (8*c) ) & 0xff );
+      a *= alpha_[c*256 + byte];
+      b *= beta_[c*256 + byte];
+    }
+    return static_cast<float>( prior_*a / ( prior_*a + (1.0-prior_)*b ) );
+  }
+
+  void seedBlock(size_t job, size_t first, size_t last)
+  {
+    const size_t R = planes_.size();
+    Statistics stats(R);
+    const float * initial = initial_->GetBufferPointer();
+    for(size_t k=first; k<last; ++k)
+    {
+      const float * w = initial + k * common::BitsPerWord;
+      const common::BitWord valid = planes_[0].valid(k);
+      double wsum = 0, wcsum = 0;
+      for(common::BitWord m = valid; m; m &= m - 1)
+      {
+        const double v = w[ common::lowestBit(m) ];
+        wsum += v;
+        wcsum += 1.0 - v;
+      }
+      stats.wsum += wsum;
+      stats.wcsum += wcsum;
+      for(size_t i=0; i<R; ++i)
+      {
+        for(common::BitWord m = planes_[i][k]; m; m &= m - 1)
+        {
+          stats.pnum[i] += w[ common::lowestBit(m) ];
+        }
+        for(common::BitWord m = ~planes_[i][k] & ~stray( i, k ) & valid; m; m &= m - 1)
+        {
+          stats.qnum[i] += 1.0 - w[ common::lowestBit(m) ];
+        }
+      }
+    }
+    partialStats_[job] = stats;
+  }
+
+  void outputBlock(size_t first, size_t last)
+  {
+    const Pattern all = planes_.size() == MaximumRaters ? ~Pattern(0) : ( Pattern(1) << planes_.size() ) - 1;
+    const float onesWeight = static_cast<float>( weight(all) );
+    const float zerosWeight = static_cast<float>( weight(0) );
+    Pattern patterns[common::BitsPerWord];
+    for(size_t k=first; k<last; ++k)
+    {
+      float * out = output_ + k * common::BitsPerWord;
+      const common::BitWord valid = planes_[0].valid(k);
+      const size_t n = common::popcount(valid);
+      common::BitWord any = 0, every = valid;
+      for(size_t i=0; i<planes_.size(); ++i)
+      {
+        any |= planes_[i][k];
+        every &= planes_[i][k];
+      }
+      if(!any)
+      {
+        std::fill( out, out + n, zerosWeight );
+        continue;
+      }
+      if(every == valid)
+      {
+        std::fill( out, out + n, onesWeight );
+        continue;
+      }
+      std::fill( patterns, patterns + common::BitsPerWord, Pattern(0) );
+      patternsOf( planes_, k, valid, patterns );
+      for(size_t b=0; b<n; ++b)
+      {
+        out[b] = static_cast<float>( weight( patterns[b] ) );
+      }
+    }
+  }
+
+  size_t numThreads_;
+  double confidenceWeight_;
+  WeightImagePointer reference_;
+  WeightImagePointer initial_;
+  std::vector<const PixelType *> buffers_; // while packing
+  std::vector<common::BitPlane> planes_;
+  std::vector<common::BitPlane> strays_;   // empty when no rater has a stray voxel
+
+  Histogram histogram_;
+  size_t allOnes_;
+  size_t allZeros_;
+  double prior_;
+  std::vector<double> alpha_;
+  std::vector<double> beta_;
+
+  // per-job results of the current common::each pass.
+  Mode mode_;
+  std::vector<Histogram> partialHistograms_;
+  std::vector<size_t> partialOnes_;
+  std::vector<size_t> partialZeros_;
+  std::vector<Statistics> partialStats_;
+  float * output_;
+};
+
+} // end namespace
+
+#endif
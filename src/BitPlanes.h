@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __BitPlanes_H
+#define __BitPlanes_H
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <itkSimpleFastMutexLock.h>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * bit-packed binary masks: 64 voxels to a word, voxel v is bit (v % 64) of word (v / 64),
+ * in the order of the image buffer.
+ */
+typedef uint64_t BitWord;
+const size_t BitsPerWord = 64;
+
+inline unsigned int popcount(BitWord w)
+{
+#ifdef _MSC_VER
+  return static_cast<unsigned int>( __popcnt64(w) );
+#else
+  return static_cast<unsigned int>( __builtin_popcountll(w) );
+#endif
+}
+
+/** index of the lowest set bit, w must not be 0. */
+inline unsigned int lowestBit(BitWord w)
+{
+#ifdef _MSC_VER
+  unsigned long b;
+  _BitScanForward64(&b, w);
+  return static_cast<unsigned int>(b);
+#else
+  return static_cast<unsigned int>( __builtin_ctzll(w) );
+#endif
+}
+
+/** number of set bits in words [0,n), written as a plain loop so the compiler can vectorize it. */
+inline size_t popcount(const BitWord * words, size_t n)
+{
+  size_t count = 0;
+  for(size_t k=0; k<n; ++k) count += popcount(words[k]);
+  return count;
+}
+
+/**
+ * BitPlane - one binary mask packed into words.
+ */
+class BitPlane
+{
+public:
+  BitPlane()
+  :voxels_(0)
+  {}
+
+  explicit BitPlane(size_t voxels)
+  :voxels_(voxels),
+   words_((voxels + BitsPerWord - 1) / BitsPerWord, 0)
+  {}
+
+  size_t voxels() const { return voxels_; }
+  size_t words() const { return words_.size(); }
+  BitWord * data() { return words_.empty() ? 0 : &words_[0]; }
+  const BitWord * data() const { return words_.empty() ? 0 : &words_[0]; }
+  BitWord operator[](size_t k) const { return words_[k]; }
+  bool test(size_t v) const { return ( words_[v / BitsPerWord] >> (v % BitsPerWord) ) & 1; }
+
+  /** the bits of word k that are voxels, only the last word can be partial. */
+  BitWord valid(size_t k) const
+  {
+    const size_t tail = voxels_ - k * BitsPerWord;
+    return tail >= BitsPerWord ? ~BitWord(0) : ( BitWord(1) << tail ) - 1;
+  }
+
+  /** number of set voxels. */
+  size_t count() const { return popcount( data(), words() ); }
+
+  /** pack words [first,last) from buffer, a non-zero voxel (a positive one with positiveOnly) is set. */
+  template < class PixelType >
+  void pack(const PixelType * buffer, size_t first, size_t last, bool positiveOnly = false)
+  {
+    if(positiveOnly)
+    {
+      for(size_t k=first; k<last; ++k)
+      {
+        const PixelType * in = buffer + k * BitsPerWord;
+        const size_t n = std::min( BitsPerWord, voxels_ - k * BitsPerWord );
+        BitWord w = 0;
+        for(size_t b=0; b<n; ++b)
+        {
+          w |= static_cast<BitWord>( in[b] > 0 ) << b;
+        }
+        words_[k] = w;
+      }
+      return;
+    }
+    for(size_t k=first; k<last; ++k)
+    {
+      const PixelType * in = buffer + k * BitsPerWord;
+      const size_t n = std::min( BitsPerWord, voxels_ - k * BitsPerWord );
+      BitWord w = 0;
+      for(size_t b=0; b<n; ++b)
+      {
+        w |= static_cast<BitWord>( in[b] != 0 ) << b;
+      }
+      words_[k] = w;
+    }
+  }
+
+private:
+  size_t voxels_;
+  std::vector<BitWord> words_;
+};
+
+/**
+ * PackFunctor - common::each functor that packs a list of image buffers into BitPlanes,
+ * one block of words of every plane per job.
+ */
+template < class PixelType >
+struct PackFunctor
+{
+  static const size_t BlockWords = 4096;
+
+  const std::vector<const PixelType *> & buffers_;
+  std::vector<BitPlane> & planes_;
+  bool positiveOnly_;
+
+  PackFunctor(const std::vector<const PixelType *> & buffers, std::vector<BitPlane> & planes, bool positiveOnly = false)
+  :buffers_(buffers),
+   planes_(planes),
+   positiveOnly_(positiveOnly)
+  {}
+
+  size_t jobs() const { return ( planes_[0].words() + BlockWords - 1 ) / BlockWords; }
+
+  void operator()(size_t job)
+  {
+    const size_t first = job * BlockWords;
+    const size_t last = std::min( first + BlockWords, planes_[0].words() );
+    for(size_t i=0; i<planes_.size(); ++i)
+    {
+      planes_[i].pack( buffers_[i], first, last, positiveOnly_ );
+    }
+  }
+};
+
+/**
+ * packImages - pack each image's buffered region into a BitPlane, non-zero voxels
+ * set (only positive ones with positiveOnly, like dice's "pixel > 0").
+ */
+template < class ImageType >
+void packImages(const std::vector<typename ImageType::Pointer> & images, std::vector<BitPlane> & planes, size_t numThreads,
+                bool positiveOnly = false)
+{
+  typedef typename ImageType::PixelType PixelType;
+  const size_t voxels = images[0]->GetBufferedRegion().GetNumberOfPixels();
+  std::vector<const PixelType *> buffers;
+  planes.clear();
+  for(size_t i=0; i<images.size(); ++i)
+  {
+    buffers.push_back( images[i]->GetBufferPointer() );
+    planes.push_back( BitPlane(voxels) );
+  }
+  PackFunctor<PixelType> functor( buffers, planes, positiveOnly );
+  each< PackFunctor<PixelType> >::run( functor, functor.jobs(), numThreads );
+}
+
+/**
+ * IntersectionFunctor - common::each functor that counts the set voxels every pair of
+ * planes has in common, one block of words per job.  Within a block each plane is
+ * ANDed with all the planes after it while the block is still in cache; the counts
+ * of a job are added to the shared matrix once, at its end.
+ */
+struct IntersectionFunctor
+{
+  static const size_t BlockWords = 2048;
+
+  const std::vector<BitPlane> & planes_;
+  std::vector<unsigned long long> & counts_; // at i*n + j, i <= j
+  itk::SimpleFastMutexLock lock_;
+
+  IntersectionFunctor(const std::vector<BitPlane> & planes, std::vector<unsigned long long> & counts)
+  :planes_(planes),
+   counts_(counts)
+  {}
+
+  size_t jobs() const { return ( planes_[0].words() + BlockWords - 1 ) / BlockWords; }
+
+  void operator()(size_t job)
+  {
+    const size_t n = planes_.size();
+    const size_t first = job * BlockWords;
+    const size_t words = std::min( first + BlockWords, planes_[0].words() ) - first;
+    std::vector<unsigned long long> counts( n * n, 0 );
+    for(size_t i=0; i<n; ++i)
+    {
+      const BitWord * a = planes_[i].data() + first;
+      counts[i*n + i] = popcount( a, words );
+      for(size_t j=i+1; j<n; ++j)
+      {
+        const BitWord * b = planes_[j].data() + first;
+        unsigned long long both = 0;
+        for(size_t k=0; k<words; ++k) both += popcount( a[k] & b[k] );
+        counts[i*n + j] = both;
+      }
+    }
+    lock_.Lock();
+    for(size_t c=0; c<counts.size(); ++c) counts_[c] += counts[c];
+    lock_.Unlock();
+  }
+};
+
+/**
+ * intersections - set voxels in common of every pair of planes (all the same size),
+ * as a symmetric n*n matrix with the plane counts on the diagonal.
+ */
+inline std::vector<unsigned long long> intersections(const std::vector<BitPlane> & planes, size_t numThreads)
+{
+  const size_t n = planes.size();
+  std::vector<unsigned long long> counts( n * n, 0 );
+  if(n == 0) return counts;
+  IntersectionFunctor functor( planes, counts );
+  each<IntersectionFunctor>::run( functor, functor.jobs(), numThreads );
+  for(size_t i=0; i<n; ++i)
+  {
+    for(size_t j=0; j<i; ++j) counts[i*n + j] = counts[j*n + i];
+  }
+  return counts;
+}
+
+} // end namespace
+
+#endif
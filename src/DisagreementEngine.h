@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __DisagreementEngine_H
+#define __DisagreementEngine_H
+
+#include <vector>
+#include <algorithm>
+
+#include <itkImage.h>
+
+#include "map.h"
+#include "StapleEM.h"
+
+namespace staple
+{
+
+/**
+ * DisagreementEngine - STAPLE engine that only visits voxels where the raters disagree
+ * (see staple::estimate).
+ *
+ * The weight of a voxel where every rater votes foreground (or every rater is
+ * background) is the same for all such voxels, so those are only counted.  The
+ * voxels with mixed votes are collected once into a compact index (their buffer
+ * offsets, one column of votes per rater and their weights), and each iteration
+ * runs the E-step and the M-step sums over that list only, plus two closed-form
+ * terms for the unanimous counts.
+ *
+ * Unlike BitPlaneEngine there is no limit on the number of raters.  The images
+ * must be fully buffered and all of the same size.  Votes are read with isVote and
+ * isBackground, like the itk filter, so a voxel where some rater has another value
+ * is always listed.
+ */
+template < class ImageType >
+class DisagreementEngine
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef itk::Image<float, ImageType::ImageDimension> WeightImageType;
+  typedef typename WeightImageType::Pointer WeightImagePointer;
+
+  static const size_t BlockVoxels = 16384;
+
+  // how a listed voxel of a rater is stored
+  enum Vote
+  {
+    BACKGROUND = 0,
+    FOREGROUND = 1,
+    OTHER = 2 // neither, a vote against that does not count towards specificity
+  };
+
+  DisagreementEngine(const std::vector<ImagePointer> & raters, size_t numThreads, double confidenceWeight = 1.0)
+  :raters_(raters),
+   numThreads_(numThreads),
+   confidenceWeight_(confidenceWeight),
+   voxels_(raters[0]->GetBufferedRegion().GetNumberOfPixels()),
+   allOnes_(0),
+   allZeros_(0),
+   prior_(0),
+   params_(0),
+   onesWeight_(1.0),
+   zerosWeight_(0.0),
+   output_(0)
+  {
+    // find the disagreement voxels, block by block so the index comes out sorted.
+    mode_ = INDEX;
+    blockIndex_.assign( jobs(voxels_), std::vector<size_t>() );
+    blockOnes_.assign( jobs(voxels_), 0 );
+    common::each<DisagreementEngine>::run( *this, jobs(voxels_), numThreads_ );
+    for(size_t j=0; j<blockIndex_.size(); ++j)
+    {
+      index_.insert( index_.end(), blockIndex_[j].begin(), blockIndex_[j].end() );
+      std::vector<size_t>().swap( blockIndex_[j] );
+      allOnes_ += blockOnes_[j];
+    }
+    allZeros_ = voxels_ - allOnes_ - index_.size();
+
+    // gather the votes of the listed voxels, one column per rater.
+    mode_ = GATHER;
+    votes_.resize( raters_.size() * index_.size() );
+    weights_.resize( index_.size() );
+    common::each<DisagreementEngine>::run( *this, jobs(index_.size()), numThreads_ );
+  }
+
+  /** start from these weights instead of the mean vote (warm start). */
+  void SetInitialWeights(const WeightImagePointer & initial) { initial_ = initial; }
+
+  size_t raters() const { return raters_.size(); }
+  size_t voxels() const { return voxels_; }
+
+  /** number of voxels where the raters disagree. */
+  size_t disagreements() const { return index_.size(); }
+
+  /** the STAPLE estimate of the last pass. */
+  WeightImagePointer GetOutput()
+  {
+    WeightImagePointer output = WeightImageType::New();
+    output->SetRegions( raters_[0]->GetLargestPossibleRegion() );
+    output->Allocate();
+    output->SetOrigin( raters_[0]->GetOrigin() );
+    output->SetSpacing( raters_[0]->GetSpacing() );
+    output->SetDirection( raters_[0]->GetDirection() );
+    output_ = output->GetBufferPointer();
+    mode_ = OUTPUT;
+    common::each<DisagreementEngine>::run( *this, jobs(voxels_), numThreads_ );
+    output_ = 0;
+    return output;
+  }
+
+  Statistics seed(Parameters & params)
+  {
+    const size_t R = raters_.size();
+    const size_t n = index_.size();
+    params_ = 0;
+
+    // prior: mean vote over all voxels, as the itk filter sums it in float.
+    double voteSum = static_cast<double>(allOnes_);
+    for(size_t v=0; v<n; ++v)
+    {
+      size_t count = 0;
+      for(size_t i=0; i<R; ++i) count += ( votes_[i*n + v] == FOREGROUND );
+      weights_[v] = static_cast<float>( static_cast<double>(count) / R );
+      voteSum += weights_[v];
+    }
+    params.prior = ( voteSum / voxels_ ) * confidenceWeight_;
+    prior_ = params.prior;
+
+    if(initial_.IsNotNull())
+    {
+      // unanimous voxels no longer share a weight, so the seed sums need every voxel.
+      const float * initial = initial_->GetBufferPointer();
+      for(size_t v=0; v<n; ++v) weights_[v] = initial[ index_[v] ];
+      mode_ = SEED;
+      partial_.assign( jobs(voxels_), Statistics() );
+      common::each<DisagreementEngine>::run( *this, jobs(voxels_), numThreads_ );
+      return merge();
+    }
+    onesWeight_ = 1.0;
+    zerosWeight_ = 0.0;
+    mode_ = ACCUMULATE;
+    return sweep();
+  }
+
+  Statistics step(const Parameters & params)
+  {
+    params_ = &params;
+    onesWeight_ = unanimousWeight(true);
+    zerosWeight_ = unanimousWeight(false);
+    mode_ = ESTEP;
+    return sweep();
+  }
+
+  // common::each interface, one block of voxels (or of listed voxels) per job.
+  void operator()(size_t job)
+  {
+    const size_t first = job * BlockVoxels;
+    switch(mode_)
+    {
+      case INDEX:
+        indexBlock( job, first, std::min( first + BlockVoxels, voxels_ ) );
+        break;
+      case GATHER:
+        gatherBlock( first, std::min( first + BlockVoxels, index_.size() ) );
+        break;
+      case SEED:
+        seedBlock( job, first, std::min( first + BlockVoxels, voxels_ ) );
+        break;
+      case ACCUMULATE:
+      case ESTEP:
+        listBlock( job, first, std::min( first + BlockVoxels, index_.size() ) );
+        break;
+      case OUTPUT:
+        outputBlock( first, std::min( first + BlockVoxels, voxels_ ) );
+        break;
+    }
+  }
+
+private:
+  enum Mode
+  {
+    INDEX,      // build the index of disagreement voxels
+    GATHER,     // copy their votes
+    SEED,       // M-step sums of the initial weights, over every voxel
+    ACCUMULATE, // M-step sums of the listed weights
+    ESTEP,      // new listed weights, fused with their M-step sums
+    OUTPUT      // write the full-size estimate
+  };
+
+  static size_t jobs(size_t count) { return ( count + BlockVoxels - 1 ) / BlockVoxels; }
+
+  /** weight of the voxels where every rater votes foreground (or background). */
+  double unanimousWeight(bool foreground) const
+  {
+    double a = 1.0, b = 1.0;
+    for(size_t i=0; i<raters_.size(); ++i)
+    {
+      const double p = params_->sensitivity[i];
+      const double q = params_->specificity[i];
+      if(foreground) { a *= p;       b *= 1.0 - q; }
+      else           { a *= 1.0 - p; b *= q; }
+    }
+    return static_cast<float>( prior_*a / ( prior_*a + (1.0-prior_)*b ) );
+  }
+
+  Statistics sweep()
+  {
+    partial_.assign( jobs(index_.size()), Statistics() );
+    common::each<DisagreementEngine>::run( *this, jobs(index_.size()), numThreads_ );
+    Statistics stats = merge();
+    if(stats.pnum.empty()) stats = Statistics( raters_.size() );
+
+    // unanimous voxels
+    const double ones = static_cast<double>(allOnes_);
+    const double zeros = static_cast<double>(allZeros_);
+    stats.wsum += ones * onesWeight_ + zeros * zerosWeight_;
+    stats.wcsum += ones * ( 1.0 - onesWeight_ ) + zeros * ( 1.0 - zerosWeight_ );
+    for(size_t i=0; i<raters_.size(); ++i)
+    {
+      stats.pnum[i] += ones * onesWeight_;
+      stats.qnum[i] += zeros * ( 1.0 - zerosWeight_ );
+    }
+    return stats;
+  }
+
+  Statistics merge() const
+  {
+    Statistics stats;
+    for(size_t j=0; j<partial_.size(); ++j) stats.add( partial_[j] );
+    return stats;
+  }
+
+  void indexBlock(size_t job, size_t first, size_t last)
+  {
+    const size_t R = raters_.size();
+    std::vector<size_t> & index = blockIndex_[job];
+    size_t ones = 0;
+    for(size_t v=first; v<last; ++v)
+    {
+      size_t votes = 0, background = 0;
+      for(size_t i=0; i<R; ++i)
+      {
+        const PixelType value = raters_[i]->GetBufferPointer()[v];
+        votes += isVote(value);
+        background += isBackground(value);
+      }
+      if(votes == R) ++ones;
+      else if(background != R) index.push_back(v);
+    }
+    blockOnes_[job] = ones;
+  }
+
+  void gatherBlock(size_t first, size_t last)
+  {
+    const size_t n = index_.size();
+    for(size_t i=0; i<raters_.size(); ++i)
+    {
+      const PixelType * buffer = raters_[i]->GetBufferPointer();
+      unsigned char * column = &votes_[i*n];
+      for(size_t v=first; v<last; ++v)
+      {
+        const PixelType value = buffer[ index_[v] ];
+        column[v] = isVote(value) ? FOREGROUND : isBackground(value) ? BACKGROUND : OTHER;
+      }
+    }
+  }
+
+  void seedBlock(size_t job, size_t first, size_t last)
+  {
+    const size_t R = raters_.size();
+    Statistics stats(R);
+    const float * initial = initial_->GetBufferPointer();
+    for(size_t v=first; v<last; ++v)
+    {
+      const double w = initial[v];
+      stats.wsum += w;
+      stats.wcsum += 1.0 - w;
+      for(size_t i=0; i<R; ++i)
+      {
+        const PixelType value = raters_[i]->GetBufferPointer()[v];
+        if(isVote(value))            stats.pnum[i] += w;
+        else if(isBackground(value)) stats.qnum[i] += 1.0 - w;
+      }
+    }
+    partial_[job] = stats;
+  }
+
+  /** listed voxels [first,last), rater by rater so every loop reads one column. */
+  void listBlock(size_t job, size_t first, size_t last)
+  {
+    const size_t R = raters_.size();
+    const size_t n = index_.size();
+    Statistics stats(R);
+    if(mode_ == ESTEP)
+    {
+      std::vector<double> a( last - first, 1.0 ), b( last - first, 1.0 );
+      for(size_t i=0; i<R; ++i)
+      {
+        const unsigned char * column = &votes_[i*n];
+        const double a1 = params_->sensitivity[i], a0 = 1.0 - a1;
+        const double b0 = params_->specificity[i], b1 = 1.0 - b0;
+        for(size_t v=first; v<last; ++v)
+        {
+          a[v-first] *= column[v] == FOREGROUND ? a1 : a0;
+          b[v-first] *= column[v] == FOREGROUND ? b1 : b0;
+        }
+      }
+      const double g = prior_;
+      for(size_t v=first; v<last; ++v)
+      {
+        const double ga = g * a[v-first];
+        weights_[v] = static_cast<float>( ga / ( ga + (1.0-g) * b[v-first] ) );
+      }
+    }
+    for(size_t v=first; v<last; ++v)
+    {
+      stats.wsum += weights_[v];
+      stats.wcsum += 1.0 - weights_[v];
+    }
+    for(size_t i=0; i<R; ++i)
+    {
+      const unsigned char * column = &votes_[i*n];
+      double pnum = 0, qnum = 0;
+      for(size_t v=first; v<last; ++v)
+      {
+        const double w = weights_[v];
+        if(column[v] == FOREGROUND)      pnum += w;
+        else if(column[v] == BACKGROUND) qnum += 1.0 - w;
+      }
+      stats.pnum[i] = pnum;
+      stats.qnum[i] = qnum;
+    }
+    partial_[job] = stats;
+  }
+
+  void outputBlock(size_t first, size_t last)
+  {
+    // unanimous voxels from the first rater's vote, then the listed voxels on top.
+    const PixelType * buffer = raters_[0]->GetBufferPointer();
+    const float ones = static_cast<float>(onesWeight_);
+    const float zeros = static_cast<float>(zerosWeight_);
+    for(size_t v=first; v<last; ++v) output_[v] = isVote( buffer[v] ) ? ones : zeros;
+    const std::vector<size_t> & index = index_;
+    std::vector<size_t>::const_iterator begin = std::lower_bound( index.begin(), index.end(), first );
+    std::vector<size_t>::const_iterator end = std::lower_bound( begin, index.end(), last );
+    for(std::vector<size_t>::const_iterator it=begin; it!=end; ++it)
+    {
+      output_[*it] = weights_[ it - index.begin() ];
+    }
+  }
+
+  std::vector<ImagePointer> raters_;
+  size_t numThreads_;
+  double confidenceWeight_;
+  size_t voxels_;
+  WeightImagePointer initial_;
+
+  // the disagreement voxels
+  std::vector<size_t> index_;         // buffer offsets, sorted
+  std::vector<unsigned char> votes_;  // Vote of rater i at listed voxel v, at i*n + v
+  std::vector<float> weights_;        // current weights of the listed voxels
+  size_t allOnes_;
+  size_t allZeros_;
+
+  double prior_;
+  const Parameters * params_;
+  double onesWeight_;
+  double zerosWeight_;
+
+  // state of the current common::each pass
+  Mode mode_;
+  std::vector< std::vector<size_t> > blockIndex_;
+  std::vector<size_t> blockOnes_;
+  std::vector<Statistics> partial_;
+  float * output_;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __DistanceTransform_H
+#define __DistanceTransform_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * DistanceTransformFunctor - common::each functor for one axis of the separable
+ * squared euclidean distance transform (Felzenszwalb and Huttenlocher, "Distance
+ * Transforms of Sampled Functions", 2012): every line along the axis is replaced by
+ * the lower envelope of the parabolas rooted at its samples, in linear time.  The
+ * lines are independent, a block of them per job.
+ */
+struct DistanceTransformFunctor
+{
+  static const size_t BlockLines = 256;
+
+  double * data_;
+  const std::vector<size_t> & size_;
+  size_t axis_;
+  double spacing_;
+  size_t stride_; // between neighbours along the axis
+  size_t lines_;
+
+  DistanceTransformFunctor(double * data, const std::vector<size_t> & size, size_t axis, double spacing)
+  :data_(data),
+   size_(size),
+   axis_(axis),
+   spacing_(spacing),
+   stride_(1),
+   lines_(1)
+  {
+    for(size_t d=0; d<size.size(); ++d)
+    {
+      if(d < axis) stride_ *= size[d];
+      if(d != axis) lines_ *= size[d];
+    }
+  }
+
+  size_t jobs() const { return ( lines_ + BlockLines - 1 ) / BlockLines; }
+
+  void operator()(size_t job)
+  {
+    const size_t n = size_[axis_];
+    std::vector<double> f( n ), out( n ), boundaries( n + 1 );
+    std::vector<size_t> roots( n );
+    const size_t last = std::min( (job + 1) * BlockLines, lines_ );
+    for(size_t line=job * BlockLines; line<last; ++line)
+    {
+      // line = (coordinates above the axis) * stride + (coordinates below it).
+      double * voxels = data_ + ( line / stride_ ) * stride_ * n + line % stride_;
+      for(size_t i=0; i<n; ++i) f[i] = voxels[i * stride_];
+      if(envelope( f, out, roots, boundaries ))
+      {
+        for(size_t i=0; i<n; ++i) voxels[i * stride_] = out[i];
+      }
+    }
+  }
+
+  /** out[p] = min over q of (spacing*(p-q))^2 + f[q], false if every f[q] is infinite. */
+  bool envelope(const std::vector<double> & f, std::vector<double> & out, std::vector<size_t> & roots,
+                std::vector<double> & boundaries) const
+  {
+    const double infinity = std::numeric_limits<double>::infinity();
+    const size_t n = f.size();
+    size_t k = 0; // index of the rightmost parabola, once there is one
+    bool any = false;
+    for(size_t q=0; q<n; ++q)
+    {
+      if(f[q] == infinity) continue;
+      const double x = spacing_ * q;
+      if(!any)
+      {
+        roots[0] = q;
+        boundaries[0] = -infinity;
+        boundaries[1] = infinity;
+        any = true;
+        continue;
+      }
+      // drop the parabolas q hides, boundaries[0] is -infinity so the first one stays.
+      double s;
+      while(true)
+      {
+        const double y = spacing_ * roots[k];
+        s = ( ( f[q] + x * x ) - ( f[roots[k]] + y * y ) ) / ( 2.0 * ( x - y ) );
+        if(s > boundaries[k]) break;
+        --k;
+      }
+      ++k;
+      roots[k] = q;
+      boundaries[k] = s;
+      boundaries[k+1] = infinity;
+    }
+    if(!any) return false;
+
+    k = 0;
+    for(size_t p=0; p<n; ++p)
+    {
+      const double x = spacing_ * p;
+      while(boundaries[k+1] < x) ++k;
+      const double dx = x - spacing_ * roots[k];
+      out[p] = dx * dx + f[roots[k]];
+    }
+    return true;
+  }
+};
+
+/**
+ * distanceTransform - squared euclidean distance transform, in place, of a volume of
+ * the given size (in buffer order, x fastest) that holds 0 at the features and
+ * infinity elsewhere.  Distances are in the units of spacing; each axis is a
+ * separate pass, spread over numThreads threads.
+ */
+inline void distanceTransform(std::vector<double> & data, const std::vector<size_t> & size,
+                              const std::vector<double> & spacing, size_t numThreads)
+{
+  if(data.empty()) return;
+  for(size_t axis=0; axis<size.size(); ++axis)
+  {
+    DistanceTransformFunctor functor( &data[0], size, axis, spacing[axis] );
+    each<DistanceTransformFunctor>::run( functor, functor.jobs(), numThreads );
+  }
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __LoadImages_H
+#define __LoadImages_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkExceptionObject.h>
+#include <itkTimeProbe.h>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * LoadFunctor - common::each functor that reads file "job" of a list into its own slot,
+ * and times it.
+ */
+template < class ImageType >
+struct LoadFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef itk::ImageFileReader< ImageType > ReaderType;
+
+  const std::vector<std::string> & filenames_;
+  std::vector<ImagePointer> & images_;
+  std::vector<double> seconds_;
+  std::vector<std::string> errors_;
+
+  LoadFunctor(const std::vector<std::string> & filenames, std::vector<ImagePointer> & images)
+  :filenames_(filenames),
+   images_(images),
+   seconds_(filenames.size(), 0.0),
+   errors_(filenames.size())
+  {}
+
+  void operator()(size_t job)
+  {
+    itk::TimeProbe probe;
+    probe.Start();
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( filenames_[job] );
+    try
+    {
+      reader->Update();
+      images_[job] = reader->GetOutput();
+    }
+    catch(itk::ExceptionObject & e)
+    {
+      std::ostringstream message;
+      message << e;
+      errors_[job] = message.str();
+    }
+    catch( ... )
+    {
+      errors_[job] = "unknown error";
+    }
+    probe.Stop();
+    seconds_[job] = probe.GetTotal();
+  }
+};
+
+/**
+ * loadImages - read filenames into images, with up to numThreads files decoding at
+ * once.  With verbose set, the time spent on each file is printed to stderr.
+ * Returns false (after printing the errors) if any file could not be read.
+ */
+template < class ImageType >
+bool loadImages(const std::vector<std::string> & filenames, std::vector<typename ImageType::Pointer> & images,
+                size_t numThreads, bool verbose = true)
+{
+  images.assign( filenames.size(), typename ImageType::Pointer() );
+  if( filenames.empty() ) return true;
+
+  itk::TimeProbe total;
+  total.Start();
+  LoadFunctor<ImageType> loader( filenames, images );
+  each< LoadFunctor<ImageType> >::run( loader, filenames.size(), numThreads );
+  total.Stop();
+
+  bool ok = true;
+  double sum = 0;
+  for( size_t i=0; i<filenames.size(); ++i )
+  {
+    if( !loader.errors_[i].empty() )
+    {
+      std::cerr << "Error reading file " << filenames[i] << ": " << loader.errors_[i] << std::endl;
+      ok = false;
+    }
+    else if( verbose )
+    {
+      std::cerr << "loaded " << filenames[i] << " in " << loader.seconds_[i] << " s" << std::endl;
+    }
+    sum += loader.seconds_[i];
+  }
+  if( verbose )
+  {
+    std::cerr << "loading took " << total.GetTotal() << " s (" << sum << " s of reading)" << std::endl;
+  }
+  return ok;
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __MaskExpression_H
+#define __MaskExpression_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * MaskExpression - a logical expression over masks, compiled to a small stack
+ * program that is run over a block of voxels at a time.
+ *
+ * Masks are named a, b, c, ... in the order they are given; a voxel is set when it
+ * is non-zero.  The operators are ~ (or !) for not, & for and, ^ for xor and | for
+ * or, binding in that order (like C), with parentheses to group, so
+ * "(a & b) | (c & ~d)" is one expression.  Every instruction is one loop over the
+ * block, which the compiler vectorizes, and the block stays in cache until the
+ * last instruction has used it: the masks are read once and nothing the size of a
+ * volume is ever made but the output.
+ */
+class MaskExpression
+{
+public:
+  enum Code { LOAD, NOT, AND, XOR, OR };
+
+  struct Instruction
+  {
+    Instruction(Code c, size_t m = 0)
+    :code(c),
+     mask(m)
+    {}
+
+    Code code;
+    size_t mask; // LOAD only
+  };
+
+  MaskExpression()
+  :masks_(0),
+   depth_(0)
+  {}
+
+  /** compile text for masks inputs, false (with error() set) if it is not a valid expression over them. */
+  bool compile(const std::string & text, size_t masks)
+  {
+    text_ = text;
+    masks_ = masks;
+    position_ = 0;
+    program_.clear();
+    error_.clear();
+    used_.assign( masks, false );
+    if( !parseOr() ) return false;
+    skipSpaces();
+    if( position_ < text_.size() ) return fail( "unexpected '" + text_.substr( position_, 1 ) + "'" );
+
+    // the deepest the stack gets.
+    size_t depth = 0;
+    depth_ = 0;
+    for(size_t k=0; k<program_.size(); ++k)
+    {
+      if( program_[k].code == LOAD ) depth_ = std::max( depth_, ++depth );
+      else if( program_[k].code != NOT ) --depth;
+    }
+    return true;
+  }
+
+  const std::string & error() const { return error_; }
+  const std::vector<Instruction> & program() const { return program_; }
+  size_t depth() const { return depth_; }
+  bool used(size_t mask) const { return used_[mask]; }
+
+  /** the program as text, in postfix order. */
+  std::string listing() const
+  {
+    std::ostringstream out;
+    const char * names[] = { "load", "not", "and", "xor", "or" };
+    for(size_t k=0; k<program_.size(); ++k)
+    {
+      if( k > 0 ) out << " ";
+      out << names[program_[k].code];
+      if( program_[k].code == LOAD ) out << " " << static_cast<char>( 'a' + program_[k].mask );
+    }
+    return out.str();
+  }
+
+  /**
+   * evaluate voxels [first, first+n) of the masks into out (as 0 or 1), with
+   * scratch holding at least depth() * n bytes.
+   */
+  void evaluate(const std::vector<const unsigned char *> & masks, unsigned char * out, size_t first, size_t n,
+                unsigned char * scratch) const
+  {
+    unsigned char * top = scratch - n; // the stack grows by n bytes an entry
+    for(size_t k=0; k<program_.size(); ++k)
+    {
+      const Instruction & instruction = program_[k];
+      switch( instruction.code )
+      {
+        case LOAD:
+        {
+          top += n;
+          const unsigned char * in = masks[instruction.mask] + first;
+          for(size_t v=0; v<n; ++v) top[v] = in[v] != 0;
+          break;
+        }
+        case NOT:
+          for(size_t v=0; v<n; ++v) top[v] ^= 1;
+          break;
+        case AND:
+          top -= n;
+          for(size_t v=0; v<n; ++v) top[v] &= top[v+n];
+          break;
+        case XOR:
+          top -= n;
+          for(size_t v=0; v<n; ++v) top[v] ^= top[v+n];
+          break;
+        case OR:
+          top -= n;
+          for(size_t v=0; v<n; ++v) top[v] |= top[v+n];
+          break;
+      }
+    }
+    std::copy( scratch, scratch + n, out + first );
+  }
+
+private:
+  bool fail(const std::string & message)
+  {
+    std::ostringstream out;
+    out << message << " at position " << position_ + 1 << " of \"" << text_ << "\"";
+    error_ = out.str();
+    return false;
+  }
+
+  void skipSpaces()
+  {
+    while( position_ < text_.size() && ( text_[position_] == ' ' || text_[position_] == '\t' ) ) ++position_;
+  }
+
+  /** true (and past it) if the next character is c. */
+  bool accept(char c)
+  {
+    skipSpaces();
+    if( position_ < text_.size() && text_[position_] == c )
+    {
+      ++position_;
+      return true;
+    }
+    return false;
+  }
+
+  // one function per precedence level, each emitting its operands before itself.
+  bool parseOr()
+  {
+    if( !parseXor() ) return false;
+    while( accept( '|' ) )
+    {
+      if( !parseXor() ) return false;
+      program_.push_back( Instruction(OR) );
+    }
+    return true;
+  }
+
+  bool parseXor()
+  {
+    if( !parseAnd() ) return false;
+    while( accept( '^' ) )
+    {
+      if( !parseAnd() ) return false;
+      program_.push_back( Instruction(XOR) );
+    }
+    return true;
+  }
+
+  bool parseAnd()
+  {
+    if( !parseUnary() ) return false;
+    while( accept( '&' ) )
+    {
+      if( !parseUnary() ) return false;
+      program_.push_back( Instruction(AND) );
+    }
+    return true;
+  }
+
+  bool parseUnary()
+  {
+    if( accept( '~' ) || accept( '!' ) )
+    {
+      if( !parseUnary() ) return false;
+      program_.push_back( Instruction(NOT) );
+      return true;
+    }
+    if( accept( '(' ) )
+    {
+      if( !parseOr() ) return false;
+      if( !accept( ')' ) ) return fail( "missing ')'" );
+      return true;
+    }
+    skipSpaces();
+    if( position_ >= text_.size() ) return fail( "missing a mask" );
+    const char name = text_[position_];
+    if( name < 'a' || name > 'z' ) return fail( "expected a mask (a, b, ...)" );
+    const size_t mask = name - 'a';
+    if( mask >= masks_ ) return fail( std::string("no input for mask ") + name );
+    ++position_;
+    used_[mask] = true;
+    program_.push_back( Instruction(LOAD, mask) );
+    return true;
+  }
+
+  std::string text_;
+  size_t masks_;
+  size_t position_;
+  std::vector<Instruction> program_;
+  size_t depth_;
+  std::vector<bool> used_;
+  std::string error_;
+};
+
+/**
+ * ExpressionFunctor - common::each functor that evaluates a MaskExpression over the
+ * image buffers, one block of voxels per job.
+ */
+struct ExpressionFunctor
+{
+  static const size_t BlockVoxels = 4096;
+
+  const MaskExpression & expression_;
+  const std::vector<const unsigned char *> & masks_;
+  unsigned char * out_;
+  size_t voxels_;
+
+  ExpressionFunctor(const MaskExpression & expression, const std::vector<const unsigned char *> & masks,
+                    unsigned char * out, size_t voxels)
+  :expression_(expression),
+   masks_(masks),
+   out_(out),
+   voxels_(voxels)
+  {}
+
+  size_t jobs() const { return ( voxels_ + BlockVoxels - 1 ) / BlockVoxels; }
+
+  void operator()(size_t job)
+  {
+    const size_t first = job * BlockVoxels;
+    const size_t n = std::min( first + BlockVoxels, voxels_ ) - first;
+    std::vector<unsigned char> scratch( expression_.depth() * n );
+    expression_.evaluate( masks_, out_, first, n, &scratch[0] );
+  }
+};
+
+/** evaluate expression over voxels voxels of masks into out, in one pass over numThreads threads. */
+inline void evaluate(const MaskExpression & expression, const std::vector<const unsigned char *> & masks,
+                     unsigned char * out, size_t voxels, size_t numThreads)
+{
+  ExpressionFunctor functor( expression, masks, out, voxels );
+  each<ExpressionFunctor>::run( functor, functor.jobs(), numThreads );
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __MemoryUsage_H
+#define __MemoryUsage_H
+
+#include <string>
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+namespace common
+{
+
+/** peak resident set size of this process so far, in bytes (0 if unknown). */
+inline size_t peakRSS()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof(counters) ) ) return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if( getrusage( RUSAGE_SELF, &usage ) != 0 ) return 0;
+#ifdef __APPLE__
+  return static_cast<size_t>( usage.ru_maxrss );        // bytes
+#else
+  return static_cast<size_t>( usage.ru_maxrss ) * 1024; // kilobytes
+#endif
+#endif
+}
+
+/** print the peak RSS to stderr, tagged with where we are. */
+inline void reportPeakRSS(const std::string & when)
+{
+  std::cerr << "peak RSS " << when << ": " << peakRSS() / (1024.0*1024.0) << " MB" << std::endl;
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __MultiLabelStaple_H
+#define __MultiLabelStaple_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <ostream>
+
+#include <itkImage.h>
+#include <itkTimeProbe.h>
+
+#include "map.h"
+#include "StapleEM.h"
+
+/**
+ * Multi-label STAPLE, as in itk::MultiLabelSTAPLEImageFilter: every rater has a
+ * confusion matrix theta(k,l) = P(rater says k | true label is l), the truth has
+ * a prior per label, and EM alternates
+ *   E-step: W(x,l) ~ prior(l) * prod_r theta_r( D_r(x), l )
+ *   M-step: theta_r(k,l) = sum_{x: D_r(x)=k} W(x,l) / sum_x W(x,l)
+ * The E-step weights are never stored: each pass computes W for a voxel and adds
+ * it straight into the M-step sums, so one pass over the labels is one iteration.
+ */
+namespace staple
+{
+
+/**
+ * MultiLabelParameters - per-rater confusion matrices and label priors.
+ */
+struct MultiLabelParameters
+{
+  MultiLabelParameters(size_t raters = 0, size_t labels = 0)
+  :labels(labels),
+   confusion(raters*labels*labels, 0.0),
+   prior(labels, 0.0),
+   iterations(0)
+  {}
+
+  size_t labels;
+  std::vector<double> confusion; // theta_r(k,l) at (r*labels + k)*labels + l
+  std::vector<double> prior;     // P(true label is l)
+  unsigned int iterations;
+
+  double theta(size_t r, size_t k, size_t l) const { return confusion[(r*labels + k)*labels + l]; }
+};
+
+/**
+ * MultiLabelEngine - multi-label STAPLE over label images with a compact label type
+ * (unsigned char or unsigned short).  Every pass is a common::reduce over the raw
+ * buffers, with per-thread sums merged at the end.
+ */
+template < class LabelImageType >
+class MultiLabelEngine
+{
+public:
+  typedef typename LabelImageType::Pointer LabelImagePointer;
+  typedef typename LabelImageType::ConstPointer LabelImageConstPointer;
+  typedef typename LabelImageType::PixelType LabelType;
+  typedef typename LabelImageType::RegionType RegionType;
+  typedef typename LabelImageType::IndexType IndexType;
+
+  /** M-step sums: sum W(x,l) per rater and rater label k, then sum W(x,l). */
+  struct Sums
+  {
+    std::vector<double> counts; // at (r*labels + k)*labels + l
+    std::vector<double> total;  // at l
+    std::vector<double> votes;  // label frequencies over all raters, seed pass only
+  };
+  typedef std::vector<Sums> SumsList;
+
+  MultiLabelEngine(const std::vector<LabelImagePointer> & raters, size_t labels, size_t numThreads)
+  :raters_(raters),
+   labels_(labels),
+   numThreads_(numThreads),
+   params_(0),
+   output_(0)
+  {}
+
+  size_t raters() const { return raters_.size(); }
+  size_t labels() const { return labels_; }
+  size_t voxels() const { return raters_[0]->GetLargestPossibleRegion().GetNumberOfPixels(); }
+
+  /** label written where two labels tie for the highest weight. */
+  LabelType undecided() const { return static_cast<LabelType>(labels_); }
+
+  /**
+   * run EM until no confusion matrix entry moves more than controls.tolerance, or
+   * controls.maximumIterations.  Starts from the soft vote (the share of raters that
+   * voted each label), with label priors from the label frequencies of all raters.
+   */
+  void estimate(MultiLabelParameters & params, const Controls & controls)
+  {
+    const size_t R = raters_.size();
+    const size_t L = labels_;
+    params = MultiLabelParameters( R, L );
+
+    params_ = 0;
+    Sums sums = run();
+    double votes = 0;
+    for(size_t l=0; l<L; ++l) votes += sums.votes[l];
+    for(size_t l=0; l<L; ++l) params.prior[l] = sums.votes[l] / votes;
+
+    std::vector<double> last;
+    double elapsed = 0;
+    unsigned int iter = 0;
+    for(iter = 0; iter < controls.maximumIterations; ++iter)
+    {
+      itk::TimeProbe probe;
+      probe.Start();
+
+      // M-step
+      last = params.confusion;
+      for(size_t r=0; r<R; ++r)
+      {
+        for(size_t k=0; k<L; ++k)
+        {
+          for(size_t l=0; l<L; ++l)
+          {
+            const size_t at = (r*L + k)*L + l;
+            params.confusion[at] = sums.total[l] > 0 ? sums.counts[at] / sums.total[l] : ( k == l ? 1.0 : 0.0 );
+          }
+        }
+      }
+
+      // E-step, fused with the sums for the next M-step
+      params_ = &params;
+      sums = run();
+
+      double delta = 0;
+      for(size_t n=0; n<last.size(); ++n) delta = std::max( delta, std::fabs( params.confusion[n] - last[n] ) );
+      probe.Stop();
+
+      if(controls.trace)
+      {
+        const double seconds = probe.GetTotal();
+        elapsed += seconds;
+        *controls.trace << "{\"run\":\"" << controls.label << "\",\"iteration\":" << iter
+                        << ",\"seconds\":" << seconds << ",\"elapsed\":" << elapsed
+                        << ",\"max_delta_confusion\":" << delta
+                        << ",\"voxels_per_second\":" << ( seconds > 0 ? voxels() / seconds : 0.0 )
+                        << "}" << std::endl;
+      }
+      if(iter > 0 && delta <= controls.tolerance) break;
+    }
+    params.iterations = iter;
+  }
+
+  /** the label with the highest weight under params, per voxel. */
+  LabelImagePointer GetOutput(const MultiLabelParameters & params)
+  {
+    LabelImagePointer output = LabelImageType::New();
+    output->SetRegions( raters_[0]->GetLargestPossibleRegion() );
+    output->Allocate();
+    output->SetOrigin( raters_[0]->GetOrigin() );
+    output->SetSpacing( raters_[0]->GetSpacing() );
+    output->SetDirection( raters_[0]->GetDirection() );
+    params_ = &params;
+    output_ = output->GetBufferPointer();
+    run();
+    output_ = 0;
+    return output;
+  }
+
+  // common::reduce interface
+  Sums operator()(const LabelImageConstPointer & in, const RegionType & threadRegion)
+  {
+    const size_t R = raters_.size();
+    const size_t L = labels_;
+    Sums sums;
+    if(threadRegion.GetNumberOfPixels() == 0) return sums;
+    sums.counts.assign( R*L*L, 0.0 );
+    sums.total.assign( L, 0.0 );
+    sums.votes.assign( L, 0.0 );
+
+    std::vector<const LabelType *> buffers(R);
+    for(size_t r=0; r<R; ++r) buffers[r] = raters_[r]->GetBufferPointer();
+    std::vector<double> w(L);
+
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    IndexType line = start;
+    for(size_t n=0; n<lines; ++n)
+    {
+      const size_t begin = raters_[0]->ComputeOffset(line);
+      for(size_t v=begin; v<begin+lineLength; ++v)
+      {
+        if(params_)
+        {
+          // E-step: prior times the likelihood of every rater's label
+          for(size_t l=0; l<L; ++l) w[l] = params_->prior[l];
+          for(size_t r=0; r<R; ++r)
+          {
+            const double * theta = &params_->confusion[ (r*L + buffers[r][v])*L ];
+            for(size_t l=0; l<L; ++l) w[l] *= theta[l];
+          }
+        }
+        else
+        {
+          // seed: soft vote
+          std::fill( w.begin(), w.end(), 0.0 );
+          for(size_t r=0; r<R; ++r) w[ buffers[r][v] ] += 1.0;
+          for(size_t l=0; l<L; ++l) sums.votes[l] += w[l];
+        }
+
+        if(output_)
+        {
+          size_t best = 0;
+          bool tie = false;
+          for(size_t l=1; l<L; ++l)
+          {
+            if(w[l] > w[best]) { best = l; tie = false; }
+            else if(w[l] == w[best]) tie = true;
+          }
+          output_[v] = tie ? undecided() : static_cast<LabelType>(best);
+          continue;
+        }
+
+        double norm = 0;
+        for(size_t l=0; l<L; ++l) norm += w[l];
+        if(norm <= 0) continue;
+        for(size_t l=0; l<L; ++l)
+        {
+          w[l] /= norm;
+          sums.total[l] += w[l];
+        }
+        // M-step sums
+        for(size_t r=0; r<R; ++r)
+        {
+          double * counts = &sums.counts[ (r*L + buffers[r][v])*L ];
+          for(size_t l=0; l<L; ++l) counts[l] += w[l];
+        }
+      }
+      for(unsigned int d=1; d<LabelImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+    return sums;
+  }
+
+  Sums operator()(const SumsList & partial)
+  {
+    Sums sums;
+    for(size_t t=0; t<partial.size(); ++t)
+    {
+      if(partial[t].counts.empty()) continue; // unused thread
+      if(sums.counts.empty())
+      {
+        sums = partial[t];
+        continue;
+      }
+      for(size_t n=0; n<sums.counts.size(); ++n) sums.counts[n] += partial[t].counts[n];
+      for(size_t l=0; l<labels_; ++l)
+      {
+        sums.total[l] += partial[t].total[l];
+        sums.votes[l] += partial[t].votes[l];
+      }
+    }
+    return sums;
+  }
+
+private:
+  Sums run()
+  {
+    return common::reduce<LabelImageType,Sums,MultiLabelEngine>::run( raters_[0].GetPointer(), *this, numThreads_ );
+  }
+
+  std::vector<LabelImagePointer> raters_;
+  size_t labels_;
+  size_t numThreads_;
+  const MultiLabelParameters * params_;
+  LabelType * output_;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,581 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __NrrdStream_H
+#define __NrrdStream_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <sstream>
+#include <cmath>
+
+#include <itkImage.h>
+#include <itk_zlib.h>
+
+namespace common
+{
+
+/**
+ * NrrdTypeName - nrrd "type:" field of a pixel type.
+ */
+template < class T > struct NrrdTypeName;
+template <> struct NrrdTypeName<char>           { static const char * name() { return "signed char"; } };
+template <> struct NrrdTypeName<signed char>    { static const char * name() { return "signed char"; } };
+template <> struct NrrdTypeName<unsigned char>  { static const char * name() { return "uchar"; } };
+template <> struct NrrdTypeName<short>          { static const char * name() { return "short"; } };
+template <> struct NrrdTypeName<unsigned short> { static const char * name() { return "ushort"; } };
+template <> struct NrrdTypeName<int>            { static const char * name() { return "int"; } };
+template <> struct NrrdTypeName<unsigned int>   { static const char * name() { return "uint"; } };
+template <> struct NrrdTypeName<float>          { static const char * name() { return "float"; } };
+template <> struct NrrdTypeName<double>         { static const char * name() { return "double"; } };
+
+/**
+ * NrrdStreamWriter - writes a nrrd file front to back, without holding the volume in memory.
+ *
+ * Data is handed over in file order with write() (voxels) and zeros() (a run of
+ * zero voxels, which never needs a buffer of its own).  With compression on the
+ * data goes through one gzip stream, the same encoding itk's nrrd writer uses.
+ */
+template < class PixelType, unsigned int Dimension >
+class NrrdStreamWriter
+{
+public:
+  typedef itk::Image<PixelType, Dimension> ImageType;
+  typedef typename ImageType::SizeType SizeType;
+  typedef typename ImageType::PointType PointType;
+  typedef typename ImageType::SpacingType SpacingType;
+  typedef typename ImageType::DirectionType DirectionType;
+
+  static const size_t BufferBytes = 1 << 18;
+
+  NrrdStreamWriter()
+  :file_(0),
+   compress_(true),
+   ok_(false)
+  {}
+
+  ~NrrdStreamWriter() { close(); }
+
+  /** write the header of a volume of the given size and geometry, true on success. */
+  bool open(const std::string & filename, const SizeType & size, const PointType & origin,
+            const SpacingType & spacing, const DirectionType & direction, bool compress)
+  {
+    close();
+    filename_ = filename;
+    compress_ = compress;
+    file_ = fopen( filename.c_str(), "wb" );
+    if(!file_)
+    {
+      std::cerr << "Error: could not open " << filename << " for writing." << std::endl;
+      return false;
+    }
+
+    const unsigned short probe = 1;
+    const bool little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+    fprintf( file_, "NRRD0004\n" );
+    fprintf( file_, "# Complete NRRD file format specification at:\n" );
+    fprintf( file_, "# http://teem.sourceforge.net/nrrd/format.html\n" );
+    fprintf( file_, "type: %s\n", NrrdTypeName<PixelType>::name() );
+    fprintf( file_, "dimension: %u\n", Dimension );
+    if(Dimension == 3) fprintf( file_, "space: left-posterior-superior\n" );
+    else               fprintf( file_, "space dimension: %u\n", Dimension );
+    fprintf( file_, "sizes:" );
+    for(unsigned int d=0; d<Dimension; ++d) fprintf( file_, " %lu", static_cast<unsigned long>(size[d]) );
+    fprintf( file_, "\nspace directions:" );
+    for(unsigned int d=0; d<Dimension; ++d)
+    {
+      fprintf( file_, " (" );
+      for(unsigned int k=0; k<Dimension; ++k) fprintf( file_, "%s%.17g", k ? "," : "", direction[k][d] * spacing[d] );
+      fprintf( file_, ")" );
+    }
+    fprintf( file_, "\nkinds:" );
+    for(unsigned int d=0; d<Dimension; ++d) fprintf( file_, " domain" );
+    fprintf( file_, "\nendian: %s\n", little ? "little" : "big" );
+    fprintf( file_, "encoding: %s\n", compress_ ? "gzip" : "raw" );
+    fprintf( file_, "space origin: (" );
+    for(unsigned int d=0; d<Dimension; ++d) fprintf( file_, "%s%.17g", d ? "," : "", origin[d] );
+    fprintf( file_, ")\n\n" );
+
+    ok_ = true;
+    if(compress_)
+    {
+      stream_.zalloc = Z_NULL;
+      stream_.zfree = Z_NULL;
+      stream_.opaque = Z_NULL;
+      // 15+16 window bits: gzip wrapper, as nrrd's gzip encoding expects.
+      if(deflateInit2( &stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY ) != Z_OK)
+      {
+        std::cerr << "Error: could not start compression of " << filename << std::endl;
+        ok_ = false;
+      }
+      out_.resize( BufferBytes );
+    }
+    zeros_.assign( BufferBytes / sizeof(PixelType), PixelType(0) );
+    return ok_;
+  }
+
+  /** append count voxels. */
+  bool write(const PixelType * voxels, size_t count)
+  {
+    return put( reinterpret_cast<const unsigned char *>(voxels), count * sizeof(PixelType), Z_NO_FLUSH );
+  }
+
+  /** append count zero voxels. */
+  bool zeros(size_t count)
+  {
+    while(count > 0 && ok_)
+    {
+      const size_t n = std::min( count, zeros_.size() );
+      write( &zeros_[0], n );
+      count -= n;
+    }
+    return ok_;
+  }
+
+  /** finish the file, true if everything was written. */
+  bool close()
+  {
+    if(!file_) return ok_;
+    if(compress_)
+    {
+      if(ok_) put( 0, 0, Z_FINISH );
+      deflateEnd( &stream_ );
+    }
+    if(fclose( file_ ) != 0) ok_ = false;
+    file_ = 0;
+    if(!ok_) std::cerr << "Error: failed writing " << filename_ << std::endl;
+    return ok_;
+  }
+
+private:
+  bool put(const unsigned char * data, size_t bytes, int flush)
+  {
+    if(!ok_) return false;
+    if(!compress_)
+    {
+      if(bytes > 0 && fwrite( data, 1, bytes, file_ ) != bytes) ok_ = false;
+      return ok_;
+    }
+    // zlib counts in unsigned int, feed it in pieces.
+    do
+    {
+      const size_t piece = std::min<size_t>( bytes, 1u << 30 );
+      stream_.next_in = const_cast<unsigned char *>(data);
+      stream_.avail_in = static_cast<unsigned int>(piece);
+      const int mode = piece == bytes ? flush : Z_NO_FLUSH;
+      int result;
+      do
+      {
+        stream_.next_out = &out_[0];
+        stream_.avail_out = static_cast<unsigned int>( out_.size() );
+        result = deflate( &stream_, mode );
+        const size_t have = out_.size() - stream_.avail_out;
+        if(result == Z_STREAM_ERROR || fwrite( &out_[0], 1, have, file_ ) != have)
+        {
+          ok_ = false;
+          return false;
+        }
+      } while(stream_.avail_out == 0 || ( mode == Z_FINISH && result != Z_STREAM_END ));
+      data += piece;
+      bytes -= piece;
+    } while(bytes > 0);
+    return ok_;
+  }
+
+  FILE * file_;
+  std::string filename_;
+  bool compress_;
+  bool ok_;
+  z_stream stream_;
+  std::vector<unsigned char> out_;
+  std::vector<PixelType> zeros_;
+};
+
+/**
+ * writePaddedNrrd - write image as the sub-volume starting at placement of a volume
+ * of the given size and origin (spacing and direction are the image's), everything
+ * around it zero.
+ *
+ * The file is streamed line by line: runs of zero lines and slabs go straight to
+ * the encoder, and only image's own buffer is ever read, so no full-size volume
+ * is allocated.
+ */
+template < class ImageType >
+bool writePaddedNrrd(const std::string & filename, const ImageType * image,
+                     const typename ImageType::IndexType & placement,
+                     const typename ImageType::SizeType & size,
+                     const typename ImageType::PointType & origin,
+                     bool compress = true)
+{
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef typename ImageType::SizeType SizeType;
+  const unsigned int Dimension = ImageType::ImageDimension;
+
+  NrrdStreamWriter<PixelType, Dimension> writer;
+  if(!writer.open( filename, size, origin, image->GetSpacing(), image->GetDirection(), compress )) return false;
+
+  const typename ImageType::RegionType region = image->GetBufferedRegion();
+  const SizeType inner = region.GetSize();
+  const PixelType * buffer = image->GetBufferPointer();
+
+  size_t lines = 1;
+  for(unsigned int d=1; d<Dimension; ++d) lines *= size[d];
+  const size_t before = placement[0];
+  const size_t after = size[0] - before - inner[0];
+
+  // zeros are only counted, and emitted in one run when image data comes next.
+  size_t pending = 0;
+  IndexType line;
+  line.Fill(0);
+  for(size_t l=0; l<lines; ++l)
+  {
+    bool inside = true;
+    for(unsigned int d=1; d<Dimension && inside; ++d)
+    {
+      inside = line[d] >= placement[d] && line[d] < placement[d] + static_cast<long>(inner[d]);
+    }
+    if(!inside)
+    {
+      pending += size[0];
+    }
+    else
+    {
+      IndexType first = region.GetIndex();
+      for(unsigned int d=1; d<Dimension; ++d) first[d] += line[d] - placement[d];
+      writer.zeros( pending + before );
+      writer.write( buffer + image->ComputeOffset(first), inner[0] );
+      pending = after;
+    }
+    for(unsigned int d=1; d<Dimension; ++d)
+    {
+      if(++line[d] < static_cast<long>(size[d])) break;
+      line[d] = 0;
+    }
+  }
+  writer.zeros( pending );
+  return writer.close();
+}
+
+/**
+ * NrrdStreamReader - reads the voxels of a nrrd file front to back, a piece at a time,
+ * without holding the volume in memory.
+ *
+ * Handles attached headers with raw or gzip encoding in either byte order, the way
+ * itk's nrrd reader lays out the geometry (an RAS space is turned into LPS).
+ */
+class NrrdStreamReader
+{
+public:
+  enum Component { UNKNOWN, CHAR, UCHAR, SHORT, USHORT, INT, UINT, FLOAT, DOUBLE };
+
+  static const size_t BufferBytes = 1 << 18;
+
+  NrrdStreamReader()
+  :file_(0),
+   component_(UNKNOWN),
+   componentSize_(0),
+   compressed_(false),
+   swap_(false),
+   ok_(false),
+   inflating_(false)
+  {}
+
+  ~NrrdStreamReader() { close(); }
+
+  /** read the header of filename, true on success. */
+  bool open(const std::string & filename)
+  {
+    close();
+    filename_ = filename;
+    file_ = fopen( filename.c_str(), "rb" );
+    if(!file_)
+    {
+      std::cerr << "Error: could not open " << filename << " for reading." << std::endl;
+      return false;
+    }
+    ok_ = readHeader();
+    if(!ok_) return false;
+
+    if(compressed_)
+    {
+      stream_.zalloc = Z_NULL;
+      stream_.zfree = Z_NULL;
+      stream_.opaque = Z_NULL;
+      stream_.next_in = Z_NULL;
+      stream_.avail_in = 0;
+      // 15+32 window bits: gzip or zlib wrapper, detected from the data.
+      if(inflateInit2( &stream_, 15+32 ) != Z_OK)
+      {
+        std::cerr << "Error: could not start decompression of " << filename << std::endl;
+        ok_ = false;
+        return false;
+      }
+      inflating_ = true;
+      in_.resize( BufferBytes );
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if(inflating_) inflateEnd( &stream_ );
+    inflating_ = false;
+    if(file_) fclose( file_ );
+    file_ = 0;
+  }
+
+  const std::string & filename() const { return filename_; }
+  Component component() const { return component_; }
+  size_t componentSize() const { return componentSize_; }
+  unsigned int dimension() const { return static_cast<unsigned int>( sizes_.size() ); }
+  size_t size(unsigned int d) const { return sizes_[d]; }
+  size_t voxels() const
+  {
+    size_t n = 1;
+    for(size_t d=0; d<sizes_.size(); ++d) n *= sizes_[d];
+    return n;
+  }
+  double spacing(unsigned int d) const { return spacing_[d]; }
+  double origin(unsigned int d) const { return origin_[d]; }
+  /** component k of the unit vector of axis d, like itk's direction[k][d]. */
+  double direction(unsigned int k, unsigned int d) const { return direction_[d][k]; }
+
+  /** the next count voxels in their stored type, in host byte order. */
+  bool read(void * voxels, size_t count)
+  {
+    unsigned char * out = static_cast<unsigned char *>(voxels);
+    const size_t bytes = count * componentSize_;
+    if(!get( out, bytes )) return false;
+    if(swap_)
+    {
+      for(size_t v=0; v<bytes; v+=componentSize_) std::reverse( out + v, out + v + componentSize_ );
+    }
+    return true;
+  }
+
+  /** the next count voxels, converted to T. */
+  template < class T >
+  bool readAs(T * voxels, size_t count)
+  {
+    std::vector<unsigned char> & raw = raw_;
+    const size_t piece = std::max<size_t>( 1, BufferBytes / componentSize_ );
+    while(count > 0)
+    {
+      const size_t n = std::min( count, piece );
+      raw.resize( n * componentSize_ );
+      if(!read( &raw[0], n )) return false;
+      switch(component_)
+      {
+        case CHAR:   convert( reinterpret_cast<const signed char *>(&raw[0]), voxels, n ); break;
+        case UCHAR:  convert( reinterpret_cast<const unsigned char *>(&raw[0]), voxels, n ); break;
+        case SHORT:  convert( reinterpret_cast<const short *>(&raw[0]), voxels, n ); break;
+        case USHORT: convert( reinterpret_cast<const unsigned short *>(&raw[0]), voxels, n ); break;
+        case INT:    convert( reinterpret_cast<const int *>(&raw[0]), voxels, n ); break;
+        case UINT:   convert( reinterpret_cast<const unsigned int *>(&raw[0]), voxels, n ); break;
+        case FLOAT:  convert( reinterpret_cast<const float *>(&raw[0]), voxels, n ); break;
+        case DOUBLE: convert( reinterpret_cast<const double *>(&raw[0]), voxels, n ); break;
+        default: return false;
+      }
+      voxels += n;
+      count -= n;
+    }
+    return true;
+  }
+
+private:
+  template < class S, class T >
+  static void convert(const S * in, T * out, size_t n)
+  {
+    for(size_t v=0; v<n; ++v) out[v] = static_cast<T>( in[v] );
+  }
+
+  static std::string trim(const std::string & s)
+  {
+    const size_t first = s.find_first_not_of( " \t\r" );
+    if(first == std::string::npos) return std::string();
+    return s.substr( first, s.find_last_not_of( " \t\r" ) - first + 1 );
+  }
+
+  /** the numbers of a "(x,y,z)" vector, empty for "none". */
+  static std::vector<double> vector(const std::string & s)
+  {
+    std::vector<double> v;
+    std::string numbers = s;
+    for(size_t c=0; c<numbers.size(); ++c) if(numbers[c] == '(' || numbers[c] == ')' || numbers[c] == ',') numbers[c] = ' ';
+    std::istringstream in( numbers );
+    double x;
+    while(in >> x) v.push_back( x );
+    return v;
+  }
+
+  bool fail(const std::string & message)
+  {
+    std::cerr << "Error: " << filename_ << ": " << message << std::endl;
+    return false;
+  }
+
+  bool readHeader()
+  {
+    std::string line;
+    if(!getLine( line ) || line.compare( 0, 4, "NRRD" ) != 0) return fail( "not a nrrd file" );
+
+    std::string type, encoding = "raw", endian = "little", space;
+    std::vector<std::string> directions;
+    std::vector<double> spacings, origin;
+    while(getLine( line ))
+    {
+      if(trim( line ).empty()) break;
+      if(line[0] == '#') continue;
+      size_t colon = line.find( ':' );
+      if(colon == std::string::npos) continue;
+      const std::string key = line.substr( 0, colon );
+      std::string value = line.substr( colon + 1 );
+      if(!value.empty() && value[0] == '=') continue; // key/value pair
+      value = trim( value );
+
+      if(key == "type") type = value;
+      else if(key == "encoding") encoding = value;
+      else if(key == "endian") endian = value;
+      else if(key == "space") space = value;
+      else if(key == "sizes")
+      {
+        std::istringstream in( value );
+        size_t n;
+        while(in >> n) sizes_.push_back( n );
+      }
+      else if(key == "spacings") spacings = vector( value );
+      else if(key == "space origin") origin = vector( value );
+      else if(key == "space directions")
+      {
+        std::istringstream in( value );
+        std::string v;
+        while(in >> v) directions.push_back( v );
+      }
+      else if(key == "data file" || key == "datafile") return fail( "detached data files are not supported" );
+      else if(key == "line skip" || key == "lineskip" || key == "byte skip" || key == "byteskip")
+      {
+        if(atoi( value.c_str() ) != 0) return fail( "skips are not supported" );
+      }
+    }
+
+    if(type == "signed char" || type == "int8" || type == "int8_t") component_ = CHAR;
+    else if(type == "uchar" || type == "unsigned char" || type == "uint8" || type == "uint8_t") component_ = UCHAR;
+    else if(type == "short" || type == "short int" || type == "signed short" || type == "signed short int" ||
+            type == "int16" || type == "int16_t") component_ = SHORT;
+    else if(type == "ushort" || type == "unsigned short" || type == "unsigned short int" ||
+            type == "uint16" || type == "uint16_t") component_ = USHORT;
+    else if(type == "int" || type == "signed int" || type == "int32" || type == "int32_t") component_ = INT;
+    else if(type == "uint" || type == "unsigned int" || type == "uint32" || type == "uint32_t") component_ = UINT;
+    else if(type == "float") component_ = FLOAT;
+    else if(type == "double") component_ = DOUBLE;
+    else return fail( "unsupported type " + type );
+    const size_t componentSizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    componentSize_ = componentSizes[component_];
+
+    if(encoding == "gzip" || encoding == "gz") compressed_ = true;
+    else if(encoding != "raw") return fail( "unsupported encoding " + encoding );
+
+    const unsigned short probe = 1;
+    const bool little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+    swap_ = componentSize_ > 1 && ( endian == "little" ) != little;
+
+    const unsigned int dim = static_cast<unsigned int>( sizes_.size() );
+    if(dim == 0) return fail( "no sizes" );
+    spacing_.assign( dim, 1.0 );
+    origin_.assign( dim, 0.0 );
+    direction_.assign( dim, std::vector<double>( dim, 0.0 ) );
+    for(unsigned int d=0; d<dim; ++d) direction_[d][d] = 1.0;
+    for(unsigned int d=0; d<dim && d<spacings.size(); ++d) spacing_[d] = spacings[d];
+    for(unsigned int d=0; d<dim && d<directions.size(); ++d)
+    {
+      std::vector<double> axis = vector( directions[d] );
+      if(axis.size() != dim) continue;
+      double length = 0;
+      for(unsigned int k=0; k<dim; ++k) length += axis[k]*axis[k];
+      length = std::sqrt( length );
+      if(length == 0) continue;
+      spacing_[d] = length;
+      for(unsigned int k=0; k<dim; ++k) direction_[d][k] = axis[k] / length;
+    }
+    for(unsigned int d=0; d<dim && d<origin.size(); ++d) origin_[d] = origin[d];
+
+    // itk works in LPS.
+    if(space == "right-anterior-superior" || space == "RAS")
+    {
+      for(unsigned int k=0; k<2 && k<dim; ++k)
+      {
+        origin_[k] = -origin_[k];
+        for(unsigned int d=0; d<dim; ++d) direction_[d][k] = -direction_[d][k];
+      }
+    }
+    return true;
+  }
+
+  bool getLine(std::string & line)
+  {
+    line.clear();
+    int c;
+    while((c = fgetc( file_ )) != EOF)
+    {
+      if(c == '\n') return true;
+      line += static_cast<char>(c);
+    }
+    return !line.empty();
+  }
+
+  bool get(unsigned char * out, size_t bytes)
+  {
+    if(!ok_) return false;
+    if(!compressed_)
+    {
+      if(bytes > 0 && fread( out, 1, bytes, file_ ) != bytes) ok_ = fail( "unexpected end of data" );
+      return ok_;
+    }
+    while(bytes > 0)
+    {
+      if(stream_.avail_in == 0)
+      {
+        const size_t have = fread( &in_[0], 1, in_.size(), file_ );
+        if(have == 0) return ok_ = fail( "unexpected end of data" );
+        stream_.next_in = &in_[0];
+        stream_.avail_in = static_cast<unsigned int>( have );
+      }
+      const size_t piece = std::min<size_t>( bytes, 1u << 30 );
+      stream_.next_out = out;
+      stream_.avail_out = static_cast<unsigned int>( piece );
+      const int result = inflate( &stream_, Z_NO_FLUSH );
+      const size_t got = piece - stream_.avail_out;
+      out += got;
+      bytes -= got;
+      if(result == Z_STREAM_END && bytes > 0) return ok_ = fail( "unexpected end of data" );
+      if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) return ok_ = fail( "corrupt gzip data" );
+    }
+    return true;
+  }
+
+  FILE * file_;
+  std::string filename_;
+  Component component_;
+  size_t componentSize_;
+  bool compressed_;
+  bool swap_;
+  bool ok_;
+  bool inflating_;
+  z_stream stream_;
+  std::vector<unsigned char> in_;
+  std::vector<unsigned char> raw_;
+  std::vector<size_t> sizes_;
+  std::vector<double> spacing_;
+  std::vector<double> origin_;
+  std::vector< std::vector<double> > direction_; // unit vector per axis
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __Overlap_H
+#define __Overlap_H
+
+#include <vector>
+#include <algorithm>
+
+#include <itkImage.h>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * OverlapCounts - voxel counts of two masks (a voxel is set when it is > 0).  Like
+ * the original dice, neither counts the voxels that are 0 in both, not the negative.
+ */
+struct OverlapCounts
+{
+  OverlapCounts()
+  :first(0),
+   second(0),
+   both(0),
+   neither(0)
+  {}
+
+  unsigned long long first;   // set in the first mask
+  unsigned long long second;  // set in the second mask
+  unsigned long long both;    // set in both
+  unsigned long long neither; // 0 in both
+
+  void add(const OverlapCounts & other)
+  {
+    first += other.first;
+    second += other.second;
+    both += other.both;
+    neither += other.neither;
+  }
+};
+
+/**
+ * DiceCounts - the confusion counts and the dice overlap (in percent) of two masks
+ * the way dice reports them, the second mask taken as the prediction.  Every tool
+ * that prints dice rows takes them from here, so they can not drift apart.
+ */
+struct DiceCounts
+{
+  DiceCounts(const OverlapCounts & counts, unsigned long long total)
+  :tp(counts.both),
+   fp(counts.second - counts.both),
+   tn(counts.neither),
+   fn(( total - counts.second ) - counts.neither),
+   dice(( 2.0 * counts.both ) / ( counts.first + counts.second ) * 100.0)
+  {}
+
+  unsigned long long tp;
+  unsigned long long fp;
+  unsigned long long tn;
+  unsigned long long fn;
+  double dice;
+};
+
+/**
+ * countSpan - add the overlap counts of n voxels of a and b.  The comparisons are
+ * turned into 0/1 and summed, with no branches, so the loop vectorizes.  A negative
+ * voxel is in neither mask and is not counted in neither, like the original dice.
+ */
+template < class PixelType >
+inline void countSpan(const PixelType * a, const PixelType * b, size_t n, OverlapCounts & counts)
+{
+  unsigned long long first = 0, second = 0, both = 0, neither = 0;
+  for(size_t v=0; v<n; ++v)
+  {
+    const unsigned int x = a[v] > 0, y = b[v] > 0;
+    const unsigned int xz = a[v] == 0, yz = b[v] == 0;
+    first += x;
+    second += y;
+    both += x & y;
+    neither += xz & yz;
+  }
+  counts.first += first;
+  counts.second += second;
+  counts.both += both;
+  counts.neither += neither;
+}
+
+/**
+ * number of the n voxels where one of a and b is > 0 and the other is 0, the test of
+ * the original xoroverlap (a negative voxel is neither), branch-free like countSpan.
+ */
+template < class PixelType >
+inline unsigned long long xorSpan(const PixelType * a, const PixelType * b, size_t n)
+{
+  unsigned long long count = 0;
+  for(size_t v=0; v<n; ++v)
+  {
+    const unsigned int x = a[v] > 0, y = b[v] > 0;
+    const unsigned int xz = a[v] == 0, yz = b[v] == 0;
+    count += ( x & yz ) | ( xz & y );
+  }
+  return count;
+}
+
+/**
+ * OverlapCountFunctor - common::reduce functor that counts the overlap of two images
+ * of the same size, one line span of the raw buffers at a time, per thread.
+ */
+template < class ImageType >
+struct OverlapCountFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+
+  ImagePointer first_;
+  ImagePointer second_;
+
+  OverlapCountFunctor(const ImagePointer & first, const ImagePointer & second)
+  :first_(first),
+   second_(second)
+  {}
+
+  OverlapCounts operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    OverlapCounts counts;
+    if(threadRegion.GetNumberOfPixels() == 0) return counts;
+
+    const PixelType * a = first_->GetBufferPointer();
+    const PixelType * b = second_->GetBufferPointer();
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
+    {
+      const size_t begin = first_->ComputeOffset(line);
+      countSpan( a + begin, b + begin, lineLength, counts );
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+    return counts;
+  }
+
+  OverlapCounts operator()(const std::vector<OverlapCounts> & partial)
+  {
+    OverlapCounts counts;
+    for(size_t t=0; t<partial.size(); ++t) counts.add( partial[t] );
+    return counts;
+  }
+};
+
+/** overlap counts of first and second (same size) over numThreads threads. */
+template < class ImageType >
+OverlapCounts countOverlap(const typename ImageType::Pointer & first, const typename ImageType::Pointer & second,
+                           size_t numThreads)
+{
+  typedef OverlapCountFunctor<ImageType> FunctorType;
+  FunctorType functor( first, second );
+  return reduce<ImageType,OverlapCounts,FunctorType>::run( first.GetPointer(), functor, numThreads );
+}
+
+/**
+ * LabelHistogram - joint histogram of the labels of two label maps: count(a,b) is the
+ * number of voxels labelled a in the first map and b in the second.
+ */
+struct LabelHistogram
+{
+  static const size_t MaximumLabels = 1024;
+
+  LabelHistogram()
+  :labels(0),
+   invalid(0)
+  {}
+
+  size_t labels;                          // labels 0..labels-1
+  std::vector<unsigned long long> counts; // at a*labels + b
+  unsigned long long invalid;             // voxels that are not a label in 0..MaximumLabels-1
+
+  unsigned long long count(size_t a, size_t b) const { return counts[a*labels + b]; }
+
+  /** voxels labelled a in the first / second map. */
+  unsigned long long first(size_t a) const
+  {
+    unsigned long long n = 0;
+    for(size_t b=0; b<labels; ++b) n += count(a,b);
+    return n;
+  }
+  unsigned long long second(size_t b) const
+  {
+    unsigned long long n = 0;
+    for(size_t a=0; a<labels; ++a) n += count(a,b);
+    return n;
+  }
+
+  /** make room for labels 0..n-1, keeping the counts. */
+  void grow(size_t n)
+  {
+    if(n <= labels) return;
+    std::vector<unsigned long long> grown( n * n, 0 );
+    for(size_t a=0; a<labels; ++a)
+    {
+      for(size_t b=0; b<labels; ++b) grown[a*n + b] = counts[a*labels + b];
+    }
+    counts.swap( grown );
+    labels = n;
+  }
+
+  void add(const LabelHistogram & other)
+  {
+    grow( other.labels );
+    for(size_t a=0; a<other.labels; ++a)
+    {
+      for(size_t b=0; b<other.labels; ++b) counts[a*labels + b] += other.counts[a*other.labels + b];
+    }
+    invalid += other.invalid;
+  }
+};
+
+/**
+ * LabelHistogramFunctor - common::reduce functor that builds the joint label histogram
+ * of two label maps of the same size, one histogram per thread, merged at the end.
+ * The histograms grow as larger labels turn up, so no pass is needed to find the
+ * largest label first.
+ */
+template < class ImageType >
+struct LabelHistogramFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+
+  ImagePointer first_;
+  ImagePointer second_;
+
+  LabelHistogramFunctor(const ImagePointer & first, const ImagePointer & second)
+  :first_(first),
+   second_(second)
+  {}
+
+  /** label of value, or MaximumLabels if it is not one. */
+  static size_t label(PixelType value)
+  {
+    const double v = static_cast<double>(value);
+    if(v < 0 || v >= LabelHistogram::MaximumLabels || v != static_cast<double>( static_cast<size_t>(v) ))
+    {
+      return LabelHistogram::MaximumLabels;
+    }
+    return static_cast<size_t>(v);
+  }
+
+  LabelHistogram operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    LabelHistogram histogram;
+    if(threadRegion.GetNumberOfPixels() == 0) return histogram;
+    histogram.grow( 2 );
+
+    const PixelType * a = first_->GetBufferPointer();
+    const PixelType * b = second_->GetBufferPointer();
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
+    {
+      const size_t begin = first_->ComputeOffset(line);
+      for(size_t v=begin; v<begin+lineLength; ++v)
+      {
+        const size_t x = label( a[v] );
+        const size_t y = label( b[v] );
+        if(x >= histogram.labels || y >= histogram.labels)
+        {
+          if(x == LabelHistogram::MaximumLabels || y == LabelHistogram::MaximumLabels)
+          {
+            ++histogram.invalid;
+            continue;
+          }
+          histogram.grow( std::max( x, y ) + 1 );
+        }
+        ++histogram.counts[x*histogram.labels + y];
+      }
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+    return histogram;
+  }
+
+  LabelHistogram operator()(const std::vector<LabelHistogram> & partial)
+  {
+    LabelHistogram histogram;
+    for(size_t t=0; t<partial.size(); ++t) histogram.add( partial[t] );
+    return histogram;
+  }
+};
+
+/** joint label histogram of first and second (same size) over numThreads threads. */
+template < class ImageType >
+LabelHistogram labelHistogram(const typename ImageType::Pointer & first, const typename ImageType::Pointer & second,
+                              size_t numThreads)
+{
+  typedef LabelHistogramFunctor<ImageType> FunctorType;
+  FunctorType functor( first, second );
+  return reduce<ImageType,LabelHistogram,FunctorType>::run( first.GetPointer(), functor, numThreads );
+}
+
+} // end namespace
+
+#endif
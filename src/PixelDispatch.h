@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __PixelDispatch_H
+#define __PixelDispatch_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <itkImage.h>
+#include <itkImageIOBase.h>
+#include <itkImageIOFactory.h>
+
+namespace common
+{
+
+typedef itk::ImageIOBase::IOComponentType ComponentType;
+
+/** pixel component type stored in filename, UNKNOWNCOMPONENTTYPE if it can not be read. */
+inline ComponentType componentType(const std::string & filename)
+{
+  itk::ImageIOBase::Pointer imageIO =
+        itk::ImageIOFactory::CreateImageIO( filename.c_str(), itk::ImageIOFactory::ReadMode );
+  if( imageIO.IsNull() ) return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  try
+  {
+    imageIO->SetFileName( filename );
+    imageIO->ReadImageInformation();
+  }
+  catch( ... )
+  {
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  }
+  return imageIO->GetComponentType();
+}
+
+/** number of voxels stored in filename, 0 if its header can not be read. */
+inline size_t voxelCount(const std::string & filename)
+{
+  itk::ImageIOBase::Pointer imageIO =
+        itk::ImageIOFactory::CreateImageIO( filename.c_str(), itk::ImageIOFactory::ReadMode );
+  if( imageIO.IsNull() ) return 0;
+  try
+  {
+    imageIO->SetFileName( filename );
+    imageIO->ReadImageInformation();
+  }
+  catch( ... )
+  {
+    return 0;
+  }
+  size_t count = 1;
+  for( unsigned int d=0; d<imageIO->GetNumberOfDimensions(); ++d ) count *= imageIO->GetDimensions(d);
+  return count;
+}
+
+/** size and modification time of filename, false if it can not be stat'ed. */
+inline bool fileStamp(const std::string & filename, uint64_t & bytes, int64_t & modified)
+{
+  struct stat info;
+  if( stat( filename.c_str(), &info ) != 0 ) return false;
+  bytes = static_cast<uint64_t>( info.st_size );
+  modified = static_cast<int64_t>( info.st_mtime );
+  return true;
+}
+
+/**
+ * component type shared by all of filenames.  When they differ the images are
+ * read as float, like the tools always used to.
+ */
+inline ComponentType componentType(const std::vector<std::string> & filenames)
+{
+  ComponentType type = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  for( size_t i=0; i<filenames.size(); ++i )
+  {
+    ComponentType next = componentType( filenames[i] );
+    if( next == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE )
+    {
+      std::cerr << "Error: could not read the header of " << filenames[i] << std::endl;
+      return next;
+    }
+    if( i > 0 && next != type ) return itk::ImageIOBase::FLOAT;
+    type = next;
+  }
+  return type;
+}
+
+/**
+ * dispatchScalar - call functor.template run< itk::Image<T,Dimension> >() with T the
+ * pixel type of component, so images are read and processed in the type they are
+ * stored in (a binary mask stays one byte per voxel).  Returns the result of run(),
+ * or 1 after an error message for unsupported types.
+ */
+template < unsigned int Dimension, class TFunctor >
+int dispatchScalar(ComponentType component, TFunctor & functor)
+{
+  switch (component)
+  {
+    case itk::ImageIOBase::UCHAR:
+      return functor.template run< itk::Image<unsigned char,Dimension> >();
+    case itk::ImageIOBase::CHAR:
+      return functor.template run< itk::Image<char,Dimension> >();
+    case itk::ImageIOBase::USHORT:
+      return functor.template run< itk::Image<unsigned short,Dimension> >();
+    case itk::ImageIOBase::SHORT:
+      return functor.template run< itk::Image<short,Dimension> >();
+    case itk::ImageIOBase::UINT:
+      return functor.template run< itk::Image<unsigned int,Dimension> >();
+    case itk::ImageIOBase::INT:
+      return functor.template run< itk::Image<int,Dimension> >();
+    case itk::ImageIOBase::FLOAT:
+      return functor.template run< itk::Image<float,Dimension> >();
+    case itk::ImageIOBase::DOUBLE:
+      return functor.template run< itk::Image<double,Dimension> >();
+
+    default:
+      std::cerr << "Pixel Type not supported. Exiting." << std::endl;
+      return 1;
+  }
+}
+
+} // end namespace
+
+#endif
@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __RunLength_H
+#define __RunLength_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
+
+#include <itkImage.h>
+
+#include "map.h"
+#include "Overlap.h"
+#include "LoadImages.h"
+#include "PixelDispatch.h"
+
+namespace common
+{
+
+/** Run - set voxels [begin,end) of one row. */
+struct Run
+{
+  Run()
+  :begin(0),
+   end(0)
+  {}
+
+  Run(uint32_t b, uint32_t e)
+  :begin(b),
+   end(e)
+  {}
+
+  uint32_t begin;
+  uint32_t end;
+};
+
+/** number of voxels in runs [0,n). */
+inline unsigned long long runLength(const Run * runs, size_t n)
+{
+  unsigned long long length = 0;
+  for(size_t k=0; k<n; ++k) length += runs[k].end - runs[k].begin;
+  return length;
+}
+
+/** number of voxels two sorted run lists of the same row have in common, walked in step. */
+inline unsigned long long intersectionLength(const Run * a, size_t na, const Run * b, size_t nb)
+{
+  unsigned long long length = 0;
+  size_t i = 0, j = 0;
+  while(i < na && j < nb)
+  {
+    const uint32_t lo = std::max( a[i].begin, b[j].begin );
+    const uint32_t hi = std::min( a[i].end, b[j].end );
+    if(lo < hi) length += hi - lo;
+    if(a[i].end < b[j].end) ++i;
+    else ++j;
+  }
+  return length;
+}
+
+/** the runs two sorted run lists of the same row have in common, appended to out. */
+inline void intersect(const Run * a, size_t na, const Run * b, size_t nb, std::vector<Run> & out)
+{
+  size_t i = 0, j = 0;
+  while(i < na && j < nb)
+  {
+    const uint32_t lo = std::max( a[i].begin, b[j].begin );
+    const uint32_t hi = std::min( a[i].end, b[j].end );
+    if(lo < hi) out.push_back( Run(lo, hi) );
+    if(a[i].end < b[j].end) ++i;
+    else ++j;
+  }
+}
+
+/**
+ * RunLengthMask - a binary mask as the runs of set voxels of each row (the lines along
+ * x, in the order of the image buffer).  Most of our masks are background, so this is
+ * far smaller than the voxels and overlaps can be counted run by run.
+ */
+class RunLengthMask
+{
+public:
+  RunLengthMask()
+  :rowStart_(1, 0)
+  {}
+
+  const std::vector<size_t> & size() const { return size_; }
+  size_t rowLength() const { return size_.empty() ? 0 : size_[0]; }
+  size_t rows() const { return rowStart_.size() - 1; }
+  size_t voxels() const { return rowLength() * rows(); }
+  size_t runs() const { return runs_.size(); }
+
+  /** runs of row r, n of them. */
+  const Run * row(size_t r, size_t & n) const
+  {
+    n = rowStart_[r+1] - rowStart_[r];
+    return n == 0 ? 0 : &runs_[rowStart_[r]];
+  }
+
+  /** number of set voxels. */
+  unsigned long long count() const { return runs_.empty() ? 0 : runLength( &runs_[0], runs_.size() ); }
+
+  /** start a mask of the given size with no runs, rows are then added in order with addRow. */
+  void reset(const std::vector<size_t> & size)
+  {
+    size_ = size;
+    runs_.clear();
+    rowStart_.assign( 1, 0 );
+    size_t rows = 1;
+    for(size_t d=1; d<size.size(); ++d) rows *= size[d];
+    rowStart_.reserve( rows + 1 );
+  }
+
+  void addRow(const std::vector<Run> & runs)
+  {
+    runs_.insert( runs_.end(), runs.begin(), runs.end() );
+    rowStart_.push_back( runs_.size() );
+  }
+
+  /** runs of the set voxels of a row of n voxels, a positive voxel (any non-zero one without positiveOnly) is set. */
+  template < class PixelType >
+  static void encodeRow(const PixelType * row, size_t n, bool positiveOnly, std::vector<Run> & runs)
+  {
+    size_t x = 0;
+    while(x < n)
+    {
+      while(x < n && !set( row[x], positiveOnly )) ++x;
+      if(x == n) break;
+      const size_t begin = x;
+      while(x < n && set( row[x], positiveOnly )) ++x;
+      runs.push_back( Run(static_cast<uint32_t>(begin), static_cast<uint32_t>(x)) );
+    }
+  }
+
+  /** runs of the negative voxels of a row of n voxels. */
+  template < class PixelType >
+  static void encodeNegativeRow(const PixelType * row, size_t n, std::vector<Run> & runs)
+  {
+    if(!std::numeric_limits<PixelType>::is_signed) return;
+    size_t x = 0;
+    while(x < n)
+    {
+      while(x < n && !( row[x] < 0 )) ++x;
+      if(x == n) break;
+      const size_t begin = x;
+      while(x < n && row[x] < 0) ++x;
+      runs.push_back( Run(static_cast<uint32_t>(begin), static_cast<uint32_t>(x)) );
+    }
+  }
+
+  /**
+   * write the mask to filename, tagged with the size and modification time of the
+   * file it was encoded from.  The layout is native byte order: it is a cache for
+   * this machine, not an exchange format.
+   */
+  bool write(const std::string & filename, const std::string & source) const;
+
+  /** read a mask written by write(), false if it is missing, unreadable or older than source. */
+  bool read(const std::string & filename, const std::string & source);
+
+private:
+  template < class PixelType >
+  static bool set(PixelType value, bool positiveOnly) { return positiveOnly ? value > 0 : value != 0; }
+
+  std::vector<size_t> size_;
+  std::vector<size_t> rowStart_; // runs of row r are [rowStart_[r], rowStart_[r+1])
+  std::vector<Run> runs_;
+};
+
+static const char RunLengthMagic[8] = { 'R', 'L', 'E', 'M', 'A', 'S', 'K', '1' };
+
+inline bool RunLengthMask::write(const std::string & filename, const std::string & source) const
+{
+  uint64_t bytes = 0;
+  int64_t modified = 0;
+  if( !fileStamp( source, bytes, modified ) ) return false;
+  FILE * out = fopen( filename.c_str(), "wb" );
+  if( !out ) return false;
+
+  bool ok = fwrite( RunLengthMagic, 1, sizeof(RunLengthMagic), out ) == sizeof(RunLengthMagic);
+  ok = ok && fwrite( &bytes, sizeof(bytes), 1, out ) == 1;
+  ok = ok && fwrite( &modified, sizeof(modified), 1, out ) == 1;
+  const uint64_t dimension = size_.size();
+  ok = ok && fwrite( &dimension, sizeof(dimension), 1, out ) == 1;
+  for(size_t d=0; d<size_.size(); ++d)
+  {
+    const uint64_t n = size_[d];
+    ok = ok && fwrite( &n, sizeof(n), 1, out ) == 1;
+  }
+  const uint64_t runs = runs_.size();
+  ok = ok && fwrite( &runs, sizeof(runs), 1, out ) == 1;
+  std::vector<uint32_t> perRow( rows() );
+  for(size_t r=0; r<rows(); ++r) perRow[r] = static_cast<uint32_t>( rowStart_[r+1] - rowStart_[r] );
+  if( !perRow.empty() ) ok = ok && fwrite( &perRow[0], sizeof(uint32_t), perRow.size(), out ) == perRow.size();
+  if( !runs_.empty() ) ok = ok && fwrite( &runs_[0], sizeof(Run), runs_.size(), out ) == runs_.size();
+
+  ok = fclose( out ) == 0 && ok;
+  if( !ok ) remove( filename.c_str() );
+  return ok;
+}
+
+inline bool RunLengthMask::read(const std::string & filename, const std::string & source)
+{
+  uint64_t bytes = 0;
+  int64_t modified = 0;
+  if( !fileStamp( source, bytes, modified ) ) return false;
+  FILE * in = fopen( filename.c_str(), "rb" );
+  if( !in ) return false;
+
+  char magic[sizeof(RunLengthMagic)];
+  uint64_t storedBytes = 0, dimension = 0, runs = 0;
+  int64_t storedModified = 0;
+  bool ok = fread( magic, 1, sizeof(magic), in ) == sizeof(magic)
+            && memcmp( magic, RunLengthMagic, sizeof(magic) ) == 0;
+  ok = ok && fread( &storedBytes, sizeof(storedBytes), 1, in ) == 1 && storedBytes == bytes;
+  ok = ok && fread( &storedModified, sizeof(storedModified), 1, in ) == 1 && storedModified == modified;
+  ok = ok && fread( &dimension, sizeof(dimension), 1, in ) == 1 && dimension > 0 && dimension < 16;
+  std::vector<size_t> size;
+  for(uint64_t d=0; ok && d<dimension; ++d)
+  {
+    uint64_t n = 0;
+    ok = fread( &n, sizeof(n), 1, in ) == 1;
+    size.push_back( static_cast<size_t>(n) );
+  }
+  ok = ok && fread( &runs, sizeof(runs), 1, in ) == 1;
+  if( ok )
+  {
+    reset( size );
+    size_t rows = 1;
+    for(size_t d=1; d<size.size(); ++d) rows *= size[d];
+    std::vector<uint32_t> perRow( rows );
+    runs_.resize( static_cast<size_t>(runs) );
+    if( !perRow.empty() ) ok = fread( &perRow[0], sizeof(uint32_t), perRow.size(), in ) == perRow.size();
+    if( ok && !runs_.empty() ) ok = fread( &runs_[0], sizeof(Run), runs_.size(), in ) == runs_.size();
+    for(size_t r=0; ok && r<perRow.size(); ++r) rowStart_.push_back( rowStart_.back() + perRow[r] );
+    ok = ok && rowStart_.back() == runs_.size();
+  }
+  fclose( in );
+  if( !ok ) reset( std::vector<size_t>() );
+  return ok;
+}
+
+/**
+ * EncodeFunctor - common::each functor that encodes a block of rows of an image
+ * buffer per job, into the job's own run list (and, with negatives, a second list of
+ * the runs of negative voxels).
+ */
+template < class PixelType >
+struct EncodeFunctor
+{
+  static const size_t BlockRows = 1024;
+
+  const PixelType * buffer_;
+  size_t rowLength_;
+  size_t rows_;
+  bool positiveOnly_;
+  bool negatives_;
+  std::vector< std::vector<Run> > runs_;       // per job
+  std::vector< std::vector<uint32_t> > perRow_; // per job, runs of each of its rows
+  std::vector< std::vector<Run> > negativeRuns_;
+  std::vector< std::vector<uint32_t> > negativePerRow_;
+
+  EncodeFunctor(const PixelType * buffer, size_t rowLength, size_t rows, bool positiveOnly, bool negatives)
+  :buffer_(buffer),
+   rowLength_(rowLength),
+   rows_(rows),
+   positiveOnly_(positiveOnly),
+   negatives_(negatives),
+   runs_(jobs()),
+   perRow_(jobs()),
+   negativeRuns_(negatives ? jobs() : 0),
+   negativePerRow_(negatives ? jobs() : 0)
+  {}
+
+  size_t jobs() const { return ( rows_ + BlockRows - 1 ) / BlockRows; }
+
+  void operator()(size_t job)
+  {
+    const size_t last = std::min( (job + 1) * BlockRows, rows_ );
+    for(size_t r=job * BlockRows; r<last; ++r)
+    {
+      const size_t before = runs_[job].size();
+      RunLengthMask::encodeRow( buffer_ + r * rowLength_, rowLength_, positiveOnly_, runs_[job] );
+      perRow_[job].push_back( static_cast<uint32_t>( runs_[job].size() - before ) );
+      if(!negatives_) continue;
+      const size_t negativeBefore = negativeRuns_[job].size();
+      RunLengthMask::encodeNegativeRow( buffer_ + r * rowLength_, rowLength_, negativeRuns_[job] );
+      negativePerRow_[job].push_back( static_cast<uint32_t>( negativeRuns_[job].size() - negativeBefore ) );
+    }
+  }
+};
+
+/** fill mask with the rows of per-job run lists, freeing the lists. */
+inline void addRows(std::vector< std::vector<Run> > & runs, const std::vector< std::vector<uint32_t> > & perRow,
+                    RunLengthMask & mask)
+{
+  std::vector<Run> row;
+  for(size_t job=0; job<runs.size(); ++job)
+  {
+    size_t next = 0;
+    for(size_t r=0; r<perRow[job].size(); ++r)
+    {
+      row.assign( runs[job].begin() + next, runs[job].begin() + next + perRow[job][r] );
+      next += perRow[job][r];
+      mask.addRow( row );
+    }
+    std::vector<Run>().swap( runs[job] );
+  }
+}
+
+/**
+ * run-length encode the buffered region of image, see RunLengthMask::encodeRow for
+ * which voxels are set, and its negative voxels into negatives if that is given.
+ */
+template < class ImageType >
+void encode(const typename ImageType::Pointer & image, RunLengthMask & mask, size_t numThreads, bool positiveOnly = false,
+            RunLengthMask * negatives = 0)
+{
+  typedef typename ImageType::PixelType PixelType;
+  const typename ImageType::SizeType imageSize = image->GetBufferedRegion().GetSize();
+  std::vector<size_t> size;
+  for(unsigned int d=0; d<ImageType::ImageDimension; ++d) size.push_back( imageSize[d] );
+  const size_t rows = image->GetBufferedRegion().GetNumberOfPixels() / size[0];
+
+  EncodeFunctor<PixelType> functor( image->GetBufferPointer(), size[0], rows, positiveOnly, negatives != 0 );
+  each< EncodeFunctor<PixelType> >::run( functor, functor.jobs(), numThreads );
+
+  mask.reset( size );
+  addRows( functor.runs_, functor.perRow_, mask );
+  if(!negatives) return;
+  negatives->reset( size );
+  addRows( functor.negativeRuns_, functor.negativePerRow_, *negatives );
+}
+
+/**
+ * RunOverlapFunctor - common::each functor that counts the overlap of two run-length
+ * masks one block of rows per job, optionally only within a third mask.  The time
+ * is in the number of runs, not voxels.  With the masks of the negative voxels of
+ * either image, it also counts the voxels that are negative in one image and > 0 in
+ * neither, which are not 0 in both but are not in either mask.
+ */
+struct RunOverlapFunctor
+{
+  static const size_t BlockRows = 4096;
+
+  const RunLengthMask & first_;
+  const RunLengthMask & second_;
+  const RunLengthMask * within_;
+  const RunLengthMask * firstNegatives_;
+  const RunLengthMask * secondNegatives_;
+  std::vector<OverlapCounts> counts_;              // per job, neither left for the caller
+  std::vector<unsigned long long> negativeOnly_;   // per job
+
+  RunOverlapFunctor(const RunLengthMask & first, const RunLengthMask & second, const RunLengthMask * within,
+                    const RunLengthMask * firstNegatives, const RunLengthMask * secondNegatives)
+  :first_(first),
+   second_(second),
+   within_(within),
+   firstNegatives_(firstNegatives),
+   secondNegatives_(secondNegatives),
+   counts_(jobs()),
+   negativeOnly_(jobs(), 0)
+  {}
+
+  size_t jobs() const { return ( first_.rows() + BlockRows - 1 ) / BlockRows; }
+
+  void operator()(size_t job)
+  {
+    OverlapCounts & counts = counts_[job];
+    std::vector<Run> both;
+    const size_t last = std::min( (job + 1) * BlockRows, first_.rows() );
+    for(size_t r=job * BlockRows; r<last; ++r)
+    {
+      size_t na, nb;
+      const Run * a = first_.row( r, na );
+      const Run * b = second_.row( r, nb );
+      if(firstNegatives_ || secondNegatives_) negativeOnly_[job] += negativeOnly( r, a, na, b, nb );
+      if(!within_)
+      {
+        counts.first += runLength( a, na );
+        counts.second += runLength( b, nb );
+        counts.both += intersectionLength( a, na, b, nb );
+        continue;
+      }
+      size_t nm;
+      const Run * m = within_->row( r, nm );
+      if(nm == 0) continue;
+      counts.first += intersectionLength( m, nm, a, na );
+      counts.second += intersectionLength( m, nm, b, nb );
+      both.clear();
+      intersect( a, na, b, nb, both );
+      if(!both.empty()) counts.both += intersectionLength( m, nm, &both[0], both.size() );
+    }
+  }
+
+  /** voxels of row r (within within_) negative in either image and > 0 in neither. */
+  unsigned long long negativeOnly(size_t r, const Run * a, size_t na, const Run * b, size_t nb) const
+  {
+    std::vector<Run> negatives[2];
+    const RunLengthMask * masks[2] = { firstNegatives_, secondNegatives_ };
+    for(size_t i=0; i<2; ++i)
+    {
+      if(!masks[i]) continue;
+      size_t n;
+      const Run * runs = masks[i]->row( r, n );
+      if(n == 0) continue;
+      if(!within_)
+      {
+        negatives[i].assign( runs, runs + n );
+        continue;
+      }
+      size_t nm;
+      const Run * m = within_->row( r, nm );
+      intersect( m, nm, runs, n, negatives[i] );
+    }
+    if(negatives[0].empty() && negatives[1].empty()) return 0;
+
+    // a voxel is never both > 0 and negative in the same image.
+    const size_t n0 = negatives[0].size(), n1 = negatives[1].size();
+    const Run * n0s = n0 ? &negatives[0][0] : 0;
+    const Run * n1s = n1 ? &negatives[1][0] : 0;
+    return runLength( n0s, n0 ) - intersectionLength( n0s, n0, b, nb )
+         + runLength( n1s, n1 ) - intersectionLength( n1s, n1, a, na )
+         - intersectionLength( n0s, n0, n1s, n1 );
+  }
+};
+
+/**
+ * countOverlap - overlap counts of two run-length masks of the same size, the same as
+ * the dense countOverlap of the images they were encoded from.  With within, only
+ * the voxels set in that mask are counted (neither is then the rest of within).
+ * Neither is only the voxels that are 0 in both images if the masks of their
+ * negative voxels are given, otherwise it also counts the negative voxels.
+ */
+inline OverlapCounts countOverlap(const RunLengthMask & first, const RunLengthMask & second, size_t numThreads,
+                                  const RunLengthMask * within = 0, const RunLengthMask * firstNegatives = 0,
+                                  const RunLengthMask * secondNegatives = 0)
+{
+  RunOverlapFunctor functor( first, second, within, firstNegatives, secondNegatives );
+  each<RunOverlapFunctor>::run( functor, functor.jobs(), numThreads );
+  OverlapCounts counts;
+  unsigned long long negativeOnly = 0;
+  for(size_t job=0; job<functor.counts_.size(); ++job)
+  {
+    counts.add( functor.counts_[job] );
+    negativeOnly += functor.negativeOnly_[job];
+  }
+  const unsigned long long total = within ? within->count() : first.voxels();
+  counts.neither = total - counts.first - counts.second + counts.both - negativeOnly;
+  return counts;
+}
+
+/** Span - voxels [offset, offset+length) of an image buffer. */
+struct Span
+{
+  Span()
+  :offset(0),
+   length(0)
+  {}
+
+  Span(size_t o, size_t l)
+  :offset(o),
+   length(l)
+  {}
+
+  size_t offset;
+  size_t length;
+};
+
+/** the runs of mask as spans of its image buffer, a run that ends a row joined with one that starts the next. */
+inline std::vector<Span> spans(const RunLengthMask & mask)
+{
+  std::vector<Span> spans;
+  for(size_t r=0; r<mask.rows(); ++r)
+  {
+    size_t n;
+    const Run * runs = mask.row( r, n );
+    for(size_t k=0; k<n; ++k)
+    {
+      const size_t offset = r * mask.rowLength() + runs[k].begin;
+      if(!spans.empty() && spans.back().offset + spans.back().length == offset)
+      {
+        spans.back().length += runs[k].end - runs[k].begin;
+      }
+      else
+      {
+        spans.push_back( Span(offset, runs[k].end - runs[k].begin) );
+      }
+    }
+  }
+  return spans;
+}
+
+/**
+ * SpanXorFunctor - common::each functor that counts the voxels of a list of spans
+ * where exactly one of two images is > 0.  The spans are cut into jobs of about
+ * BlockVoxels voxels each, so one long span is still spread over the threads.
+ */
+template < class PixelType >
+struct SpanXorFunctor
+{
+  static const size_t BlockVoxels = 1 << 16;
+
+  const PixelType * first_;
+  const PixelType * second_;
+  std::vector<Span> pieces_;
+  std::vector<size_t> jobStart_;           // first piece of each job, and the end
+  std::vector<unsigned long long> counts_; // per job
+
+  SpanXorFunctor(const std::vector<Span> & spans, const PixelType * first, const PixelType * second)
+  :first_(first),
+   second_(second)
+  {
+    size_t filled = 0;
+    for(size_t k=0; k<spans.size(); ++k)
+    {
+      Span span = spans[k];
+      while(span.length > 0)
+      {
+        if(filled == 0) jobStart_.push_back( pieces_.size() );
+        const size_t length = std::min( span.length, BlockVoxels - filled );
+        pieces_.push_back( Span(span.offset, length) );
+        span.offset += length;
+        span.length -= length;
+        filled = ( filled + length ) % BlockVoxels;
+      }
+    }
+    counts_.assign( jobStart_.size(), 0 );
+    jobStart_.push_back( pieces_.size() );
+  }
+
+  size_t jobs() const { return counts_.size(); }
+
+  void operator()(size_t job)
+  {
+    unsigned long long count = 0;
+    for(size_t k=jobStart_[job]; k<jobStart_[job+1]; ++k)
+    {
+      count += xorSpan( first_ + pieces_[k].offset, second_ + pieces_[k].offset, pieces_[k].length );
+    }
+    counts_[job] = count;
+  }
+};
+
+/** voxels of spans where exactly one of first and second (same size) is > 0, over numThreads threads. */
+template < class ImageType >
+unsigned long long countXor(const std::vector<Span> & spans, const typename ImageType::Pointer & first,
+                            const typename ImageType::Pointer & second, size_t numThreads)
+{
+  typedef SpanXorFunctor<typename ImageType::PixelType> FunctorType;
+  FunctorType functor( spans, first->GetBufferPointer(), second->GetBufferPointer() );
+  each<FunctorType>::run( functor, functor.jobs(), numThreads );
+  unsigned long long count = 0;
+  for(size_t job=0; job<functor.jobs(); ++job) count += functor.counts_[job];
+  return count;
+}
+
+/**
+ * RunLengthLoad - reads the images that have no usable sidecar in their stored pixel
+ * type and encodes them, see common::dispatchScalar.
+ */
+struct RunLengthLoad
+{
+  const std::vector<std::string> & filenames_;
+  const std::vector<size_t> & pending_;
+  std::vector<RunLengthMask> & masks_;
+  size_t threads_;
+  bool positiveOnly_;
+  std::vector<RunLengthMask> * negatives_;
+
+  RunLengthLoad(const std::vector<std::string> & filenames, const std::vector<size_t> & pending,
+                std::vector<RunLengthMask> & masks, size_t threads, bool positiveOnly,
+                std::vector<RunLengthMask> * negatives)
+  :filenames_(filenames),
+   pending_(pending),
+   masks_(masks),
+   threads_(threads),
+   positiveOnly_(positiveOnly),
+   negatives_(negatives)
+  {}
+
+  template < class ImageType >
+  int run()
+  {
+    // one image is decoded at a time, only its runs are kept.
+    for(size_t k=0; k<pending_.size(); ++k)
+    {
+      std::vector<std::string> one( 1, filenames_[pending_[k]] );
+      std::vector<typename ImageType::Pointer> images;
+      if( !loadImages<ImageType>( one, images, 1, false ) ) return 1;
+      encode<ImageType>( images[0], masks_[pending_[k]], threads_, positiveOnly_,
+                         negatives_ ? &(*negatives_)[pending_[k]] : 0 );
+    }
+    return 0;
+  }
+};
+
+/**
+ * loadRunLengths - run-length masks of filenames.  With sidecar, the mask of "x.nrrd"
+ * is read from "x.nrrd.rle" when that is up to date, and otherwise encoded from the
+ * image and written there for the next run.  With negatives, the runs of the negative
+ * voxels of each image are kept there too (in "x.nrrd.neg.rle").  Returns false
+ * (after printing an error) if an image can not be read.
+ */
+inline bool loadRunLengths(const std::vector<std::string> & filenames, std::vector<RunLengthMask> & masks,
+                           size_t numThreads, bool sidecar, bool positiveOnly = false,
+                           std::vector<RunLengthMask> * negatives = 0)
+{
+  masks.assign( filenames.size(), RunLengthMask() );
+  if( negatives ) negatives->assign( filenames.size(), RunLengthMask() );
+  std::vector<size_t> pending;
+  std::vector<std::string> pendingNames;
+  for(size_t i=0; i<filenames.size(); ++i)
+  {
+    if( sidecar && masks[i].read( filenames[i] + ".rle", filenames[i] ) &&
+        ( !negatives || (*negatives)[i].read( filenames[i] + ".neg.rle", filenames[i] ) ) ) continue;
+    pending.push_back( i );
+    pendingNames.push_back( filenames[i] );
+  }
+  if( pending.empty() ) return true;
+
+  RunLengthLoad load( filenames, pending, masks, numThreads, positiveOnly, negatives );
+  if( dispatchScalar<3>( componentType( pendingNames ), load ) != 0 ) return false;
+
+  for(size_t k=0; sidecar && k<pending.size(); ++k)
+  {
+    const std::string & filename = filenames[pending[k]];
+    if( !masks[pending[k]].write( filename + ".rle", filename ) )
+    {
+      std::cerr << "Warning: could not write " << filename << ".rle" << std::endl;
+    }
+    if( negatives && !(*negatives)[pending[k]].write( filename + ".neg.rle", filename ) )
+    {
+      std::cerr << "Warning: could not write " << filename << ".neg.rle" << std::endl;
+    }
+  }
+  return true;
+}
+
+} // end namespace
+
+#endif
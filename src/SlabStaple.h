@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __SlabStaple_H
+#define __SlabStaple_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include <itkImage.h>
+#include <itkMultiThreader.h>
+
+#include "map.h"
+#include "BitPlanes.h"
+#include "StapleEM.h"
+#include "NrrdStream.h"
+#include "staple.h"
+
+namespace staple
+{
+
+/**
+ * SlabEngine - STAPLE engine for volumes that do not fit in memory.
+ *
+ * The inputs are streamed from their files once, slice by slice, while the votes
+ * of the raters are spilled to a temporary file as bit planes (one bit per voxel
+ * and rater, slice after slice).  Every EM pass then reads that file back one slab
+ * of slices at a time and works through the slices of the slab on a common::each
+ * pool, so what stays resident is one slab and the per-rater sums whatever the
+ * size of the volume.  The region of interest is the one runStaple crops to.
+ * Votes are read with isVote and isBackground like the itk filter; from the first
+ * slice where a rater has another value on, those voxels are spilled to a second
+ * file, as they count in neither the sensitivity nor the specificity sums.
+ */
+class SlabEngine
+{
+public:
+  typedef itk::Image<float, 3> WeightImageType;
+  typedef WeightImageType::IndexType IndexType;
+  typedef WeightImageType::SizeType SizeType;
+  typedef WeightImageType::PointType PointType;
+  typedef WeightImageType::SpacingType SpacingType;
+  typedef WeightImageType::DirectionType DirectionType;
+
+  SlabEngine(size_t numThreads, double confidenceWeight, size_t memoryBudget)
+  :numThreads_(numThreads),
+   confidenceWeight_(confidenceWeight),
+   memoryBudget_(memoryBudget),
+   raters_(0),
+   planeWords_(0),
+   sliceWords_(0),
+   slabSlices_(1),
+   spill_(0),
+   straySpill_(0),
+   strayStart_(0),
+   failed_(false),
+   readers_(0),
+   params_(0),
+   prior_(0),
+   output_(0)
+  {}
+
+  ~SlabEngine()
+  {
+    if(spill_) fclose( spill_ );
+    if(straySpill_) fclose( straySpill_ );
+  }
+
+  /**
+   * stream inputs (the raters, then the mask) into the spill file and find the region
+   * of interest, trimmed by ignoreSlices like cropInputs.  Returns false, after
+   * printing an error, if an input can not be read or nothing is left to run on.
+   */
+  bool spill(std::vector<common::NrrdStreamReader> & inputs, size_t ignoreSlices)
+  {
+    readers_ = &inputs;
+    raters_ = inputs.size() - 1;
+    for(unsigned int d=0; d<3; ++d) size_[d] = inputs[0].size(d);
+    origin_.Fill( 0 );
+    for(unsigned int d=0; d<3; ++d)
+    {
+      spacing_[d] = inputs[0].spacing(d);
+      origin_[d] = inputs[0].origin(d);
+      for(unsigned int k=0; k<3; ++k) direction_[k][d] = inputs[0].direction(k,d);
+    }
+
+    const size_t sliceVoxels = size_[0] * size_[1];
+    planeWords_ = ( sliceVoxels + common::BitsPerWord - 1 ) / common::BitsPerWord;
+    sliceWords_ = raters_ * planeWords_;
+
+    spill_ = tmpfile();
+    if(!spill_)
+    {
+      std::cerr << "Error: could not create a temporary file for the rater votes." << std::endl;
+      return false;
+    }
+
+    // one slice of every input at a time.
+    raw_.assign( inputs.size(), std::vector<unsigned char>() );
+    for(size_t i=0; i<inputs.size(); ++i) raw_[i].resize( sliceVoxels * inputs[i].componentSize() );
+    nonzero_.assign( inputs.size() * planeWords_, 0 );
+    crop_ = CropBox<3>();
+    occupied_.assign( inputs.size() * size_[2], 0 );
+    slab_.assign( sliceWords_, 0 );
+    straySlab_.assign( sliceWords_, 0 );
+    for(slice_ = 0; slice_ < size_[2]; ++slice_)
+    {
+      mode_ = SPILL;
+      ok_.assign( inputs.size(), 1 );
+      common::each<SlabEngine>::run( *this, inputs.size(), numThreads_ );
+      for(size_t i=0; i<inputs.size(); ++i) if(!ok_[i]) return false;
+      cropSlice();
+      if(sliceWords_ > 0 && fwrite( &slab_[0], sizeof(common::BitWord), sliceWords_, spill_ ) != sliceWords_)
+      {
+        std::cerr << "Error: could not write the rater votes to a temporary file." << std::endl;
+        return false;
+      }
+      if(!spillStrays()) return false;
+    }
+    raw_.clear();
+    nonzero_.clear();
+    readers_ = 0;
+
+    // region of interest of all inputs, padded and trimmed like cropInputs.
+    SizeType imgSize;
+    for(unsigned int d=0; d<3; ++d) imgSize[d] = size_[d];
+    if(!crop_.bounds( imgSize, lower_, upper_ ))
+    {
+      std::cerr << "Error: no non-zero voxels found in the inputs." << std::endl;
+      return false;
+    }
+    if(ignoreSlices > 0)
+    {
+      long first = upper_[2], last = lower_[2] - 1;
+      for(long z=lower_[2]; z<upper_[2]; ++z)
+      {
+        if(!allOccupied(z)) continue;
+        first = std::min( first, z );
+        last = z;
+      }
+      if(!trimSlices( lower_, upper_, 2, first <= last, first, last, ignoreSlices )) return false;
+    }
+
+    // slabs as thick as the budget allows, with the output slices of a slab.
+    const size_t planes = straySpill_ ? 2 : 1;
+    const size_t sliceBytes = planes * sliceWords_ * sizeof(common::BitWord) + sliceVoxels * sizeof(float);
+    slabSlices_ = std::max<size_t>( 1, memoryBudget_ / std::max<size_t>( 1, sliceBytes ) );
+    slabSlices_ = std::min<size_t>( slabSlices_, upper_[2] - lower_[2] );
+    slab_.assign( slabSlices_ * sliceWords_, 0 );
+    straySlab_.assign( straySpill_ ? slabSlices_ * sliceWords_ : 0, 0 );
+    sums_.assign( slabSlices_, Statistics() );
+    votes_.assign( slabSlices_, 0.0 );
+    std::cerr << "out of core: " << raters_ << " raters spilled as bit planes, slabs of "
+              << slabSlices_ << " slices (" << slabSlices_ * sliceBytes / (1024.0*1024.0) << " MB)" << std::endl;
+    return true;
+  }
+
+  /** true once reading a slab back failed, the estimate is then incomplete. */
+  bool failed() const { return failed_; }
+
+  size_t raters() const { return raters_; }
+  size_t voxels() const
+  {
+    return static_cast<size_t>( upper_[0] - lower_[0] ) * ( upper_[1] - lower_[1] ) * ( upper_[2] - lower_[2] );
+  }
+
+  Statistics seed(Parameters & params)
+  {
+    params_ = 0;
+    Statistics stats;
+    const double voteSum = pass( stats );
+    params.prior = ( voteSum / voxels() ) * confidenceWeight_;
+    prior_ = params.prior;
+    return stats;
+  }
+
+  Statistics step(const Parameters & params)
+  {
+    params_ = &params;
+    Statistics stats;
+    pass( stats );
+    return stats;
+  }
+
+  /**
+   * stream the weights of the last pass (recomputed slab by slab) into a nrrd file,
+   * the region of interest only when cropped is set, the full extent otherwise.
+   */
+  bool write(const std::string & filename, bool cropped)
+  {
+    SizeType size;
+    PointType origin = origin_;
+    for(unsigned int d=0; d<3; ++d) size[d] = cropped ? upper_[d] - lower_[d] : size_[d];
+    if(cropped)
+    {
+      for(unsigned int k=0; k<3; ++k)
+      {
+        for(unsigned int d=0; d<3; ++d) origin[k] += direction_[k][d] * spacing_[d] * lower_[d];
+      }
+    }
+    common::NrrdStreamWriter<float, 3> writer;
+    if(!writer.open( filename, size, origin, spacing_, direction_, true )) return false;
+
+    const size_t sliceVoxels = size_[0] * size_[1];
+    std::vector<float> output( slabSlices_ * sliceVoxels, 0.0f );
+    if(!cropped) writer.zeros( lower_[2] * sliceVoxels );
+    output_ = &output[0];
+    for(long z=lower_[2]; z<upper_[2]; z+=slabSlices_)
+    {
+      const size_t slices = std::min<size_t>( slabSlices_, upper_[2] - z );
+      if(!slab( z, slices )) return false;
+      for(size_t s=0; s<slices; ++s)
+      {
+        const float * slice = &output[s*sliceVoxels];
+        if(!cropped)
+        {
+          writer.write( slice, sliceVoxels );
+          continue;
+        }
+        for(long y=lower_[1]; y<upper_[1]; ++y) writer.write( slice + y*size_[0] + lower_[0], size[0] );
+      }
+    }
+    output_ = 0;
+    if(!cropped) writer.zeros( ( size_[2] - upper_[2] ) * sliceVoxels );
+    return writer.close();
+  }
+
+  // common::each interface: input "job" of the slice being spilled, or slice "job" of the slab.
+  void operator()(size_t job)
+  {
+    if(mode_ == SPILL)
+    {
+      spillSlice( job );
+      return;
+    }
+    const common::BitWord * words = &slab_[job * sliceWords_];
+    const common::BitWord * strays = straySpill_ ? &straySlab_[job * sliceWords_] : 0;
+    const size_t R = raters_;
+    Statistics stats(R);
+    double voteSum = 0;
+
+    std::vector<double> a1(R), a0(R), b1(R), b0(R);
+    if(params_)
+    {
+      for(size_t i=0; i<R; ++i)
+      {
+        a1[i] = params_->sensitivity[i];
+        a0[i] = 1.0 - params_->sensitivity[i];
+        b1[i] = 1.0 - params_->specificity[i];
+        b0[i] = params_->specificity[i];
+      }
+    }
+    const double g = prior_;
+    float * output = output_ ? output_ + job * size_[0] * size_[1] : 0;
+
+    for(long y=lower_[1]; y<upper_[1]; ++y)
+    {
+      for(long x=lower_[0]; x<upper_[0]; ++x)
+      {
+        const size_t v = y*size_[0] + x;
+        const size_t word = v / common::BitsPerWord;
+        const unsigned int bit = v % common::BitsPerWord;
+        double w;
+        if(params_)
+        {
+          double a = 1.0, b = 1.0;
+          for(size_t i=0; i<R; ++i)
+          {
+            if(( words[i*planeWords_ + word] >> bit ) & 1) { a *= a1[i]; b *= b1[i]; }
+            else                                           { a *= a0[i]; b *= b0[i]; }
+          }
+          w = g*a / ( g*a + (1.0-g)*b );
+        }
+        else
+        {
+          size_t votes = 0;
+          for(size_t i=0; i<R; ++i) votes += ( words[i*planeWords_ + word] >> bit ) & 1;
+          const float mean = static_cast<float>( static_cast<double>(votes) / R );
+          voteSum += mean;
+          w = mean;
+        }
+        const float stored = static_cast<float>(w);
+        if(output) output[v] = stored;
+        w = stored; // accumulate what is stored, like the itk filter
+
+        stats.wsum += w;
+        stats.wcsum += 1.0 - w;
+        for(size_t i=0; i<R; ++i)
+        {
+          if(( words[i*planeWords_ + word] >> bit ) & 1)                 stats.pnum[i] += w;
+          else if(!strays || !( ( strays[i*planeWords_ + word] >> bit ) & 1 )) stats.qnum[i] += 1.0 - w;
+        }
+      }
+    }
+    sums_[job] = stats;
+    votes_[job] = voteSum;
+  }
+
+private:
+  enum Mode { SPILL, SLAB };
+
+  bool allOccupied(long z) const
+  {
+    for(size_t i=0; i<=raters_; ++i) if(!occupied_[i*size_[2] + z]) return false;
+    return true;
+  }
+
+  /**
+   * add the voxels of slice_ where some input is non-zero to the crop, in raster
+   * order, skipping what can not move a bound like BoundingBoxFunctor.
+   */
+  void cropSlice()
+  {
+    std::vector<common::BitWord> any( planeWords_, 0 );
+    for(size_t i=0; i<=raters_; ++i)
+    {
+      const common::BitWord * marks = &nonzero_[i*planeWords_];
+      for(size_t w=0; w<planeWords_; ++w) any[w] |= marks[w];
+    }
+    for(size_t y=0; y<size_[1]; ++y)
+    {
+      const size_t row = y * size_[0];
+      size_t first = 0;
+      while(first < size_[0] && !set( any, row + first )) ++first;
+      if(first == size_[0]) continue;
+      const long index[3] = { static_cast<long>(first), static_cast<long>(y), static_cast<long>(slice_) };
+      crop_.add( index );
+      for(size_t x = std::max<long>( first, crop_.highs[0].back() ) + 1; x < size_[0]; ++x)
+      {
+        if(set( any, row + x )) crop_.highs[0].push_back( x );
+      }
+    }
+  }
+
+  static bool set(const std::vector<common::BitWord> & plane, size_t v)
+  {
+    return ( plane[v / common::BitsPerWord] >> ( v % common::BitsPerWord ) ) & 1;
+  }
+
+  /**
+   * append the stray planes of slice_ to their file, which is only made at the first
+   * slice that has any: the slices before strayStart_ have none.
+   */
+  bool spillStrays()
+  {
+    if(!straySpill_)
+    {
+      bool any = false;
+      for(size_t w=0; w<straySlab_.size() && !any; ++w) any = straySlab_[w] != 0;
+      if(!any) return true;
+      straySpill_ = tmpfile();
+      strayStart_ = slice_;
+      if(!straySpill_)
+      {
+        std::cerr << "Error: could not create a temporary file for the rater votes." << std::endl;
+        return false;
+      }
+    }
+    if(fwrite( &straySlab_[0], sizeof(common::BitWord), sliceWords_, straySpill_ ) != sliceWords_)
+    {
+      std::cerr << "Error: could not write the rater votes to a temporary file." << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  /** read slice_ of input i, note where it is non-zero and, for a rater, pack its votes. */
+  void spillSlice(size_t i)
+  {
+    common::NrrdStreamReader & reader = (*readers_)[i];
+    const size_t sliceVoxels = size_[0] * size_[1];
+    if(!reader.read( &raw_[i][0], sliceVoxels ))
+    {
+      ok_[i] = 0;
+      return;
+    }
+    switch(reader.component())
+    {
+      case common::NrrdStreamReader::CHAR:   scan( reinterpret_cast<const signed char *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::UCHAR:  scan( reinterpret_cast<const unsigned char *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::SHORT:  scan( reinterpret_cast<const short *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::USHORT: scan( reinterpret_cast<const unsigned short *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::INT:    scan( reinterpret_cast<const int *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::UINT:   scan( reinterpret_cast<const unsigned int *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::FLOAT:  scan( reinterpret_cast<const float *>(&raw_[i][0]), i ); break;
+      case common::NrrdStreamReader::DOUBLE: scan( reinterpret_cast<const double *>(&raw_[i][0]), i ); break;
+      default: ok_[i] = 0;
+    }
+  }
+
+  template < class T >
+  void scan(const T * voxels, size_t i)
+  {
+    common::BitWord * plane = i < raters_ ? &slab_[i*planeWords_] : 0;
+    common::BitWord * strays = i < raters_ ? &straySlab_[i*planeWords_] : 0;
+    if(plane)
+    {
+      std::fill( plane, plane + planeWords_, common::BitWord(0) );
+      std::fill( strays, strays + planeWords_, common::BitWord(0) );
+    }
+    common::BitWord * marks = &nonzero_[i*planeWords_];
+    std::fill( marks, marks + planeWords_, common::BitWord(0) );
+    // occupancy is counted over the voxels cropInputs can keep: it crops to
+    // [lower,upper), and upper stops one short of the image edge.
+    bool occupied = false;
+    size_t v = 0;
+    for(size_t y=0; y<size_[1]; ++y)
+    {
+      for(size_t x=0; x<size_[0]; ++x, ++v)
+      {
+        const common::BitWord bit = common::BitWord(1) << ( v % common::BitsPerWord );
+        if(plane)
+        {
+          if(isVote( voxels[v] ))             plane[v / common::BitsPerWord] |= bit;
+          else if(!isBackground( voxels[v] )) strays[v / common::BitsPerWord] |= bit;
+        }
+        if(voxels[v] == 0) continue;
+        marks[v / common::BitsPerWord] |= bit;
+        occupied = occupied || ( x + 1 < size_[0] && y + 1 < size_[1] );
+      }
+    }
+    occupied_[i*size_[2] + slice_] = occupied;
+  }
+
+  /** read slices [z, z+slices) of the spill file and run them through operator(). */
+  bool slab(long z, size_t slices)
+  {
+    bool ok = read( spill_, z, slices, &slab_[0] );
+    if(straySpill_)
+    {
+      // the slices before strayStart_ have no stray voxels.
+      const long first = std::max<long>( z, strayStart_ );
+      std::fill( straySlab_.begin(), straySlab_.end(), common::BitWord(0) );
+      if(first < z + static_cast<long>(slices))
+      {
+        ok = ok && read( straySpill_, first - strayStart_, z + slices - first, &straySlab_[( first - z ) * sliceWords_] );
+      }
+    }
+    if(!ok)
+    {
+      std::cerr << "Error: could not read the rater votes back from the temporary file." << std::endl;
+      failed_ = true;
+      return false;
+    }
+    mode_ = SLAB;
+    slabStart_ = z;
+    common::each<SlabEngine>::run( *this, slices, numThreads_ );
+    return true;
+  }
+
+  /** one pass over the region of interest, returns the vote sum of a seed pass. */
+  double pass(Statistics & stats)
+  {
+    double voteSum = 0;
+    for(long z=lower_[2]; z<upper_[2]; z+=slabSlices_)
+    {
+      const size_t slices = std::min<size_t>( slabSlices_, upper_[2] - z );
+      if(!slab( z, slices )) break;
+      // merged in slice order, so the sums do not depend on the thread count.
+      for(size_t s=0; s<slices; ++s)
+      {
+        stats.add( sums_[s] );
+        voteSum += votes_[s];
+      }
+    }
+    return voteSum;
+  }
+
+  /** read slices [z, z+slices) of a spill file into words. */
+  bool read(FILE * file, long z, size_t slices, common::BitWord * words)
+  {
+    return seek( file, static_cast<unsigned long long>(z) * sliceWords_ * sizeof(common::BitWord) ) &&
+           fread( words, sizeof(common::BitWord), slices * sliceWords_, file ) == slices * sliceWords_;
+  }
+
+  static bool seek(FILE * file, unsigned long long offset)
+  {
+#ifdef _MSC_VER
+    return _fseeki64( file, static_cast<__int64>(offset), SEEK_SET ) == 0;
+#else
+    return fseeko( file, static_cast<off_t>(offset), SEEK_SET ) == 0;
+#endif
+  }
+
+  size_t numThreads_;
+  double confidenceWeight_;
+  size_t memoryBudget_;
+
+  size_t size_[3];
+  PointType origin_;
+  SpacingType spacing_;
+  DirectionType direction_;
+  IndexType lower_;  // region of interest, [lower,upper)
+  IndexType upper_;
+
+  size_t raters_;
+  size_t planeWords_;   // words of one rater's slice
+  size_t sliceWords_;   // words of all raters' slice
+  size_t slabSlices_;
+  FILE * spill_;
+  FILE * straySpill_;   // voxels neither a vote nor background, from slice strayStart_ on
+  long strayStart_;
+  bool failed_;
+  std::vector<common::BitWord> slab_;
+  std::vector<common::BitWord> straySlab_;
+
+  // spilling
+  Mode mode_;
+  size_t slice_;
+  std::vector<common::NrrdStreamReader> * readers_;
+  std::vector< std::vector<unsigned char> > raw_;
+  std::vector<common::BitWord> nonzero_;  // per input, where the slice is non-zero
+  CropBox<3> crop_;
+  std::vector<char> occupied_;  // per input and slice
+  std::vector<char> ok_;
+
+  // passes
+  long slabStart_;
+  const Parameters * params_;
+  double prior_;
+  float * output_;
+  std::vector<Statistics> sums_;  // per slice of the slab
+  std::vector<double> votes_;
+};
+
+} // end namespace
+
+/**
+ * runSlabStaple - runStaple for inputs too large to load: filenames are the raters
+ * followed by the mask, streamed from disk by a staple::SlabEngine that holds at
+ * most options.memory_budget bytes of slabs (64 MB if not set).
+ */
+inline void runSlabStaple(const std::vector<std::string> & filenames, const std::string & outname, const StapleOptions & options)
+{
+    if ( options.round_robin )
+    {
+      std::cerr << "-rr is not supported with -outofcore, running the full comparison only." << std::endl;
+    }
+    if ( options.engine != ENGINE_ITK )
+    {
+      std::cerr << "-outofcore runs its own engine, -engine is ignored." << std::endl;
+    }
+
+    std::vector<common::NrrdStreamReader> readers( filenames.size() );
+    for ( size_t i=0; i<filenames.size(); ++i )
+    {
+      if ( !readers[i].open( filenames[i] ) ) return;
+      if ( readers[i].dimension() != 3 )
+      {
+        std::cerr << "Error: " << filenames[i] << " is not a 3D image." << std::endl;
+        return;
+      }
+      for ( unsigned int d=0; d<3; ++d )
+      {
+        if ( readers[i].size(d) != readers[0].size(d) )
+        {
+          std::cerr << "Error: size of " << filenames[i] << " does not match the first image." << std::endl;
+          return;
+        }
+      }
+    }
+
+    const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    const size_t budget = options.memory_budget > 0 ? options.memory_budget : 64 * 1024 * 1024;
+    staple::SlabEngine engine( numThreads, options.confidence_weight, budget );
+    if ( !engine.spill( readers, options.ignore_slices ) ) return;
+    readers.clear();
+
+    std::ofstream traceFile;
+    staple::Controls controls = options.controls;
+    if ( !options.trace_file.empty() )
+    {
+      traceFile.open( options.trace_file.c_str() );
+      if ( !traceFile )
+      {
+        std::cerr << "Error: could not open " << options.trace_file << " for writing." << std::endl;
+        return;
+      }
+      controls.trace = &traceFile;
+      controls.label = "full";
+    }
+
+    staple::Parameters full;
+    staple::estimate( engine, full, controls );
+    if ( engine.failed() || !engine.write( outname, options.cropped_output ) ) return;
+    printOverall( full, std::cout, options.reportsIterations() );
+}
+
+#endif
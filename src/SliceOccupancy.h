@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __SliceOccupancy_H
+#define __SliceOccupancy_H
+
+#include <vector>
+
+#include <itkImage.h>
+
+#include "map.h"
+
+namespace common
+{
+
+/**
+ * SliceOccupancy - number of non-zero voxels of each image in each slice of a region.
+ *
+ * The index is built once, one slice per common::each job, straight from the image
+ * buffers.  Questions like "which is the first slice where every image has a
+ * value" or "can this slice be skipped" are then answered without touching the
+ * voxels again.
+ */
+template < class ImageType >
+class SliceOccupancy
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef typename ImageType::SizeType SizeType;
+
+  /**
+   * index the slices of region along sliceDimension, for every image in images
+   * (all buffered over region).
+   */
+  SliceOccupancy(const std::vector<ImagePointer> & images, const RegionType & region,
+                 unsigned int sliceDimension = ImageType::ImageDimension-1, size_t numThreads = 1)
+  :images_(images),
+   region_(region),
+   sliceDimension_(sliceDimension),
+   counts_(images.size() * region.GetSize()[sliceDimension], 0)
+  {
+    common::each<SliceOccupancy>::run( *this, slices(), numThreads );
+  }
+
+  size_t images() const { return images_.size(); }
+  size_t slices() const { return region_.GetSize()[sliceDimension_]; }
+
+  /** image index of slice s. */
+  long sliceIndex(size_t s) const { return region_.GetIndex()[sliceDimension_] + static_cast<long>(s); }
+
+  /** non-zero voxels of image i in slice s. */
+  unsigned long count(size_t i, size_t s) const { return counts_[i*slices() + s]; }
+
+  bool occupied(size_t i, size_t s) const { return count(i,s) > 0; }
+
+  /** true when every image has a non-zero voxel in slice s. */
+  bool allOccupied(size_t s) const
+  {
+    for(size_t i=0; i<images_.size(); ++i) if(!occupied(i,s)) return false;
+    return true;
+  }
+
+  /** true when some image has a non-zero voxel in slice s. */
+  bool anyOccupied(size_t s) const
+  {
+    for(size_t i=0; i<images_.size(); ++i) if(occupied(i,s)) return true;
+    return false;
+  }
+
+  /** first / last slice (0 based) where every image has a value, slices() if there is none. */
+  size_t firstAllOccupied() const
+  {
+    for(size_t s=0; s<slices(); ++s) if(allOccupied(s)) return s;
+    return slices();
+  }
+  size_t lastAllOccupied() const
+  {
+    for(size_t s=slices(); s>0; --s) if(allOccupied(s-1)) return s-1;
+    return slices();
+  }
+
+  // common::each interface, one slice per job.
+  void operator()(size_t s)
+  {
+    RegionType slice = region_;
+    IndexType start = region_.GetIndex();
+    SizeType size = region_.GetSize();
+    start[sliceDimension_] += s;
+    size[sliceDimension_] = 1;
+    slice.SetIndex(start);
+    slice.SetSize(size);
+    if(slice.GetNumberOfPixels() == 0) return;
+
+    const size_t lineLength = size[0];
+    const size_t lines = slice.GetNumberOfPixels() / lineLength;
+    for(size_t i=0; i<images_.size(); ++i)
+    {
+      const PixelType * buffer = images_[i]->GetBufferPointer();
+      unsigned long count = 0;
+      IndexType line = start;
+      for(size_t l=0; l<lines; ++l)
+      {
+        const PixelType * row = buffer + images_[i]->ComputeOffset(line);
+        for(size_t x=0; x<lineLength; ++x) count += ( row[x] != 0 );
+        for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+        {
+          if(++line[d] < start[d] + static_cast<long>(size[d])) break;
+          line[d] = start[d];
+        }
+      }
+      counts_[i*slices() + s] = count;
+    }
+  }
+
+private:
+  std::vector<ImagePointer> images_;
+  RegionType region_;
+  unsigned int sliceDimension_;
+  std::vector<unsigned long> counts_;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __StapleBatch_H
+#define __StapleBatch_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+
+#include <itkImage.h>
+#include <itkMultiThreader.h>
+#include <itkTimeProbe.h>
+
+#include "map.h"
+#include "staple.h"
+#include "PixelDispatch.h"
+#include "LoadImages.h"
+
+/**
+ * BatchCase - one staple run of a batch: the raters, then the mask, and the output.
+ */
+struct BatchCase
+{
+  std::vector<std::string> inputs;
+  std::string output;
+};
+
+/**
+ * readManifest - one case per line, whitespace separated: rater files, the mask and
+ * the output file, like the command line of a single run.  Blank lines and lines
+ * starting with # are skipped.  Returns false (after printing an error) if a line
+ * has fewer than two raters or the file can not be read.
+ */
+inline bool readManifest(const std::string & filename, std::vector<BatchCase> & cases)
+{
+  std::ifstream in( filename.c_str() );
+  if ( !in )
+  {
+    std::cerr << "Error: could not open manifest " << filename << std::endl;
+    return false;
+  }
+  cases.clear();
+  std::string line;
+  size_t lineNumber = 0;
+  while ( std::getline( in, line ) )
+  {
+    ++lineNumber;
+    std::istringstream fields( line );
+    std::vector<std::string> files;
+    std::string file;
+    while ( fields >> file ) files.push_back( file );
+    if ( files.empty() || files[0][0] == '#' ) continue;
+    if ( files.size() < 4 )
+    {
+      std::cerr << "Error: line " << lineNumber << " of " << filename
+                << " needs at least two raters, a mask and an output." << std::endl;
+      return false;
+    }
+    BatchCase batchCase;
+    batchCase.output = files.back();
+    files.pop_back();
+    batchCase.inputs = files;
+    cases.push_back( batchCase );
+  }
+  return true;
+}
+
+/**
+ * StapleBatch - runs the cases of a manifest as a three stage pipeline: while case k
+ * is computed, case k+1 is read and case k-1 is written.
+ *
+ * The stages run in lockstep, one common::each job per stage, so at most three
+ * cases are resident.  When the estimated footprint of a step is over
+ * options.memory_budget its stages run one after the other instead (write,
+ * compute, then read), each releasing what it no longer needs before the next
+ * one starts.
+ */
+template < class ImageType >
+class StapleBatch
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename StapleResult<ImageType>::OutputImageType OutputImageType;
+
+  enum Stage { WRITE = 0, COMPUTE = 1, READ = 2 };
+
+  StapleBatch(const std::vector<BatchCase> & cases, const StapleOptions & options, std::ostream * trace)
+  :cases_(cases),
+   options_(options),
+   trace_(trace),
+   slots_(cases.size()),
+   step_(0)
+  {
+    for ( size_t k=0; k<cases.size(); ++k )
+    {
+      size_t voxels = common::voxelCount( cases[k].inputs[0] );
+      slots_[k].inputBytes = voxels * sizeof(typename ImageType::PixelType) * cases[k].inputs.size();
+      slots_[k].outputBytes = voxels * sizeof(typename OutputImageType::PixelType);
+    }
+  }
+
+  /** run every case, the CSV report of each goes to stdout in manifest order; returns the number of failed cases. */
+  size_t run()
+  {
+    size_t failed = 0;
+    const size_t steps = cases_.size() + 2;
+    for ( step_ = 0; step_ < steps; ++step_ )
+    {
+      const size_t budget = options_.memory_budget;
+      const bool overlap = budget == 0 || footprint() <= budget;
+      if ( !overlap )
+      {
+        std::cerr << "batch step " << step_ << ": estimated " << footprint() / (1024.0*1024.0)
+                  << " MB is over the memory budget, running its stages one at a time." << std::endl;
+      }
+      common::each<StapleBatch>::run( *this, 3, overlap ? 3 : 1 );
+
+      // report the case that was just written.
+      if ( step_ >= 2 )
+      {
+        const size_t k = step_ - 2;
+        Slot & slot = slots_[k];
+        std::cerr << "case " << k << " (" << cases_[k].output << "): read " << slot.seconds[READ]
+                  << " s, staple " << slot.seconds[COMPUTE] << " s, write " << slot.seconds[WRITE] << " s" << std::endl;
+        if ( !slot.ok )
+        {
+          std::cerr << "Error: case " << k << " (" << cases_[k].output << ") failed." << std::endl;
+          ++failed;
+        }
+        if ( slot.written )
+        {
+          std::cout << "case," << cases_[k].output << std::endl;
+          std::cout << slot.csv;
+        }
+        slot.csv.clear();
+      }
+    }
+    return failed;
+  }
+
+  // common::each interface, one stage of the current step per job.
+  void operator()(size_t job)
+  {
+    const size_t k = step_ + job;
+    if ( k < 2 || k - 2 >= cases_.size() ) return;
+    Slot & slot = slots_[k-2];
+    itk::TimeProbe probe;
+    probe.Start();
+    switch ( job )
+    {
+      case READ:
+      {
+        size_t threads = options_.load_threads;
+        if ( threads == 0 ) threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+        slot.ok = common::loadImages<ImageType>( cases_[k-2].inputs, slot.images, threads, false );
+        break;
+      }
+      case COMPUTE:
+      {
+        if ( slot.ok )
+        {
+          std::ostringstream csv;
+          slot.ok = computeStaple<ImageType>( slot.images, options_, slot.result, csv, trace_ );
+          slot.csv = csv.str();
+        }
+        slot.images.clear();
+        break;
+      }
+      case WRITE:
+      {
+        if ( slot.result.consensus.IsNotNull() )
+        {
+          slot.written = writeStapleResult<ImageType>( cases_[k-2].output, slot.result, options_ );
+          slot.ok = slot.ok && slot.written;
+        }
+        slot.result.consensus = 0;
+        break;
+      }
+    }
+    probe.Stop();
+    slot.seconds[job] = probe.GetTotal();
+  }
+
+private:
+  struct Slot
+  {
+    Slot()
+    :ok(false),
+     written(false),
+     inputBytes(0),
+     outputBytes(0)
+    {
+      seconds[0] = seconds[1] = seconds[2] = 0;
+    }
+
+    std::vector<ImagePointer> images;
+    StapleResult<ImageType> result;
+    std::string csv;
+    bool ok;
+    bool written;
+    size_t inputBytes;   // decoded raters and mask
+    size_t outputBytes;  // consensus, at most the full extent
+    double seconds[3];
+  };
+
+  /**
+   * estimated peak of the current step with its stages overlapped: the case being
+   * read, the case being computed (inputs, cropped copies and consensus) and the
+   * consensus being written.
+   */
+  size_t footprint() const
+  {
+    size_t bytes = 0;
+    if ( step_ < cases_.size() ) bytes += slots_[step_].inputBytes;
+    if ( step_ >= 1 && step_ - 1 < cases_.size() ) bytes += 2 * slots_[step_-1].inputBytes + slots_[step_-1].outputBytes;
+    if ( step_ >= 2 && step_ - 2 < cases_.size() ) bytes += slots_[step_-2].outputBytes;
+    return bytes;
+  }
+
+  const std::vector<BatchCase> & cases_;
+  const StapleOptions & options_;
+  std::ostream * trace_;
+  std::vector<Slot> slots_;
+  size_t step_;
+};
+
+#endif
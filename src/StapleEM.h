@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __StapleEM_H
+#define __StapleEM_H
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <ostream>
+
+#include <itkImage.h>
+#include <itkNumericTraits.h>
+#include <itkTimeProbe.h>
+
+#include "map.h"
+
+/**
+ * Native STAPLE expectation-maximization.
+ *
+ * This follows itk::STAPLEImageFilter step for step (M-step from the current
+ * weights, E-step from the new sensitivity/specificity, stop when no parameter
+ * moved more than the tolerance), but lets the caller seed the run and keeps
+ * the voxel work in engines that fuse the E-step with the accumulation of the
+ * next M-step's sums, so each iteration is a single pass over the data.
+ */
+namespace staple
+{
+
+/**
+ * How itk::STAPLEImageFilter reads a rater's voxel, with its default ForegroundValue:
+ * a voxel at the foreground value is a vote for foreground and any other value a vote
+ * against, but only a voxel at 0 counts towards the rater's specificity, so a label
+ * that is neither (2, 255, ...) takes part in the E-step only.  Values are compared
+ * within the filter's epsilon.
+ */
+const double ForegroundValue = 1.0;
+
+template < class PixelType >
+inline bool isVote(PixelType value)
+{
+  const double v = static_cast<double>(value);
+  return v > ForegroundValue - 1.0e-10 && v < ForegroundValue + 1.0e-10;
+}
+
+template < class PixelType >
+inline bool isBackground(PixelType value)
+{
+  const double v = static_cast<double>(value);
+  return v > -1.0e-10 && v < 1.0e-10;
+}
+
+/**
+ * Parameters - per-rater performance estimates of one STAPLE run.
+ */
+struct Parameters
+{
+  Parameters()
+  :prior(0),
+   iterations(0)
+  {}
+
+  std::vector<double> sensitivity; // p, per rater
+  std::vector<double> specificity; // q, per rater
+  double prior;                    // g_t, prior probability of foreground
+  unsigned int iterations;         // elapsed iterations, counted like itk::STAPLEImageFilter
+};
+
+/**
+ * Statistics - sums needed by the M-step, accumulated over voxels.
+ */
+struct Statistics
+{
+  Statistics(size_t raters = 0)
+  :pnum(raters, 0.0),
+   qnum(raters, 0.0),
+   wsum(0),
+   wcsum(0)
+  {}
+
+  std::vector<double> pnum; // sum W D_i
+  std::vector<double> qnum; // sum (1-W) over the voxels where rater i is background
+  double wsum;              // sum W
+  double wcsum;             // sum (1-W)
+
+  void add(const Statistics & other)
+  {
+    if(other.pnum.empty()) return; // unused thread
+    if(pnum.empty())
+    {
+      *this = other;
+      return;
+    }
+    for(size_t i=0; i<pnum.size(); ++i)
+    {
+      pnum[i] += other.pnum[i];
+      qnum[i] += other.qnum[i];
+    }
+    wsum += other.wsum;
+    wcsum += other.wcsum;
+  }
+};
+
+/**
+ * Controls - stopping rule of the EM loop, the defaults match itk::STAPLEImageFilter,
+ * and where to trace it.
+ */
+struct Controls
+{
+  Controls()
+  :maximumIterations(itk::NumericTraits<unsigned int>::max()),
+   tolerance(1.0e-14),
+   trace(0)
+  {}
+
+  unsigned int maximumIterations;
+  double tolerance; // largest change of any p or q that still counts as converged
+
+  // when set, one JSON object per iteration is written here:
+  //   {"run":label,"iteration":i,"seconds":..,"elapsed":..,"max_delta_sensitivity":..,
+  //    "max_delta_specificity":..,"voxels_per_second":..}
+  std::ostream * trace;
+  std::string label;
+};
+
+/**
+ * estimate - the EM loop shared by the native engines.
+ *
+ * TEngine must provide:
+ *   size_t raters() const
+ *   size_t voxels() const
+ *   Statistics seed(Parameters & params)
+ *      - M-step sums of the initial weights, also sets params.prior
+ *   Statistics step(const Parameters & params)
+ *      - E-step: new weights from params, returns the M-step sums of those weights
+ *
+ * When params.sensitivity/specificity are filled in on entry they are taken as the
+ * previous estimate (a warm start), otherwise the itk defaults (0.99999) are used.
+ */
+template < class TEngine >
+void estimate(TEngine & engine, Parameters & params, const Controls & controls)
+{
+  const size_t raters = engine.raters();
+  std::vector<double> last_p(raters, 0.99999);
+  std::vector<double> last_q(raters, 0.99999);
+  const bool seeded = params.sensitivity.size() == raters && params.specificity.size() == raters;
+  if(seeded)
+  {
+    last_p = params.sensitivity;
+    last_q = params.specificity;
+  }
+  params.sensitivity = last_p;
+  params.specificity = last_q;
+
+  Statistics stats = engine.seed(params);
+
+  double elapsed = 0;
+  unsigned int iter = 0;
+  for(iter = 0; iter < controls.maximumIterations; ++iter)
+  {
+    itk::TimeProbe probe;
+    probe.Start();
+
+    // M-step
+    for(size_t i=0; i<raters; ++i)
+    {
+      params.sensitivity[i] = stats.pnum[i] / stats.wsum;
+      params.specificity[i] = stats.qnum[i] / stats.wcsum;
+    }
+
+    // E-step, fused with the sums for the next M-step
+    stats = engine.step(params);
+
+    double delta_p = 0, delta_q = 0;
+    for(size_t i=0; i<raters; ++i)
+    {
+      delta_p = std::max( delta_p, std::fabs(params.sensitivity[i] - last_p[i]) );
+      delta_q = std::max( delta_q, std::fabs(params.specificity[i] - last_q[i]) );
+    }
+    probe.Stop();
+
+    if(controls.trace)
+    {
+      const double seconds = probe.GetTotal();
+      elapsed += seconds;
+      *controls.trace << "{\"run\":\"" << controls.label << "\",\"iteration\":" << iter
+                      << ",\"seconds\":" << seconds << ",\"elapsed\":" << elapsed
+                      << ",\"max_delta_sensitivity\":" << delta_p << ",\"max_delta_specificity\":" << delta_q
+                      << ",\"voxels_per_second\":" << ( seconds > 0 ? engine.voxels() / seconds : 0.0 )
+                      << "}" << std::endl;
+    }
+
+    // a seed usually came from the same weights the first M-step just used, so
+    // the first comparison would always report convergence.
+    const bool changed = ( seeded && iter == 0 ) || delta_p > controls.tolerance || delta_q > controls.tolerance;
+    if(!changed) break;
+    last_p = params.sensitivity;
+    last_q = params.specificity;
+  }
+  params.iterations = iter;
+}
+
+/**
+ * DenseEngine - STAPLE engine over full-size rater images.
+ *
+ * Keeps one float weight (the STAPLE output) per voxel, every pass is a
+ * common::reduce over the raw buffers of the raters.  Votes are read with isVote
+ * and isBackground, like the itk filter.
+ */
+template < class ImageType >
+class DenseEngine
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef itk::Image<float, ImageType::ImageDimension> WeightImageType;
+  typedef typename WeightImageType::Pointer WeightImagePointer;
+  typedef std::vector<Statistics> StatisticsList;
+
+  DenseEngine(const std::vector<ImagePointer> & raters, size_t numThreads, double confidenceWeight = 1.0)
+  :raters_(raters),
+   numThreads_(numThreads),
+   confidenceWeight_(confidenceWeight),
+   params_(0)
+  {
+    weights_ = WeightImageType::New();
+    weights_->SetRegions( raters_[0]->GetLargestPossibleRegion() );
+    weights_->Allocate();
+    weights_->SetOrigin( raters_[0]->GetOrigin() );
+    weights_->SetSpacing( raters_[0]->GetSpacing() );
+    weights_->SetDirection( raters_[0]->GetDirection() );
+  }
+
+  /** start from these weights instead of the mean vote (warm start). */
+  void SetInitialWeights(const WeightImagePointer & initial) { initial_ = initial; }
+
+  /** the STAPLE estimate of the last pass. */
+  WeightImagePointer GetOutput() const { return weights_; }
+
+  size_t raters() const { return raters_.size(); }
+  size_t voxels() const { return raters_[0]->GetLargestPossibleRegion().GetNumberOfPixels(); }
+
+  Statistics seed(Parameters & params)
+  {
+    params_ = 0;
+    voteSum_ = 0;
+    Statistics stats = run();
+    const double voxels = raters_[0]->GetLargestPossibleRegion().GetNumberOfPixels();
+    params.prior = ( voteSum_ / voxels ) * confidenceWeight_;
+    prior_ = params.prior;
+    return stats;
+  }
+
+  Statistics step(const Parameters & params)
+  {
+    params_ = &params;
+    return run();
+  }
+
+  // common::reduce interface
+  Statistics operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    const size_t R = raters_.size();
+    Statistics stats(R);
+    if(threadRegion.GetNumberOfPixels() == 0) return stats;
+
+    std::vector<const PixelType *> buffers(R);
+    for(size_t i=0; i<R; ++i) buffers[i] = raters_[i]->GetBufferPointer();
+    float * weights = weights_->GetBufferPointer();
+    const float * initial = initial_.IsNotNull() ? initial_->GetBufferPointer() : 0;
+
+    // E-step factors: W = g*a / (g*a + (1-g)*b)
+    std::vector<double> a1(R), a0(R), b1(R), b0(R);
+    if(params_)
+    {
+      for(size_t i=0; i<R; ++i)
+      {
+        a1[i] = params_->sensitivity[i];
+        a0[i] = 1.0 - params_->sensitivity[i];
+        b1[i] = 1.0 - params_->specificity[i];
+        b0[i] = params_->specificity[i];
+      }
+    }
+    const double g = prior_;
+    double voteSum = 0;
+
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
+    {
+      const size_t begin = raters_[0]->ComputeOffset(line);
+      for(size_t v=begin; v<begin+lineLength; ++v)
+      {
+        double w;
+        if(params_)
+        {
+          double a = 1.0, b = 1.0;
+          for(size_t i=0; i<R; ++i)
+          {
+            if(isVote(buffers[i][v])) { a *= a1[i]; b *= b1[i]; }
+            else                      { a *= a0[i]; b *= b0[i]; }
+          }
+          w = g*a / ( g*a + (1.0-g)*b );
+        }
+        else
+        {
+          size_t votes = 0;
+          for(size_t i=0; i<R; ++i) votes += isVote(buffers[i][v]);
+          const float mean = static_cast<float>( static_cast<double>(votes) / R );
+          voteSum += mean;
+          w = initial ? initial[v] : mean;
+        }
+        weights[v] = static_cast<float>(w);
+        w = weights[v]; // accumulate what is stored, like the itk filter
+
+        stats.wsum += w;
+        stats.wcsum += 1.0 - w;
+        for(size_t i=0; i<R; ++i)
+        {
+          if(isVote(buffers[i][v]))            stats.pnum[i] += w;
+          else if(isBackground(buffers[i][v])) stats.qnum[i] += 1.0 - w;
+        }
+      }
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+
+    if(!params_)
+    {
+      lock_.Lock();
+      voteSum_ += voteSum;
+      lock_.Unlock();
+    }
+    return stats;
+  }
+
+  Statistics operator()(const StatisticsList & partial)
+  {
+    Statistics stats;
+    for(size_t t=0; t<partial.size(); ++t) stats.add(partial[t]);
+    return stats;
+  }
+
+private:
+  Statistics run()
+  {
+    return common::reduce<ImageType,Statistics,DenseEngine>::run( raters_[0].GetPointer(), *this, numThreads_ );
+  }
+
+  std::vector<ImagePointer> raters_;
+  size_t numThreads_;
+  double confidenceWeight_;
+  WeightImagePointer weights_;
+  WeightImagePointer initial_;
+  const Parameters * params_;
+  double prior_;
+  double voteSum_;
+  itk::SimpleFastMutexLock lock_;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __StreamOverlap_H
+#define __StreamOverlap_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+
+#include "map.h"
+#include "Overlap.h"
+#include "NrrdStream.h"
+
+namespace common
+{
+
+/**
+ * StreamOverlap - overlap counts of two nrrd files (a voxel is set when it is > 0),
+ * streamed front to back in chunks so only a few chunks are ever in memory.
+ *
+ * The files are read in lockstep, one common::each job each, while a third job
+ * counts the chunk read the step before: inflating the next chunk and counting
+ * the last one overlap.  Each chunk is turned into 1/0/-1 bytes (> 0, 0, negative)
+ * as it is read, so files of different pixel types can be compared and the count is
+ * the same branch-free countSpan the in-memory path uses, tn still the voxels that
+ * are 0 in both.
+ */
+class StreamOverlap
+{
+public:
+  static const size_t ChunkVoxels = 1 << 20;
+
+  enum Job { FIRST = 0, SECOND = 1, COUNT = 2 };
+
+  explicit StreamOverlap(size_t chunkVoxels = ChunkVoxels)
+  :chunk_(std::max<size_t>( 1, chunkVoxels )),
+   voxels_(0),
+   chunks_(0),
+   step_(0)
+  {}
+
+  /** count the overlap of first and second, false (after an error message) if they can not be read or differ in size. */
+  bool run(const std::string & first, const std::string & second)
+  {
+    counts_ = OverlapCounts();
+    if(!readers_[0].open( first ) || !readers_[1].open( second )) return false;
+    bool same = readers_[0].dimension() == readers_[1].dimension();
+    for(unsigned int d=0; same && d<readers_[0].dimension(); ++d) same = readers_[0].size(d) == readers_[1].size(d);
+    if(!same)
+    {
+      std::cerr << "Error: sizes of " << first << " and " << second << " do not match." << std::endl;
+      return false;
+    }
+
+    voxels_ = readers_[0].voxels();
+    chunks_ = ( voxels_ + chunk_ - 1 ) / chunk_;
+    for(size_t i=0; i<2; ++i)
+    {
+      raw_[i].resize( std::min( chunk_, voxels_ ) * readers_[i].componentSize() );
+      ok_[i] = true;
+      for(size_t slot=0; slot<2; ++slot) set_[slot][i].resize( std::min( chunk_, voxels_ ) );
+    }
+
+    for(step_ = 0; step_ <= chunks_; ++step_)
+    {
+      each<StreamOverlap>::run( *this, 3, 3 );
+      if(!ok_[0] || !ok_[1])
+      {
+        std::cerr << "Error: could not read the voxels of " << ( ok_[0] ? second : first ) << std::endl;
+        return false;
+      }
+    }
+    readers_[0].close();
+    readers_[1].close();
+    return true;
+  }
+
+  const OverlapCounts & counts() const { return counts_; }
+  size_t voxels() const { return voxels_; }
+
+  // common::each interface: read chunk step_ of either file, or count chunk step_-1.
+  void operator()(size_t job)
+  {
+    if(job == COUNT)
+    {
+      if(step_ == 0) return;
+      const size_t slot = ( step_ - 1 ) % 2;
+      countSpan( &set_[slot][0][0], &set_[slot][1][0], length( step_ - 1 ), counts_ );
+      return;
+    }
+    if(step_ >= chunks_) return;
+    readChunk( job, step_ % 2, length( step_ ) );
+  }
+
+private:
+  size_t length(size_t chunk) const { return std::min( chunk_, voxels_ - chunk * chunk_ ); }
+
+  void readChunk(size_t i, size_t slot, size_t n)
+  {
+    NrrdStreamReader & reader = readers_[i];
+    if(!reader.read( &raw_[i][0], n ))
+    {
+      ok_[i] = false;
+      return;
+    }
+    signed char * set = &set_[slot][i][0];
+    switch(reader.component())
+    {
+      case NrrdStreamReader::CHAR:   sign( reinterpret_cast<const signed char *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::UCHAR:  sign( reinterpret_cast<const unsigned char *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::SHORT:  sign( reinterpret_cast<const short *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::USHORT: sign( reinterpret_cast<const unsigned short *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::INT:    sign( reinterpret_cast<const int *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::UINT:   sign( reinterpret_cast<const unsigned int *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::FLOAT:  sign( reinterpret_cast<const float *>(&raw_[i][0]), set, n ); break;
+      case NrrdStreamReader::DOUBLE: sign( reinterpret_cast<const double *>(&raw_[i][0]), set, n ); break;
+      default: ok_[i] = false;
+    }
+  }
+
+  /** 1, 0 or -1 for each voxel > 0, 0 or negative, so 0 is kept apart from negative. */
+  template < class T >
+  static void sign(const T * voxels, signed char * set, size_t n)
+  {
+    for(size_t v=0; v<n; ++v) set[v] = static_cast<signed char>( ( voxels[v] > 0 ) - ( voxels[v] < 0 ) );
+  }
+
+  size_t chunk_;
+  size_t voxels_;
+  size_t chunks_;
+  size_t step_;
+  NrrdStreamReader readers_[2];
+  std::vector<unsigned char> raw_[2];    // the stored bytes of the chunk being read, per file
+  std::vector<signed char> set_[2][2];   // sign per voxel, [slot][file], the slot alternates with the step
+  bool ok_[2];
+  OverlapCounts counts_;
+};
+
+} // end namespace
+
+#endif
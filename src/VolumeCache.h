@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __VolumeCache_H
+#define __VolumeCache_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkExceptionObject.h>
+#include <itkMutexLock.h>
+#include <itkConditionVariable.h>
+
+#include "PixelDispatch.h"
+
+namespace common
+{
+
+/**
+ * VolumeCache - decoded volumes shared by the jobs of a run, at most budget bytes of
+ * them kept once no job is using them.
+ *
+ * A volume is keyed by its path and modification time, so a file rewritten during
+ * a run is read again.  Jobs acquire() a file, which decodes it unless it is cached
+ * or another thread is already decoding it (then the job waits for that decode),
+ * and release() it by the key acquire() gave them when done.  Volumes in use are
+ * never evicted, so the budget can be overrun by what the running jobs hold.
+ * Otherwise volumes no job is expected to need again go first, then the least
+ * recently used.
+ *
+ * Safe to call from several threads at once.
+ */
+template < class ImageType >
+class VolumeCache
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+
+  explicit VolumeCache(size_t budget)
+  :budget_(budget),
+   bytes_(0),
+   clock_(0),
+   decodes_(0),
+   hits_(0),
+   redecodes_(0)
+  {
+    ready_ = itk::ConditionVariable::New();
+  }
+
+  /** note that one more job will acquire filename, call before the jobs start. */
+  void expect(const std::string & filename)
+  {
+    ++expected_[filename];
+  }
+
+  /**
+   * the decoded volume of filename, null (after printing an error) if it can not be
+   * read, with key set to what to release() it by.
+   */
+  ImagePointer acquire(const std::string & filename, std::string & key)
+  {
+    key = this->key( filename );
+    lock_.Lock();
+    Entry & entry = entries_[key];
+    if( expected_[filename] > 0 ) --expected_[filename];
+    entry.filename = filename;
+    ++entry.users;
+    while( entry.loading ) ready_->Wait( &lock_ );
+    if( entry.image.IsNotNull() )
+    {
+      ++hits_;
+      entry.lastUse = ++clock_;
+      ImagePointer image = entry.image;
+      lock_.Unlock();
+      return image;
+    }
+
+    // decode it here, with room made for it first.
+    entry.loading = true;
+    if( entry.decodes > 0 ) ++redecodes_;
+    ++entry.decodes;
+    ++decodes_;
+    lock_.Unlock();
+    const size_t bytes = voxelCount( filename ) * sizeof(typename ImageType::PixelType);
+    lock_.Lock();
+    evict( bytes );
+    entry.bytes = bytes;
+    bytes_ += bytes;
+    lock_.Unlock();
+
+    ImagePointer image;
+    std::string error;
+    typedef itk::ImageFileReader< ImageType > ReaderType;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( filename );
+    try
+    {
+      reader->Update();
+      image = reader->GetOutput();
+      image->DisconnectPipeline();
+    }
+    catch( itk::ExceptionObject & e )
+    {
+      std::ostringstream message;
+      message << e;
+      error = message.str();
+    }
+    catch( ... )
+    {
+      error = "unknown error";
+    }
+
+    lock_.Lock();
+    entry.loading = false;
+    entry.lastUse = ++clock_;
+    if( image.IsNull() )
+    {
+      std::cerr << "Error reading file " << filename << ": " << error << std::endl;
+      --entry.users;
+      bytes_ -= entry.bytes;
+      entry.bytes = 0;
+    }
+    entry.image = image;
+    ready_->Broadcast();
+    lock_.Unlock();
+    return image;
+  }
+
+  /** a job is done with the volume it acquired under key (after a successful acquire). */
+  void release(const std::string & key)
+  {
+    lock_.Lock();
+    Entry & entry = entries_[key];
+    if( entry.users > 0 ) --entry.users;
+    evict( 0 );
+    lock_.Unlock();
+  }
+
+  size_t decodes() const { return decodes_; }
+  size_t hits() const { return hits_; }
+  size_t redecodes() const { return redecodes_; }
+
+private:
+  struct Entry
+  {
+    Entry()
+    :bytes(0),
+     users(0),
+     lastUse(0),
+     decodes(0),
+     loading(false)
+    {}
+
+    std::string filename;
+    ImagePointer image;
+    size_t bytes;
+    size_t users;    // jobs holding or waiting for it
+    size_t lastUse;
+    size_t decodes;
+    bool loading;
+  };
+
+  static std::string key(const std::string & filename)
+  {
+    uint64_t bytes = 0;
+    int64_t modified = 0;
+    fileStamp( filename, bytes, modified );
+    std::ostringstream key;
+    key << filename << "@" << modified;
+    return key.str();
+  }
+
+  /** drop unused volumes until incoming more bytes fit in the budget, or nothing unused is left. */
+  void evict(size_t incoming)
+  {
+    while( bytes_ + incoming > budget_ )
+    {
+      typename std::map<std::string,Entry>::iterator victim = entries_.end();
+      for( typename std::map<std::string,Entry>::iterator it = entries_.begin(); it != entries_.end(); ++it )
+      {
+        const Entry & entry = it->second;
+        if( entry.users > 0 || entry.loading || entry.image.IsNull() ) continue;
+        if( victim == entries_.end() || better( entry, victim->second ) ) victim = it;
+      }
+      if( victim == entries_.end() ) return;
+      bytes_ -= victim->second.bytes;
+      victim->second.bytes = 0;
+      victim->second.image = 0;
+    }
+  }
+
+  /** true if a is a better eviction victim than b. */
+  bool better(const Entry & a, const Entry & b)
+  {
+    const bool aNeeded = expected_[a.filename] > 0;
+    const bool bNeeded = expected_[b.filename] > 0;
+    if( aNeeded != bNeeded ) return bNeeded;
+    return a.lastUse < b.lastUse;
+  }
+
+  size_t budget_;
+  size_t bytes_;
+  size_t clock_;
+  size_t decodes_;
+  size_t hits_;
+  size_t redecodes_;
+  std::map<std::string,Entry> entries_;
+  std::map<std::string,size_t> expected_; // acquires still to come, per file
+  itk::SimpleMutexLock lock_;
+  itk::ConditionVariable::Pointer ready_;
+};
+
+} // end namespace
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+/**
+ * continuous_staple - run the continuous staple algorithm on a set of scalar images.
+ */
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdlib>
+
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itkNrrdImageIO.h>
+#include <itkMultiThreader.h>
+
+#include "continuous_staple.h"
+
+int main(int argc, char ** argv)
+{
+  if( argc < 4 )
+  {
+    std::cerr << "usage: " << argv[0] << " [options] image1.nrrd image2.nrrd [image3.nrrd ...] outimage.nrrd" << std::endl;
+    std::cerr << "options: -iters N = number of EM iterations (default 100)" << std::endl;
+    std::cerr << "         -threads N = number of threads (default one per core)" << std::endl;
+    return 1;
+  }
+
+  typedef float InputPixelType;
+  typedef itk::Image< InputPixelType, 3 > InputImageType;
+  typedef itk::ImageFileReader< InputImageType > ReaderType;
+
+  unsigned int maxiters = 100;
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  int image_index = 1;
+  while( image_index < argc && argv[image_index][0] == '-' )
+  {
+    std::string option(argv[image_index++]);
+    if( option == "-iters" && image_index < argc )
+    {
+      maxiters = atoi(argv[image_index++]);
+    }
+    else if( option == "-threads" && image_index < argc )
+    {
+      threads = std::max( 1, atoi(argv[image_index++]) );
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( argc - image_index < 3 )
+  {
+    std::cerr << "Error: need at least two input images and an output image." << std::endl;
+    return 1;
+  }
+
+  std::vector<InputImageType::Pointer> images;
+  for( int i=image_index; i<argc-1; ++i )
+  {
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( argv[i] );
+    InputImageType::Pointer image = reader->GetOutput();
+    reader->Update();
+    if( !images.empty() && image->GetLargestPossibleRegion().GetSize() != images[0]->GetLargestPossibleRegion().GetSize() )
+    {
+      std::cerr << "Error: size of " << argv[i] << " does not match the first image." << std::endl;
+      return 1;
+    }
+    images.push_back(image);
+  }
+  std::string outname( argv[argc-1] );
+
+  // uniform prior, no bias and unit variance to start, as in the julia version.
+  staple::ContinuousParameters params;
+  params.beta.assign( images.size(), 0.0 );
+  params.lambda.assign( images.size(), 1.0 );
+
+  typedef staple::ContinuousStapleFunctor<InputImageType>::OutputImageType OutputImageType;
+  OutputImageType::Pointer result = staple::continuousStaple<InputImageType>( images, params, maxiters, threads );
+
+  typedef itk::ImageFileWriter< OutputImageType > WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetInput( result );
+  writer->SetFileName( outname );
+  writer->UseCompressionOn();
+  writer->Update();
+
+  std::cerr << "Bias, Variance:" << std::endl;
+  for( size_t i=0; i<images.size(); ++i )
+  {
+    std::cerr << i << ": " << params.beta[i] << ", " << params.lambda[i] << std::endl;
+    std::cout << "beta" << i << "," << params.beta[i] << std::endl;
+  }
+  std::cout << std::endl;
+  for( size_t i=0; i<images.size(); ++i )
+  {
+    std::cout << "lambda" << i << "," << params.lambda[i] << std::endl;
+  }
+  std::cerr << "Iterations: " << params.iterations << std::endl;
+  std::cout << "iterations," << params.iterations << std::endl;
+
+  return 0;
+}
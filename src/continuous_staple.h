@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+#ifndef __continuous_staple_H
+#define __continuous_staple_H
+
+/**
+ * continuous staple - STAPLE for scalar images, as described in
+ * Olivier Commowick and Simon K. Warfield, "A Continuous STAPLE for Scalar, Vector,
+ * and Tensor Images: An Application to DTI Analysis", IEEE Trans on Med Imaging, 2009
+ *
+ * This is the algorithm of julia/Staple/src/Staple.jl (uniform prior), with the
+ * E-step and M-step of each iteration fused into one pass over the images.
+ *
+ * The E-step estimate is mean(x) = v * sum_i (I_i(x) - beta_i) / lambda_i, with
+ * v = 1 / sum_i (1/lambda_i).  With d_i = I_i - mean, the new bias is
+ * beta'_i = avg(d_i).  The M-step evaluates the estimate again with beta', which
+ * only shifts it by the constant c = v * sum_i (beta'_i - beta_i) / lambda_i, so
+ *   lambda'_i = avg( (beta'_i - c - d_i)^2 ) + v
+ *             = avg(d_i^2) - 2 (beta'_i - c) beta'_i + (beta'_i - c)^2 + v
+ * and both updates follow from per-rater sums of d_i and d_i^2.
+ */
+
+#include <vector>
+
+#include <itkImage.h>
+
+#include "map.h"
+
+namespace staple
+{
+
+/**
+ * ContinuousParameters - per-rater bias and variance.
+ */
+struct ContinuousParameters
+{
+  std::vector<double> beta;   // bias, per rater
+  std::vector<double> lambda; // variance, per rater
+  unsigned int iterations;
+};
+
+/**
+ * ContinuousSums - per-rater sums of the deviations from the estimate.
+ */
+struct ContinuousSums
+{
+  ContinuousSums(size_t raters = 0)
+  :d(raters, 0.0),
+   d2(raters, 0.0)
+  {}
+
+  std::vector<double> d;  // sum (I_i - mean)
+  std::vector<double> d2; // sum (I_i - mean)^2
+};
+
+/**
+ * ContinuousStapleFunctor - common::reduce functor for one fused iteration.
+ *
+ * Each thread walks its region a line at a time over the raw buffers, computes the
+ * estimate and accumulates the deviations of every rater from it.  When an output
+ * image is set the estimate is also written there (only done on the last pass).
+ */
+template < class ImageType >
+class ContinuousStapleFunctor
+{
+public:
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef itk::Image<float, ImageType::ImageDimension> OutputImageType;
+  typedef typename OutputImageType::Pointer OutputImagePointer;
+  typedef std::vector<ContinuousSums> SumsList;
+
+  ContinuousStapleFunctor(const std::vector<ImagePointer> & images)
+  :images_(images),
+   variance_(0)
+  {}
+
+  /** set up the pass for the current parameters. */
+  void SetParameters(const ContinuousParameters & params)
+  {
+    const size_t R = images_.size();
+    double precision = 0;
+    for(size_t i=0; i<R; ++i) precision += 1.0 / params.lambda[i];
+    variance_ = 1.0 / precision;
+    // mean = v * sum_i (I_i - beta_i)/lambda_i = sum_i weight_i I_i - offset
+    weight_.resize(R);
+    offset_ = 0;
+    for(size_t i=0; i<R; ++i)
+    {
+      weight_[i] = variance_ / params.lambda[i];
+      offset_ += weight_[i] * params.beta[i];
+    }
+  }
+
+  double variance() const { return variance_; }
+
+  /** write the estimate of the next pass here, 0 to not write. */
+  void SetOutput(const OutputImagePointer & output) { output_ = output; }
+
+  ContinuousSums operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    const size_t R = images_.size();
+    ContinuousSums sums(R);
+    if(threadRegion.GetNumberOfPixels() == 0) return sums;
+
+    std::vector<const PixelType *> buffers(R);
+    for(size_t i=0; i<R; ++i) buffers[i] = images_[i]->GetBufferPointer();
+    float * output = output_.IsNotNull() ? output_->GetBufferPointer() : 0;
+
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    std::vector<double> mean(lineLength);
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
+    {
+      const size_t begin = images_[0]->ComputeOffset(line);
+
+      // estimate for the whole line, then one sweep per rater, so every
+      // loop runs over contiguous memory.
+      for(size_t x=0; x<lineLength; ++x) mean[x] = -offset_;
+      for(size_t i=0; i<R; ++i)
+      {
+        const PixelType * row = buffers[i] + begin;
+        const double w = weight_[i];
+        for(size_t x=0; x<lineLength; ++x) mean[x] += w * row[x];
+      }
+      for(size_t i=0; i<R; ++i)
+      {
+        const PixelType * row = buffers[i] + begin;
+        double d = 0, d2 = 0;
+        for(size_t x=0; x<lineLength; ++x)
+        {
+          const double diff = row[x] - mean[x];
+          d += diff;
+          d2 += diff * diff;
+        }
+        sums.d[i] += d;
+        sums.d2[i] += d2;
+      }
+      if(output)
+      {
+        for(size_t x=0; x<lineLength; ++x) output[begin + x] = static_cast<float>(mean[x]);
+      }
+
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+    return sums;
+  }
+
+  ContinuousSums operator()(const SumsList & partial)
+  {
+    ContinuousSums sums(images_.size());
+    for(size_t t=0; t<partial.size(); ++t)
+    {
+      if(partial[t].d.empty()) continue; // unused thread
+      for(size_t i=0; i<images_.size(); ++i)
+      {
+        sums.d[i] += partial[t].d[i];
+        sums.d2[i] += partial[t].d2[i];
+      }
+    }
+    return sums;
+  }
+
+private:
+  const std::vector<ImagePointer> & images_;
+  std::vector<double> weight_;
+  double offset_;
+  double variance_;
+  OutputImagePointer output_;
+};
+
+/**
+ * continuousStaple - run maxiters iterations from the parameters in params and
+ * return the final estimate.  params is updated to the final beta and lambda.
+ */
+template < class ImageType >
+typename ContinuousStapleFunctor<ImageType>::OutputImagePointer
+continuousStaple(const std::vector<typename ImageType::Pointer> & images, ContinuousParameters & params,
+                 unsigned int maxiters, size_t numThreads)
+{
+  typedef ContinuousStapleFunctor<ImageType> FunctorType;
+  typedef typename FunctorType::OutputImageType OutputImageType;
+
+  typename OutputImageType::Pointer result = OutputImageType::New();
+  result->SetRegions( images[0]->GetLargestPossibleRegion() );
+  result->Allocate();
+  result->FillBuffer( 0 );
+  result->SetOrigin( images[0]->GetOrigin() );
+  result->SetSpacing( images[0]->GetSpacing() );
+  result->SetDirection( images[0]->GetDirection() );
+
+  const size_t R = images.size();
+  const double voxels = images[0]->GetLargestPossibleRegion().GetNumberOfPixels();
+  FunctorType functor( images );
+  params.iterations = 0;
+  for(unsigned int iter=0; iter<maxiters; ++iter)
+  {
+    functor.SetParameters( params );
+    if(iter + 1 == maxiters) functor.SetOutput( result );
+    ContinuousSums sums = common::reduce<ImageType,ContinuousSums,FunctorType>::run( images[0].GetPointer(), functor, numThreads );
+
+    // E-step: new bias
+    std::vector<double> beta(R);
+    double shift = 0;
+    for(size_t i=0; i<R; ++i)
+    {
+      beta[i] = sums.d[i] / voxels;
+      shift += functor.variance() / params.lambda[i] * ( beta[i] - params.beta[i] );
+    }
+    // M-step: new variance, against the estimate shifted by the new bias
+    for(size_t i=0; i<R; ++i)
+    {
+      const double b = beta[i] - shift;
+      params.lambda[i] = sums.d2[i] / voxels - 2.0 * b * beta[i] + b * b + functor.variance();
+    }
+    params.beta = beta;
+    params.iterations = iter + 1;
+  }
+  return result;
+}
+
+} // end namespace
+
+#endif
@@ -24,17 +24,39 @@
 */
 
 
-
-
+
+
 
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <string>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkNrrdImageIO.h>
-#include <itkImageRegionConstIterator.h>
+#include <itkMultiThreader.h>
+
+#include "Overlap.h"
+#include "RunLength.h"
+#include "StreamOverlap.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
+
+
+/** print the counts to stderr and return the dice overlap in percent. */
+double report_overlap(const common::OverlapCounts &counts, long long tot_pixels) {
+
+  const common::DiceCounts dice(counts, tot_pixels);
+
+  std::cerr << "tp: " << dice.tp << std::endl;
+  std::cerr << "fp: " << dice.fp << std::endl;
+  std::cerr << "tn: " << dice.tn << std::endl;
+  std::cerr << "fn: " << dice.fn << std::endl;
+  std::cerr << "tot: " << tot_pixels << std::endl;
+
+  return dice.dice;
+}
 
 
 template < class ImageType >
@@ -42,10 +64,6 @@ double get_overlap(const typename ImageType::Pointer &first_image,
                    const typename ImageType::Pointer &second_image) {
 
 
-  typedef typename itk::ImageRegionConstIterator<ImageType> ConstIteratorType;
-  typedef typename ImageType::PixelType PixelType;
-
-
   typename ImageType::SizeType first_image_size = first_image->GetLargestPossibleRegion().GetSize();
   typename ImageType::SizeType second_image_size = second_image->GetLargestPossibleRegion().GetSize();
 
@@ -55,91 +73,193 @@ double get_overlap(const typename ImageType::Pointer &first_image,
     exit(1);
   }
 
-  //std::cerr << "sizes = " << first_image_size << ", " << second_image_size << "\n";
+  // one pass over the raw buffers, split over all cores.
+  const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  common::OverlapCounts counts = common::countOverlap<ImageType>( first_image, second_image, numThreads );
 
-  ConstIteratorType it1( first_image, first_image->GetRequestedRegion() );
-  ConstIteratorType it2( second_image, first_image->GetRequestedRegion() );
-  it1.GoToBegin();
-  it2.GoToBegin();
+  long long tot_pixels = 1;
+  for(size_t i=0; i<second_image_size.GetSizeDimension(); ++i) tot_pixels *= second_image_size[i];
 
-  long long num_pixels1 = 0;
-  long long num_pixels2 = 0;
-  long long num_overlap = 0;
-  long long num_nooverlap = 0;
+  return report_overlap(counts, tot_pixels);
+}
 
-  while (!it1.IsAtEnd()) {
-    PixelType pixel1 = it1.Get();
-    PixelType pixel2 = it2.Get();
 
-    if (pixel1 > 0) {
-      num_pixels1++;
-    }
+/**
+ * get_rle_overlap - the same as get_overlap, from the run-length encoded masks,
+ * in time proportional to their number of runs.
+ */
+double get_rle_overlap(const std::vector<std::string> &filenames, bool sidecar) {
 
-    if (pixel2 > 0) {
-      num_pixels2++;
-    }
+  const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::vector<common::RunLengthMask> masks;
+  std::vector<common::RunLengthMask> negatives;
+  if(!common::loadRunLengths(filenames, masks, numThreads, sidecar, true, &negatives)) exit(1);
+  common::reportPeakRSS( "after loading" );
 
-    if (pixel1 > 0 && pixel2 > 0) {
-      num_overlap++;
-    }
+  if(masks[0].size() != masks[1].size())
+  {
+    std::cerr << "Error: sizes of " << filenames[0] << " and " << filenames[1] << " do not match." << std::endl;
+    exit(1);
+  }
+  std::cerr << "runs: " << masks[0].runs() << " ; " << masks[1].runs() << std::endl;
 
-    if (pixel1 == 0 && pixel2 == 0) {
-      num_nooverlap++;
-    }
+  // tn is the voxels that are 0 in both, so the negative voxels are kept too.
+  common::OverlapCounts counts = common::countOverlap( masks[0], masks[1], numThreads, 0, &negatives[0], &negatives[1] );
+  return report_overlap(counts, masks[0].voxels());
+}
 
-    ++it1;
-    ++it2;
-  }
 
-  //std::cerr << num_pixels1 << ", " << num_pixels2 << ", " << num_overlap << "\n";
-  long long tot_pixels = 1;
-  for(size_t i=0; i<second_image_size.GetSizeDimension(); ++i) tot_pixels *= second_image_size[i];
+/**
+ * get_stream_overlap - the same as get_overlap, with both files inflated in lockstep
+ * chunks and counted as they arrive, never holding either volume.
+ */
+double get_stream_overlap(const std::vector<std::string> &filenames) {
 
-  std::cerr << "tp: " << num_overlap << std::endl;
-  std::cerr << "fp: " << num_pixels2-num_overlap << std::endl;
-  std::cerr << "tn: " << num_nooverlap << std::endl;
-  std::cerr << "fn: " << (tot_pixels-num_pixels2) - num_nooverlap << std::endl;
-  std::cerr << "tot: " << tot_pixels << std::endl;
+  common::StreamOverlap stream;
+  if(!stream.run(filenames[0], filenames[1])) exit(1);
+  return report_overlap(stream.counts(), stream.voxels());
+}
+
+
+/**
+ * print_label_overlap - per-label dice of two label maps, all from one joint
+ * histogram of their labels.  Label 0 is background.
+ */
+template < class ImageType >
+void print_label_overlap(const typename ImageType::Pointer &first_image, 
+                         const typename ImageType::Pointer &second_image) {
+
+  typename ImageType::SizeType first_image_size = first_image->GetLargestPossibleRegion().GetSize();
+  typename ImageType::SizeType second_image_size = second_image->GetLargestPossibleRegion().GetSize();
 
-  double overlap = (2.0 * (double)num_overlap) / (double)(num_pixels1 + num_pixels2);
+  if(first_image_size != second_image_size)
+  {
+    std::cerr << "Error: sizes (" << first_image_size << " ; " << second_image_size << ") do not match." << std::endl;
+    exit(1);
+  }
+
+  const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  common::LabelHistogram histogram = common::labelHistogram<ImageType>( first_image, second_image, numThreads );
+  if(histogram.invalid > 0)
+  {
+    std::cerr << "Warning: " << histogram.invalid << " voxels are not labels in 0.."
+              << common::LabelHistogram::MaximumLabels-1 << " and were skipped." << std::endl;
+  }
 
-  return overlap * 100.0;
+  std::cout << "label,dice,volume1,volume2,tp,fp,fn" << std::endl;
+  for(size_t l=1; l<histogram.labels; ++l)
+  {
+    const unsigned long long volume1 = histogram.first(l);
+    const unsigned long long volume2 = histogram.second(l);
+    if(volume1 == 0 && volume2 == 0) continue;
+    const unsigned long long tp = histogram.count(l,l);
+    const double dice = (2.0 * (double)tp) / (double)(volume1 + volume2) * 100.0;
+    std::cout << l << "," << std::setprecision(4) << dice << "," << volume1 << "," << volume2 << ","
+              << tp << "," << volume2 - tp << "," << volume1 - tp << std::endl;
+  }
+
+  // the confusion counts behind it, every (label1, label2) pair that occurs.
+  std::cout << std::endl << "label1,label2,voxels" << std::endl;
+  for(size_t a=0; a<histogram.labels; ++a)
+  {
+    for(size_t b=0; b<histogram.labels; ++b)
+    {
+      if(histogram.count(a,b) > 0) std::cout << a << "," << b << "," << histogram.count(a,b) << std::endl;
+    }
+  }
 }
 
 
+/**
+ * DiceRun - reads both images in their stored pixel type and prints their overlap,
+ * see common::dispatchScalar.
+ */
+struct DiceRun
+{
+  char ** argv_;
+  bool labels_;
+
+  DiceRun(char ** argv, bool labels)
+  :argv_(argv),
+   labels_(labels)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    typedef itk::ImageFileReader< InputImageType  >  ReaderType;
+
+    // read in the images...
+    std::vector<typename InputImageType::Pointer> images;
+
+    for( int i=0; i<2; ++i ) {
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( argv_[i] );
+      typename InputImageType::Pointer image = reader->GetOutput();
+      reader->Update();
+      images.push_back(image);
+    }
+    common::reportPeakRSS( "after loading" );
+
+    if( labels_ ) {
+      print_label_overlap<InputImageType>(images[0], images[1]);
+      common::reportPeakRSS( "at exit" );
+      return 0;
+    }
+
+    double overlap = get_overlap<InputImageType>(images[0], images[1]);
+
+    //std::cout << std::setprecision(4) << overlap << std::endl;
+    std::cerr << "dice overlap: ";
+    std::cout << std::setprecision(4) << overlap;
+    std::cerr << std::endl;
+    common::reportPeakRSS( "at exit" );
+    return 0;
+  }
+};
 
 int main(int argc, char ** argv) {
 
-  if (argc != 3) {
-    std::cerr << "usage: " << argv[0] << " image1.nrrd image2.nrrd" << std::endl;
+  bool labels = false;
+  bool rle = false;
+  bool sidecar = false;
+  bool stream = false;
+  int image_index = 1;
+  while (image_index < argc && argv[image_index][0] == '-') {
+    std::string option(argv[image_index++]);
+    if (option == "-labels") labels = true;
+    else if (option == "-rle") rle = true;
+    else if (option == "-sidecar") rle = sidecar = true;
+    else if (option == "-stream") stream = true;
+    else {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if (argc - image_index != 2) {
+    std::cerr << "usage: " << argv[0] << " [-labels | -rle | -sidecar | -stream] image1.nrrd image2.nrrd" << std::endl;
+    std::cerr << "       -labels = images are label maps, print the dice of every label as CSV" << std::endl;
+    std::cerr << "       -rle = count the overlap from the run-length encoded masks" << std::endl;
+    std::cerr << "       -sidecar = like -rle, keeping each mask's runs in image.nrrd.rle (its negative voxels in image.nrrd.neg.rle) for the next run" << std::endl;
+    std::cerr << "       -stream = count while inflating both files in chunks, without reading either volume" << std::endl;
     return 1;
   }
-  
-  // setup ITK types...
-  typedef float InputPixelType;
-  typedef itk::Image< InputPixelType,  3 >   InputImageType;
-  typedef itk::ImageFileReader< InputImageType  >  ReaderType;
-
-  // read in the images...
-  std::vector<InputImageType::Pointer> images;
-
-  for( int i=1; i<argc; ++i ) {
-    ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName( argv[i] );
-    InputImageType::Pointer image = reader->GetOutput();
-    reader->Update();
-    images.push_back(image);
+  if ((labels ? 1 : 0) + (rle ? 1 : 0) + (stream ? 1 : 0) > 1) {
+    std::cerr << "Error: only one of -labels, -rle and -stream can be given." << std::endl;
+    return 1;
   }
 
+  std::vector<std::string> filenames( argv+image_index, argv+image_index+2 );
+  if (rle || stream) {
+    double overlap = rle ? get_rle_overlap(filenames, sidecar) : get_stream_overlap(filenames);
+    std::cerr << "dice overlap: ";
+    std::cout << std::setprecision(4) << overlap;
+    std::cerr << std::endl;
+    common::reportPeakRSS( "at exit" );
+    return 0;
+  }
 
-  double overlap = get_overlap<InputImageType>(images[0], images[1]);
-
-  //std::cout << std::setprecision(4) << overlap << std::endl;
-  std::cerr << "dice overlap: ";
-  std::cout << std::setprecision(4) << overlap;
-  std::cerr << std::endl;
-
-  return 0;
+  DiceRun diceRun( argv+image_index, labels );
+  return common::dispatchScalar<3>( common::componentType( filenames ), diceRun );
 }
 
-
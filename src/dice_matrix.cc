@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+/**
+ * dice_matrix - dice similarity coefficient of every pair of a set of masks.
+ *
+ * Each mask is read once and packed into bits, the overlaps of all pairs then come
+ * from AND+popcount over the packed masks.  The result is printed as CSV matrices,
+ * row i / column j comparing mask i (as "image1" of dice) with mask j.
+ */
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <algorithm>
+
+#include <itkImage.h>
+#include <itkMultiThreader.h>
+
+#include "BitPlanes.h"
+#include "LoadImages.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
+
+/**
+ * DiceMatrixRun - reads the masks in their stored pixel type, a few at a time, and
+ * packs each one before the next are read, see common::dispatchScalar.
+ */
+struct DiceMatrixRun
+{
+  const std::vector<std::string> & filenames_;
+  size_t threads_;
+  std::vector<common::BitPlane> planes_;
+
+  DiceMatrixRun(const std::vector<std::string> & filenames, size_t threads)
+  :filenames_(filenames),
+   threads_(threads)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    // only threads_ decoded volumes are ever held, the rest is bits.
+    typename InputImageType::SizeType size;
+    for( size_t first=0; first<filenames_.size(); first+=threads_ )
+    {
+      const size_t last = std::min( first + threads_, filenames_.size() );
+      std::vector<std::string> group( filenames_.begin() + first, filenames_.begin() + last );
+      std::vector<typename InputImageType::Pointer> images;
+      if( !common::loadImages<InputImageType>( group, images, threads_, false ) ) return 1;
+      for( size_t i=0; i<images.size(); ++i )
+      {
+        if( first == 0 && i == 0 ) size = images[0]->GetLargestPossibleRegion().GetSize();
+        if( images[i]->GetLargestPossibleRegion().GetSize() != size )
+        {
+          std::cerr << "Error: size of " << group[i] << " does not match the first image." << std::endl;
+          return 1;
+        }
+      }
+      std::vector<common::BitPlane> planes;
+      common::packImages<InputImageType>( images, planes, threads_, true );
+      planes_.insert( planes_.end(), planes.begin(), planes.end() );
+    }
+    common::reportPeakRSS( "after packing" );
+    return 0;
+  }
+};
+
+/** one CSV matrix of the n masks, value(i,j) per entry. */
+template < class TValue >
+void printMatrix(const std::string & name, const std::vector<std::string> & filenames, const TValue & value)
+{
+  const size_t n = filenames.size();
+  std::cout << name;
+  for( size_t j=0; j<n; ++j ) std::cout << "," << filenames[j];
+  std::cout << std::endl;
+  for( size_t i=0; i<n; ++i )
+  {
+    std::cout << filenames[i];
+    for( size_t j=0; j<n; ++j ) std::cout << "," << value(i,j);
+    std::cout << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+/** entries of the matrices, from the intersection counts. */
+struct MatrixEntry
+{
+  enum Kind { DICE, TP, FP, FN };
+
+  const std::vector<unsigned long long> & both_;
+  size_t n_;
+  Kind kind_;
+
+  MatrixEntry(const std::vector<unsigned long long> & both, size_t n, Kind kind)
+  :both_(both),
+   n_(n),
+   kind_(kind)
+  {}
+
+  double operator()(size_t i, size_t j) const
+  {
+    const double tp = both_[i*n_ + j];
+    const double first = both_[i*n_ + i];
+    const double second = both_[j*n_ + j];
+    switch( kind_ )
+    {
+      case TP: return tp;
+      case FP: return second - tp;
+      case FN: return first - tp;
+      default: return ( 2.0 * tp ) / ( first + second ) * 100.0;
+    }
+  }
+};
+
+int main(int argc, char ** argv)
+{
+  if( argc < 3 )
+  {
+    std::cerr << "usage: " << argv[0] << " [options] image1.nrrd image2.nrrd [image3.nrrd ...]" << std::endl;
+    std::cerr << "options: -threads N = number of threads (default one per core)" << std::endl;
+    std::cerr << "         -counts = also print the tp, fp and fn matrices" << std::endl;
+    std::cerr << "prints the dice overlap (in percent, like dice) of every pair as a CSV matrix." << std::endl;
+    return 1;
+  }
+
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  bool counts = false;
+  int image_index = 1;
+  while( image_index < argc && argv[image_index][0] == '-' )
+  {
+    std::string option(argv[image_index++]);
+    if( option == "-threads" && image_index < argc )
+    {
+      threads = std::max( 1, atoi(argv[image_index++]) );
+    }
+    else if( option == "-counts" )
+    {
+      counts = true;
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( argc - image_index < 2 )
+  {
+    std::cerr << "Error: need at least two images." << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> filenames( argv + image_index, argv + argc );
+  DiceMatrixRun diceMatrixRun( filenames, threads );
+  int result = common::dispatchScalar<3>( common::componentType( filenames ), diceMatrixRun );
+  if( result != 0 ) return result;
+
+  const std::vector<unsigned long long> both = common::intersections( diceMatrixRun.planes_, threads );
+  const size_t n = filenames.size();
+
+  std::cout << std::setprecision(4);
+  printMatrix( "dice", filenames, MatrixEntry( both, n, MatrixEntry::DICE ) );
+  if( counts )
+  {
+    std::cout << std::setprecision(15);
+    printMatrix( "tp", filenames, MatrixEntry( both, n, MatrixEntry::TP ) );
+    printMatrix( "fp", filenames, MatrixEntry( both, n, MatrixEntry::FP ) );
+    printMatrix( "fn", filenames, MatrixEntry( both, n, MatrixEntry::FN ) );
+  }
+  common::reportPeakRSS( "at exit" );
+  return 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+/**
+ * evaluate - runs a manifest of dice, xoroverlap and staple jobs in one process,
+ * decoding each file at most once while the cache budget holds and sharing it
+ * between the jobs that use it.
+ *
+ * The manifest is CSV, one job a line: the metric, then its files in the order the
+ * tool takes them.
+ *
+ *   dice,image1.nrrd,image2.nrrd
+ *   xoroverlap,mask.nrrd,image1.nrrd,image2.nrrd
+ *   staple,output.nrrd,rater1.nrrd,...,raterN.nrrd,mask.nrrd
+ *
+ * (a staple job with an empty output only reports).  Blank lines, lines starting
+ * with # and a "metric,..." header are skipped.  The jobs run on a pool of threads
+ * over a common::VolumeCache, and the results of all of them are printed as one CSV
+ * of job,metric,key,value lines, in manifest order.
+ *
+ * Volumes are cached in the pixel type all the files of the manifest are stored in
+ * (a binary mask stays one byte a voxel), or as float when the types differ, the way
+ * the tools read files of mixed types; see common::dispatchScalar.
+ */
+
+#include <vector>
+#include <set>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <algorithm>
+
+#include <itkImage.h>
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+
+#include "map.h"
+#include "staple.h"
+#include "Overlap.h"
+#include "RunLength.h"
+#include "VolumeCache.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
+
+/**
+ * Job - one line of the manifest.
+ */
+struct Job
+{
+  std::string metric;
+  std::vector<std::string> files;
+  std::string output; // staple only
+};
+
+/** the fields of a CSV line, trimmed of spaces. */
+std::vector<std::string> splitFields(const std::string & line)
+{
+  std::vector<std::string> fields;
+  std::istringstream in( line );
+  std::string field;
+  while( std::getline( in, field, ',' ) )
+  {
+    const size_t first = field.find_first_not_of( " \t\r" );
+    fields.push_back( first == std::string::npos ? std::string() :
+                      field.substr( first, field.find_last_not_of( " \t\r" ) - first + 1 ) );
+  }
+  return fields;
+}
+
+/**
+ * readJobs - the jobs of a manifest, see the top of this file.  Returns false (after
+ * printing an error) if it can not be read or a line is not a job.
+ */
+bool readJobs(const std::string & filename, std::vector<Job> & jobs)
+{
+  std::ifstream in( filename.c_str() );
+  if( !in )
+  {
+    std::cerr << "Error: could not open manifest " << filename << std::endl;
+    return false;
+  }
+  std::string line;
+  size_t lineNumber = 0;
+  while( std::getline( in, line ) )
+  {
+    ++lineNumber;
+    std::vector<std::string> fields = splitFields( line );
+    if( fields.empty() || fields[0].empty() || fields[0][0] == '#' || fields[0] == "metric" ) continue;
+    Job job;
+    job.metric = fields[0];
+    size_t first = 1;
+    size_t needed = 0;
+    if( job.metric == "dice" ) needed = 2;
+    else if( job.metric == "xoroverlap" ) needed = 3;
+    else if( job.metric == "staple" && fields.size() >= 2 )
+    {
+      job.output = fields[1];
+      first = 2;
+      needed = std::max<size_t>( 3, fields.size() - first );
+    }
+    job.files.assign( fields.begin() + std::min( first, fields.size() ), fields.end() );
+    bool complete = needed > 0 && job.files.size() == needed;
+    for( size_t i=0; complete && i<job.files.size(); ++i ) complete = !job.files[i].empty();
+    if( !complete )
+    {
+      std::cerr << "Error: line " << lineNumber << " of " << filename << " is not a dice, xoroverlap or staple job"
+                << " (staple needs an output field, at least two raters and a mask)." << std::endl;
+      return false;
+    }
+    jobs.push_back( job );
+  }
+  return true;
+}
+
+/**
+ * EvaluateFunctor - common::each functor that runs one job of the manifest, with
+ * its volumes from the shared cache, into the job's own CSV lines.
+ *
+ * dice and xoroverlap count straight from the buffers on the job's own thread, so
+ * any number of them can share a volume; staple jobs run one at a time, spread over
+ * all the cores by staple itself, since its filters touch their inputs' pipelines.
+ */
+template < class ImageType >
+struct EvaluateFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+
+  const std::vector<Job> & jobs_;
+  common::VolumeCache<ImageType> & cache_;
+  std::vector<std::string> results_;
+  std::vector<char> ok_;
+  itk::SimpleFastMutexLock stapleLock_;
+
+  EvaluateFunctor(const std::vector<Job> & jobs, common::VolumeCache<ImageType> & cache)
+  :jobs_(jobs),
+   cache_(cache),
+   results_(jobs.size()),
+   ok_(jobs.size(), false)
+  {}
+
+  void operator()(size_t k)
+  {
+    const Job & job = jobs_[k];
+    std::vector<ImagePointer> images;
+    std::vector<std::string> keys;
+    for( size_t i=0; i<job.files.size(); ++i )
+    {
+      std::string key;
+      ImagePointer image = cache_.acquire( job.files[i], key );
+      if( image.IsNull() ) break;
+      images.push_back( image );
+      keys.push_back( key );
+    }
+
+    std::ostringstream out;
+    bool ok = images.size() == job.files.size();
+    for( size_t i=1; ok && i<images.size(); ++i )
+    {
+      ok = images[i]->GetLargestPossibleRegion().GetSize() == images[0]->GetLargestPossibleRegion().GetSize();
+      if( !ok ) std::cerr << "Error: job " << k << ": size of " << job.files[i] << " does not match " << job.files[0] << std::endl;
+    }
+    if( ok )
+    {
+      if( job.metric == "dice" ) dice( images, out );
+      else if( job.metric == "xoroverlap" ) xorOverlap( images, out );
+      else ok = staple( k, images, out );
+    }
+
+    for( size_t i=0; i<keys.size(); ++i ) cache_.release( keys[i] );
+    images.clear();
+    ok_[k] = ok;
+
+    // prefix every key,value line with the job.
+    std::istringstream lines( out.str() );
+    std::ostringstream result;
+    std::string line;
+    while( std::getline( lines, line ) )
+    {
+      if( !line.empty() ) result << k << "," << job.metric << "," << line << std::endl;
+    }
+    if( !ok ) result << k << "," << job.metric << ",error,failed" << std::endl;
+    results_[k] = result.str();
+  }
+
+  /** the counts and percent overlap of dice. */
+  void dice(const std::vector<ImagePointer> & images, std::ostream & out)
+  {
+    common::OverlapCounts counts;
+    common::countSpan( images[0]->GetBufferPointer(), images[1]->GetBufferPointer(),
+                       images[0]->GetBufferedRegion().GetNumberOfPixels(), counts );
+    const common::DiceCounts dice( counts, images[0]->GetBufferedRegion().GetNumberOfPixels() );
+    out << std::setprecision(4) << "dice," << dice.dice << std::endl;
+    out << "tp," << dice.tp << std::endl;
+    out << "fp," << dice.fp << std::endl;
+    out << "tn," << dice.tn << std::endl;
+    out << "fn," << dice.fn << std::endl;
+  }
+
+  /** the percent xor overlap of xoroverlap, over the spans of the mask. */
+  void xorOverlap(const std::vector<ImagePointer> & images, std::ostream & out)
+  {
+    common::RunLengthMask mask;
+    common::encode<ImageType>( images[0], mask, 1, true );
+    const long long num_mask = mask.count();
+    const long long num_xor = common::countXor<ImageType>( common::spans( mask ), images[1], images[2], 1 );
+    out << std::setprecision(4) << "xor_overlap," << static_cast<double>( num_mask - num_xor ) / num_mask * 100.0 << std::endl;
+  }
+
+  /** the CSV report of staple, writing the consensus if the job has an output. */
+  bool staple(size_t k, const std::vector<ImagePointer> & images, std::ostream & out)
+  {
+    StapleOptions options;
+    StapleResult<ImageType> result;
+    stapleLock_.Lock();
+    bool ok = computeStaple<ImageType>( images, options, result, out, 0 );
+    if( ok && !jobs_[k].output.empty() ) ok = writeStapleResult<ImageType>( jobs_[k].output, result, options );
+    stapleLock_.Unlock();
+    return ok;
+  }
+};
+
+/**
+ * EvaluateRun - runs the jobs over a cache of volumes in one pixel type and prints
+ * their results, see common::dispatchScalar.
+ */
+struct EvaluateRun
+{
+  const std::vector<Job> & jobs_;
+  size_t threads_;
+  size_t cacheBytes_;
+
+  EvaluateRun(const std::vector<Job> & jobs, size_t threads, size_t cacheBytes)
+  :jobs_(jobs),
+   threads_(threads),
+   cacheBytes_(cacheBytes)
+  {}
+
+  template < class ImageType >
+  int run()
+  {
+    common::VolumeCache<ImageType> cache( cacheBytes_ );
+    for( size_t k=0; k<jobs_.size(); ++k )
+    {
+      for( size_t i=0; i<jobs_[k].files.size(); ++i ) cache.expect( jobs_[k].files[i] );
+    }
+
+    EvaluateFunctor<ImageType> evaluate( jobs_, cache );
+    common::each< EvaluateFunctor<ImageType> >::run( evaluate, jobs_.size(), threads_ );
+
+    size_t failed = 0;
+    std::cout << "job,metric,key,value" << std::endl;
+    for( size_t k=0; k<jobs_.size(); ++k )
+    {
+      std::cout << evaluate.results_[k];
+      if( !evaluate.ok_[k] ) ++failed;
+    }
+    std::cerr << jobs_.size() << " jobs, " << failed << " failed; " << cache.decodes() << " decodes ("
+              << cache.redecodes() << " of files evicted earlier), " << cache.hits() << " cache hits" << std::endl;
+    common::reportPeakRSS( "at exit" );
+    return failed == 0 ? 0 : 1;
+  }
+};
+
+int main(int argc, char ** argv)
+{
+  if( argc < 2 )
+  {
+    std::cerr << "usage: " << argv[0] << " [options] manifest.csv" << std::endl;
+    std::cerr << "options: -threads N = jobs run at once (default one per core)" << std::endl;
+    std::cerr << "         -cache MB = decoded volumes kept between jobs (default 1024)" << std::endl;
+    std::cerr << "manifest lines: dice,image1,image2 | xoroverlap,mask,image1,image2 |" << std::endl;
+    std::cerr << "                staple,output,rater1,...,raterN,mask (empty output = report only)" << std::endl;
+    std::cerr << "prints job,metric,key,value CSV for every job, in manifest order." << std::endl;
+    return 1;
+  }
+
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  size_t cacheBytes = size_t(1024) * 1024 * 1024;
+  int arg = 1;
+  while( arg < argc && argv[arg][0] == '-' )
+  {
+    std::string option(argv[arg++]);
+    if( option == "-threads" && arg < argc )
+    {
+      threads = std::max( 1, atoi(argv[arg++]) );
+    }
+    else if( option == "-cache" && arg < argc )
+    {
+      cacheBytes = static_cast<size_t>( std::max( 0.0, atof(argv[arg++]) ) * 1024 * 1024 );
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( argc - arg != 1 )
+  {
+    std::cerr << "Error: need one manifest." << std::endl;
+    return 1;
+  }
+
+  std::vector<Job> jobs;
+  if( !readJobs( argv[arg], jobs ) ) return 1;
+
+  // the type the files share, float if they differ.  Files that can not be read are
+  // left out, their jobs fail on their own.
+  std::set<std::string> files;
+  for( size_t k=0; k<jobs.size(); ++k ) files.insert( jobs[k].files.begin(), jobs[k].files.end() );
+  common::ComponentType type = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  for( std::set<std::string>::const_iterator it = files.begin(); it != files.end(); ++it )
+  {
+    const common::ComponentType next = common::componentType( *it );
+    if( next == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE ) continue;
+    type = type == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE || type == next ? next : itk::ImageIOBase::FLOAT;
+  }
+  if( type == itk::ImageIOBase::UNKNOWNCOMPONENTTYPE ) type = itk::ImageIOBase::FLOAT;
+
+  EvaluateRun evaluateRun( jobs, threads, cacheBytes );
+  return common::dispatchScalar<3>( type, evaluateRun );
+}
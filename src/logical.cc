@@ -25,10 +25,15 @@
 
 
 /**
- * logical - logically combine two mask volumes
+ * logical - logically combine two mask volumes, or any number of them with an
+ * expression (see common::MaskExpression) evaluated in one pass.
  */
 
 #include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
@@ -37,7 +42,10 @@
 #include <itkImageRegionIteratorWithIndex.h>
 #include <itkNumericTraits.h>
 #include <itkExceptionObject.h>
+#include <itkMultiThreader.h>
 
+#include "MaskExpression.h"
+#include "LoadImages.h"
 
 enum Operation
 {
@@ -47,6 +55,102 @@ enum Operation
   NOT
 };
 
+/**
+ * expression mode: [-threads N] -expr <expression> <output.nrrd> <a.nrrd> [b.nrrd ...],
+ * with the arguments from arg on.  The masks are read in parallel, then the
+ * compiled expression is run over them block by block straight into the output.
+ */
+int expression(int argc, char ** argv, int arg)
+{
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::string text;
+  while( arg < argc && argv[arg][0] == '-' )
+  {
+    std::string option(argv[arg++]);
+    if( option == "-threads" && arg < argc )
+    {
+      threads = std::max( 1, atoi(argv[arg++]) );
+    }
+    else if( option == "-expr" && arg < argc )
+    {
+      text = argv[arg++];
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( text.empty() || argc - arg < 2 )
+  {
+    std::cerr << "Error: need an expression, an output and at least one input." << std::endl;
+    return 1;
+  }
+  const std::string outputfn(argv[arg++]);
+  const std::vector<std::string> filenames( argv + arg, argv + argc );
+
+  common::MaskExpression program;
+  if( !program.compile( text, filenames.size() ) )
+  {
+    std::cerr << "Error: " << program.error() << std::endl;
+    return 1;
+  }
+  for( size_t i=0; i<filenames.size(); ++i )
+  {
+    if( !program.used( i ) ) std::cerr << "Warning: " << filenames[i] << " (" << static_cast<char>( 'a' + i ) << ") is not used" << std::endl;
+  }
+
+  typedef itk::Image< unsigned char, 3 > ImageType;
+  std::vector<ImageType::Pointer> inputs( filenames.size() );
+  std::vector<std::string> used;
+  for( size_t i=0; i<filenames.size(); ++i )
+  {
+    if( program.used( i ) ) used.push_back( filenames[i] );
+  }
+  std::vector<ImageType::Pointer> loaded;
+  if( !common::loadImages<ImageType>( used, loaded, threads, false ) ) return 1;
+  for( size_t i=0, k=0; i<filenames.size(); ++i )
+  {
+    if( program.used( i ) ) inputs[i] = loaded[k++];
+  }
+
+  const ImageType::Pointer & first = loaded[0];
+  std::vector<const unsigned char *> masks( filenames.size(), static_cast<const unsigned char *>(0) );
+  for( size_t i=0; i<filenames.size(); ++i )
+  {
+    if( inputs[i].IsNull() ) continue;
+    if( inputs[i]->GetLargestPossibleRegion().GetSize() != first->GetLargestPossibleRegion().GetSize() )
+    {
+      std::cerr << "Error volumes must be equal size (" << filenames[i] << ")" << std::endl;
+      return 1;
+    }
+    masks[i] = inputs[i]->GetBufferPointer();
+  }
+
+  ImageType::Pointer output = ImageType::New();
+  output->SetRegions( first->GetLargestPossibleRegion() );
+  output->Allocate();
+  output->SetOrigin( first->GetOrigin() );
+  output->SetSpacing( first->GetSpacing() );
+  common::evaluate( program, masks, output->GetBufferPointer(), output->GetBufferedRegion().GetNumberOfPixels(), threads );
+
+  typedef itk::ImageFileWriter< ImageType > WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetInput( output );
+  writer->SetFileName( outputfn );
+  writer->UseCompressionOn();
+  try
+  {
+    writer->Update();
+  }
+  catch(itk::ExceptionObject e)
+  {
+    std::cerr << "Error writing file " << outputfn << ": " << e << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 /**
  * thresholds an image creating a binary mask
  */
@@ -56,9 +160,13 @@ int main(int argc, char ** argv)
   if( argc == 1 )
   {
     std::cerr << "usage: " << argv[0] << " <and|or|xor|not> <in1.nrrd> [in2.nrrd] <output.nrrd>" << std::endl;
+    std::cerr << "       " << argv[0] << " [-threads N] -expr <expression> <output.nrrd> <a.nrrd> [b.nrrd ...]" << std::endl;
     std::cerr << "note: when not is used, in2.nrrd should not be given." << std::endl;
+    std::cerr << "expressions name the inputs a, b, c, ... in order and combine them with ~ (not)," << std::endl;
+    std::cerr << "& (and), ^ (xor), | (or) and parentheses, e.g. \"(a & b) | (c & ~d)\"." << std::endl;
     return 1;
   }
+  if( argv[1][0] == '-' ) return expression( argc, argv, 1 );
   std::string operationstr(argv[1]);
   std::string input1fn(argv[2]);
   std::string input2fn;
@@ -5,6 +5,12 @@
 #ifndef __map_H
 #define __map_H
 
+#include <exception>
+#include <iostream>
+
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+
 #include "MapFilter.h"
 #include "ReduceFilter.h"
 
@@ -105,6 +111,99 @@ public:
   }
 };
 
+/**
+ * each is an abstraction of running a list of independent jobs over a pool of threads.
+ *
+ * the passed in functor should have an:
+ *   void operator()(size_t job)
+ *
+ *   jobs 0..numJobs-1 are handed out in order to at most numThreads threads, a thread
+ *   takes the next unclaimed job as soon as it finishes its current one.  The functor
+ *   is shared by all threads, so it should write its results into per-job slots.
+ *
+ *   an exception thrown by a job is caught on its thread and printed, the other jobs
+ *   still run; run() returns the number of jobs that threw.
+ */
+template<class TFunctor>
+struct each
+{
+public:
+  typedef TFunctor FType;
+
+  static
+  size_t
+  run( FType & functor, size_t numJobs, size_t numThreads = 1 )
+  {
+    if(numJobs == 0)
+      return 0;
+    if(numThreads == 0)
+      numThreads = 1;
+    if(numThreads > numJobs)
+      numThreads = numJobs;
+
+    State state;
+    state.functor = &functor;
+    state.next = 0;
+    state.numJobs = numJobs;
+    state.failed = 0;
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numThreads);
+    threader->SetSingleMethod(&each::worker, &state);
+    threader->SingleMethodExecute();
+    return state.failed;
+  }
+
+private:
+  struct State
+  {
+    FType * functor;
+    size_t next;
+    size_t numJobs;
+    size_t failed;
+    itk::SimpleFastMutexLock lock;
+  };
+
+  static
+  void
+  fail( State * state, size_t job, const char * what )
+  {
+    state->lock.Lock();
+    ++state->failed;
+    std::cerr << "Error: job " << job << " failed: " << what << std::endl;
+    state->lock.Unlock();
+  }
+
+  static
+  ITK_THREAD_RETURN_TYPE
+  worker( void * arg )
+  {
+    typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+    State * state = static_cast<State *>( static_cast<ThreadInfo *>(arg)->UserData );
+    while(true)
+    {
+      state->lock.Lock();
+      size_t job = state->next++;
+      state->lock.Unlock();
+      if(job >= state->numJobs)
+        break;
+      try
+      {
+        (*state->functor)(job);
+      }
+      catch(std::exception & e)
+      {
+        fail(state, job, e.what());
+      }
+      catch(...)
+      {
+        fail(state, job, "unknown exception");
+      }
+    }
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+
 } // end namespace
 
 
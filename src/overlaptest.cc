@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+// test that the overlap counts behind dice agree with the loop of the original dice.
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// itk
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+
+// local
+#include "Overlap.h"
+#include "RunLength.h"
+#include "StreamOverlap.h"
+
+typedef itk::Image<float,3> ImageType;
+typedef ImageType::Pointer ImagePointer;
+
+const unsigned int Size = 20;
+const size_t Threads = 4;
+
+// deterministic noise, so every run tests the same volumes.
+struct Noise
+{
+  Noise(unsigned long seed)
+  :state_(seed)
+  {}
+
+  double operator()()
+  {
+    state_ = state_ * 1103515245UL + 12345UL;
+    return static_cast<double>( ( state_ >> 16 ) & 0x7fff ) / 32768.0;
+  }
+
+  unsigned long state_;
+};
+
+/** image - a Size^3 volume of 0, 1 and negative voxels, in about equal numbers. */
+ImagePointer image(unsigned long seed)
+{
+  ImageType::RegionType region;
+  ImageType::SizeType size;
+  size.Fill( Size );
+  region.SetSize( size );
+  ImagePointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  Noise noise( seed );
+  float * voxels = image->GetBufferPointer();
+  const size_t count = region.GetNumberOfPixels();
+  for(size_t v=0; v<count; ++v)
+  {
+    const double r = noise();
+    voxels[v] = r < 1.0 / 3 ? 0.0f : r < 2.0 / 3 ? 1.0f : -1.0f;
+  }
+  return image;
+}
+
+/** the counts of the original dice: tn is the voxels that are 0 in both. */
+common::OverlapCounts reference(const ImagePointer & first, const ImagePointer & second)
+{
+  common::OverlapCounts counts;
+  const float * a = first->GetBufferPointer();
+  const float * b = second->GetBufferPointer();
+  const size_t count = first->GetBufferedRegion().GetNumberOfPixels();
+  for(size_t v=0; v<count; ++v)
+  {
+    if(a[v] > 0) ++counts.first;
+    if(b[v] > 0) ++counts.second;
+    if(a[v] > 0 && b[v] > 0) ++counts.both;
+    if(a[v] == 0 && b[v] == 0) ++counts.neither;
+  }
+  return counts;
+}
+
+/** write image to filename as a gzip nrrd, false if that fails. */
+bool write(const ImagePointer & image, const std::string & filename)
+{
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetInput( image );
+  writer->SetFileName( filename );
+  writer->UseCompressionOn();
+  try
+  {
+    writer->Update();
+  }
+  catch(itk::ExceptionObject & e)
+  {
+    std::cerr << "could not write " << filename << ": " << e << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/** false (after a message) if counts differ from expected. */
+bool compare(const std::string & name, const common::OverlapCounts & counts, const common::OverlapCounts & expected)
+{
+  const bool ok = counts.first == expected.first && counts.second == expected.second &&
+                  counts.both == expected.both && counts.neither == expected.neither;
+  if(!ok)
+  {
+    std::cerr << name << ": counts " << counts.first << " " << counts.second << " " << counts.both << " "
+              << counts.neither << ", expected " << expected.first << " " << expected.second << " "
+              << expected.both << " " << expected.neither << std::endl;
+  }
+  std::cerr << name << ": " << ( ok ? "ok" : "FAILED" ) << std::endl;
+  return ok;
+}
+
+/** false (after a message) if the dice rows of counts differ from those the original dice prints for expected. */
+bool compareDice(const std::string & name, const common::OverlapCounts & counts, const common::OverlapCounts & expected,
+                 unsigned long long total)
+{
+  const common::DiceCounts dice( counts, total );
+  const long long tp = expected.both;
+  const long long fp = expected.second - expected.both;
+  const long long tn = expected.neither;
+  const long long fn = ( total - expected.second ) - expected.neither;
+  const bool ok = static_cast<long long>(dice.tp) == tp && static_cast<long long>(dice.fp) == fp &&
+                  static_cast<long long>(dice.tn) == tn && static_cast<long long>(dice.fn) == fn;
+  if(!ok)
+  {
+    std::cerr << name << ": tp fp tn fn " << dice.tp << " " << dice.fp << " " << dice.tn << " " << dice.fn
+              << ", expected " << tp << " " << fp << " " << tn << " " << fn << std::endl;
+  }
+  std::cerr << name << ": " << ( ok ? "ok" : "FAILED" ) << std::endl;
+  return ok;
+}
+
+int main(int, char * [])
+{
+  bool ok = true;
+
+  const ImagePointer first = image( 1 );
+  const ImagePointer second = image( 2 );
+  const common::OverlapCounts expected = reference( first, second );
+
+  ok &= compare( "dense", common::countOverlap<ImageType>( first, second, Threads ), expected );
+
+  // evaluate's dice rows: one countSpan over the whole buffers.
+  const size_t total = first->GetBufferedRegion().GetNumberOfPixels();
+  common::OverlapCounts whole;
+  common::countSpan( first->GetBufferPointer(), second->GetBufferPointer(), total, whole );
+  ok &= compareDice( "evaluate dice rows", whole, expected, total );
+
+  // the run-length path needs the negative voxels to tell them from 0.
+  common::RunLengthMask masks[2], negatives[2];
+  common::encode<ImageType>( first, masks[0], Threads, true, &negatives[0] );
+  common::encode<ImageType>( second, masks[1], Threads, true, &negatives[1] );
+  ok &= compare( "run-length", common::countOverlap( masks[0], masks[1], Threads, 0, &negatives[0], &negatives[1] ),
+                 expected );
+
+  // the streaming path, in chunks that end mid-row.
+  const std::string names[2] = { "overlaptest_first.nrrd", "overlaptest_second.nrrd" };
+  if(write( first, names[0] ) && write( second, names[1] ))
+  {
+    common::StreamOverlap stream( 1000 );
+    if(stream.run( names[0], names[1] )) ok &= compare( "stream", stream.counts(), expected );
+    else ok = false;
+  }
+  else ok = false;
+  remove( names[0].c_str() );
+  remove( names[1].c_str() );
+
+  return ok ? 0 : 1;
+}
@@ -29,67 +29,255 @@
  */
 
 #include <vector>
+#include <string>
 #include <iostream>
+#include <cstdlib>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
+#include <itkMultiThreader.h>
 #include <itkNrrdImageIO.h>
 
 #include "staple.h"
+#include "StapleBatch.h"
+#include "SlabStaple.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
+#include "LoadImages.h"
+
+/**
+ * StapleRun - reads the inputs in their stored pixel type and runs staple on them,
+ * see common::dispatchScalar.
+ */
+struct StapleRun
+{
+  const std::vector<std::string> & filenames_;
+  const std::string & outname_;
+  const StapleOptions & options_;
+
+  StapleRun(const std::vector<std::string> & filenames, const std::string & outname, const StapleOptions & options)
+  :filenames_(filenames),
+   outname_(outname),
+   options_(options)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    // read in the images, a few files decoding at once...
+    std::vector<typename InputImageType::Pointer> images;
+    size_t threads = options_.load_threads;
+    if ( threads == 0 ) threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    if ( !common::loadImages<InputImageType>( filenames_, images, threads ) )
+    {
+      return 1;
+    }
+    common::reportPeakRSS( "after loading" );
+
+    // run the staple algorithm with comparisons...
+    if ( options_.multi_label )
+    {
+      runMultiLabelStaple<InputImageType>( images, outname_, options_ );
+    }
+    else
+    {
+      runStaple<InputImageType>( images, outname_, options_ );
+    }
+    common::reportPeakRSS( "at exit" );
+    return 0;
+  }
+};
+
+/**
+ * BatchRun - runs the cases of a manifest through a StapleBatch, all in one pixel type.
+ */
+struct BatchRun
+{
+  const std::vector<BatchCase> & cases_;
+  const StapleOptions & options_;
+
+  BatchRun(const std::vector<BatchCase> & cases, const StapleOptions & options)
+  :cases_(cases),
+   options_(options)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    std::ofstream traceFile;
+    if ( !options_.trace_file.empty() )
+    {
+      traceFile.open( options_.trace_file.c_str() );
+      if ( !traceFile )
+      {
+        std::cerr << "Error: could not open " << options_.trace_file << " for writing." << std::endl;
+        return 1;
+      }
+    }
+    StapleBatch<InputImageType> batch( cases_, options_, traceFile.is_open() ? &traceFile : 0 );
+    const size_t failed = batch.run();
+    common::reportPeakRSS( "at exit" );
+    return failed == 0 ? 0 : 1;
+  }
+};
 
 int main(int argc, char ** argv)
 {
 
   if( argc < 3 )
   {
-    std::cerr << "usage: " << argv[0] << " [-rr] image1.nrrd image2.nrrd [image3.nrrd ...] mask.nrrd outimage.nrrd" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [options] image1.nrrd image2.nrrd [image3.nrrd ...] mask.nrrd outimage.nrrd" << std::endl;
+    std::cerr << "       " << argv[0] << " [options] -batch manifest.txt" << std::endl;
     std::cerr << "options: -rr = run round robin comparison on inputs" << std::endl;
+    std::cerr << "         -rrthreads N = number of round robin runs in flight at once (default 1, 0 = one per core)" << std::endl;
+    std::cerr << "         -warm = start each round robin run from the full run's estimate (adds iteration counts to the CSV)" << std::endl;
+    std::cerr << "         -loadthreads N = number of input files read at once (default 0 = one per core)" << std::endl;
+    std::cerr << "         -ignoreslices N = skip N slices past the first and last slice where all inputs have a value" << std::endl;
+    std::cerr << "         -cropped = write only the region around the inputs, with its origin" << std::endl;
+    std::cerr << "         -maxiters N = stop EM after N iterations (default: run to convergence)" << std::endl;
+    std::cerr << "         -tolerance T = converged when no sensitivity/specificity moves more than T (default 1e-14, 1e-5 with -multilabel)" << std::endl;
+    std::cerr << "         -confidence W = confidence weight, scales the foreground prior (default 1)" << std::endl;
+    std::cerr << "         -trace file.json = write one JSON line per EM iteration to file.json (adds iteration counts to the CSV)" << std::endl;
+    std::cerr << "         -engine itk|dense|bitplane|disagreement = STAPLE implementation (default itk)" << std::endl;
+    std::cerr << "         -batch manifest.txt = run one case per line (raters, mask, output), reading the next case" << std::endl;
+    std::cerr << "                               and writing the previous one while the current one runs" << std::endl;
+    std::cerr << "         -outofcore = stream the inputs from disk a slab at a time instead of loading them" << std::endl;
+    std::cerr << "         -memory MB = memory budget: -batch steps estimated over it do not overlap (default 0 = no limit)," << std::endl;
+    std::cerr << "                      -outofcore slabs stay within it (default 64)" << std::endl;
+    std::cerr << "         -multilabel = inputs are label maps (0 = background), run multi-label STAPLE" << std::endl;
     return 1;
   }
   
-  // setup ITK types...
-  typedef   float  InputPixelType;
-  typedef itk::Image< InputPixelType,  3 >   InputImageType;
-  typedef itk::ImageFileReader< InputImageType  >  ReaderType;
-
-  // read in the images...
-  std::vector<InputImageType::Pointer> images;
-
   size_t image_index = 1;
-  bool round_robin = false;
-  std::string option(argv[1]);
-  if( option == "-rr" )
+  StapleOptions options;
+  std::string manifest;
+  while( image_index < static_cast<size_t>(argc) && argv[image_index][0] == '-' )
   {
-    ++image_index;
-    round_robin = true;
+    std::string option(argv[image_index++]);
+    if( option == "-rr" )
+    {
+      options.round_robin = true;
+    }
+    else if( option == "-warm" )
+    {
+      options.warm_start = true;
+    }
+    else if( option == "-rrthreads" && image_index < static_cast<size_t>(argc) )
+    {
+      options.round_robin_threads = atoi(argv[image_index++]);
+    }
+    else if( option == "-loadthreads" && image_index < static_cast<size_t>(argc) )
+    {
+      options.load_threads = atoi(argv[image_index++]);
+    }
+    else if( option == "-cropped" )
+    {
+      options.cropped_output = true;
+    }
+    else if( option == "-ignoreslices" && image_index < static_cast<size_t>(argc) )
+    {
+      options.ignore_slices = atoi(argv[image_index++]);
+    }
+    else if( option == "-maxiters" && image_index < static_cast<size_t>(argc) )
+    {
+      options.controls.maximumIterations = atoi(argv[image_index++]);
+    }
+    else if( option == "-tolerance" && image_index < static_cast<size_t>(argc) )
+    {
+      options.controls.tolerance = atof(argv[image_index++]);
+      options.tolerance_set = true;
+    }
+    else if( option == "-confidence" && image_index < static_cast<size_t>(argc) )
+    {
+      options.confidence_weight = atof(argv[image_index++]);
+    }
+    else if( option == "-trace" && image_index < static_cast<size_t>(argc) )
+    {
+      options.trace_file = argv[image_index++];
+    }
+    else if( option == "-batch" && image_index < static_cast<size_t>(argc) )
+    {
+      manifest = argv[image_index++];
+    }
+    else if( option == "-memory" && image_index < static_cast<size_t>(argc) )
+    {
+      options.memory_budget = static_cast<size_t>( atof(argv[image_index++]) * 1024 * 1024 );
+    }
+    else if( option == "-outofcore" )
+    {
+      options.out_of_core = true;
+    }
+    else if( option == "-multilabel" )
+    {
+      options.multi_label = true;
+    }
+    else if( option == "-engine" && image_index < static_cast<size_t>(argc) )
+    {
+      std::string engine(argv[image_index++]);
+      if( engine == "itk" ) options.engine = ENGINE_ITK;
+      else if( engine == "dense" ) options.engine = ENGINE_DENSE;
+      else if( engine == "bitplane" ) options.engine = ENGINE_BITPLANE;
+      else if( engine == "disagreement" ) options.engine = ENGINE_DISAGREEMENT;
+      else
+      {
+        std::cerr << "Error: unknown engine " << engine << std::endl;
+        return 1;
+      }
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
   }
 
-  for( int i=image_index; i<argc-1; ++i )
+  if( !manifest.empty() )
   {
-    ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName( argv[i] );
-    InputImageType::Pointer image = reader->GetOutput();
-    reader->Update();
-    images.push_back(image);
+    if( options.multi_label || options.out_of_core )
+    {
+      std::cerr << "Error: -multilabel and -outofcore are not supported with -batch." << std::endl;
+      return 1;
+    }
+    std::vector<BatchCase> cases;
+    if( !readManifest( manifest, cases ) )
+    {
+      return 1;
+    }
+    if( cases.empty() )
+    {
+      std::cerr << "Error: no cases in " << manifest << std::endl;
+      return 1;
+    }
+    std::vector<std::string> all;
+    for( size_t k=0; k<cases.size(); ++k )
+    {
+      all.insert( all.end(), cases[k].inputs.begin(), cases[k].inputs.end() );
+    }
+    BatchRun batchRun( cases, options );
+    return common::dispatchScalar<3>( common::componentType( all ), batchRun );
   }
 
+  std::vector<std::string> filenames;
+  for( int i=image_index; i<argc-1; ++i )
+  {
+    filenames.push_back( argv[i] );
+  }
   std::string outname( argv[argc-1] );
 
-  // debug:
-  /*
-  for( size_t i=0; i<images.size(); ++i )
+  if( options.out_of_core )
   {
-    std::cout << i << ": (" << images[i]->GetLargestPossibleRegion().GetSize()[0]
-              << ", " << images[i]->GetLargestPossibleRegion().GetSize()[1]
-              << ", " << images[i]->GetLargestPossibleRegion().GetSize()[2]
-              << ")" << std::endl;
+    if( options.multi_label )
+    {
+      std::cerr << "Error: -multilabel is not supported with -outofcore." << std::endl;
+      return 1;
+    }
+    runSlabStaple( filenames, outname, options );
+    common::reportPeakRSS( "at exit" );
+    return 0;
   }
-  */
 
-
-  // run the staple algorithm with comparisons...
-  runStaple<InputImageType>( images, outname, round_robin ); 
-
-  return 0;
+  // binary inputs stay in their stored type (usually one byte per voxel), mixed
+  // types are read as float.
+  StapleRun stapleRun( filenames, outname, options );
+  return common::dispatchScalar<3>( common::componentType( filenames ), stapleRun );
 }
-
@@ -30,215 +30,755 @@
  * produce the same results.
  */
 
+#ifndef __staple_H
+#define __staple_H
+
 #include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
 
 #include <itkSTAPLEImageFilter.h>
 #include <itkImageRegionIteratorWithIndex.h>
-#include <itkImageSliceConstIteratorWithIndex.h>
 #include <itkRegionOfInterestImageFilter.h>
 #include <itkExtractImageFilter.h>
-#include <itkImageFileWriter.h>
+#include <itkMultiThreader.h>
 
-template < class ImageType >
-void runStaple(const std::vector<typename ImageType::Pointer> & images, const std::string & outname, bool round_robin)
+#include "map.h"
+#include "StapleEM.h"
+#include "BitPlaneEngine.h"
+#include "DisagreementEngine.h"
+#include "SliceOccupancy.h"
+#include "NrrdStream.h"
+#include "MultiLabelStaple.h"
+
+/**
+ * CropBox - the region of interest the staple scan crops to.
+ *
+ * The scan visits the voxels in raster order and, at every voxel where some input
+ * is non-zero, moves each bound the voxel lies outside of to PAD voxels past it
+ * (within the image).  A bound only moves for a voxel outside it, so the region
+ * depends on the order of the voxels and not just on their extent.  Only a voxel
+ * further out than all the ones before it can move a bound, so a CropBox keeps
+ * those, the running minima and maxima of each index.  Pieces of the volume can
+ * be scanned apart, appended in raster order and replayed by bounds().
+ */
+template < unsigned int Dimension >
+struct CropBox
 {
-    size_t ignoreSlices = 0;
-    // bounding box ImageType
-    typedef typename ImageType::RegionType RegionType;
-    typedef itk::ImageRegionIteratorWithIndex<ImageType> RegionIteratorType;
-    std::vector<RegionIteratorType> iterators;
-    for( unsigned int i=0; i<images.size(); ++i )
+  enum { PAD = 2 };
+
+  CropBox() : offset(0) {}
+
+  size_t offset;                   // of the first voxel of the piece scanned
+  std::vector<long> lows[Dimension];  // running minima of each index, in visiting order
+  std::vector<long> highs[Dimension]; // running maxima
+
+  bool empty() const { return lows[0].empty(); }
+
+  /** the next non-zero voxel, in raster order. */
+  template < class IndexType >
+  void add(const IndexType & index)
+  {
+    for(unsigned int d=0; d<Dimension; ++d)
     {
-      RegionIteratorType it( images[i], images[i]->GetLargestPossibleRegion() );
-      iterators.push_back(it);
+      if(lows[d].empty() || index[d] < lows[d].back()) lows[d].push_back( index[d] );
+      if(highs[d].empty() || index[d] > highs[d].back()) highs[d].push_back( index[d] );
     }
+  }
 
-    typename RegionType::SizeType  imgSize   = images[0]->GetLargestPossibleRegion().GetSize();
-    typename RegionType::IndexType imgCorner = images[0]->GetLargestPossibleRegion().GetIndex();
+  /** append the piece scanned after this one. */
+  void add(const CropBox & other)
+  {
+    for(unsigned int d=0; d<Dimension; ++d)
+    {
+      lows[d].insert( lows[d].end(), other.lows[d].begin(), other.lows[d].end() );
+      highs[d].insert( highs[d].end(), other.highs[d].begin(), other.highs[d].end() );
+    }
+  }
 
-    // Search for bounding box.
-    const unsigned int PAD = 2;
-    typename ImageType::IndexType idx;
-    typename ImageType::IndexType lower = imgCorner + imgSize;
-    typename ImageType::IndexType upper = imgCorner;
+  /** the padded region [lower,upper] of an image of size size, false if no voxel was added. */
+  template < class IndexType, class SizeType >
+  bool bounds(const SizeType & size, IndexType & lower, IndexType & upper) const
+  {
+    for(unsigned int d=0; d<Dimension; ++d)
+    {
+      lower[d] = size[d];
+      upper[d] = 0;
+      for(size_t k=0; k<lows[d].size(); ++k)
+      {
+        if(lows[d][k] < lower[d]) lower[d] = std::max<long>( lows[d][k] - PAD, 0 );
+      }
+      for(size_t k=0; k<highs[d].size(); ++k)
+      {
+        if(highs[d][k] > upper[d]) upper[d] = std::min<long>( highs[d][k] + PAD, static_cast<long>(size[d]) - 1 );
+      }
+    }
+    return !empty();
+  }
+};
 
-    typename ImageType::IndexType nonZeroIndex;
+/** orders pieces of a scan by where they start. */
+template < class BoxType >
+bool scannedBefore(const BoxType & a, const BoxType & b)
+{
+  return a.offset < b.offset;
+}
 
-    while ( !iterators[0].IsAtEnd() )
+/**
+ * BoundingBoxFunctor - common::reduce functor that finds the CropBox of all
+ * non-zero voxels over a list of images of the same size.
+ *
+ * Each thread scans the raw buffers of every image over its region, one line at a
+ * time, and returns the CropBox of its region.  Within a line only the first
+ * non-zero voxel can lower a bound or raise the upper bounds of the line's other
+ * indices, and only voxels past the largest first index seen so far can raise
+ * its upper bound, so the rest of a line is skipped.  The pieces are appended in
+ * raster order at the end.
+ */
+template < class ImageType >
+struct BoundingBoxFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef typename ImageType::SizeType SizeType;
+  typedef typename ImageType::PixelType PixelType;
+
+  typedef CropBox<ImageType::ImageDimension> Box;
+  typedef std::vector<Box> BoxList;
+
+  const std::vector<ImagePointer> & images_;
+
+  BoundingBoxFunctor(const std::vector<ImagePointer> & images)
+  :images_(images)
+  {}
+
+  Box operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    Box box;
+    const IndexType start = threadRegion.GetIndex();
+    const SizeType size = threadRegion.GetSize();
+    if(threadRegion.GetNumberOfPixels() == 0) return box;
+    const size_t lineLength = size[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    box.offset = images_[0]->ComputeOffset(start);
+
+    std::vector<const PixelType *> rows(images_.size());
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
     {
-      bool nonZeroValue = false;
-      for ( unsigned int i=0; i<iterators.size(); ++i )
+      // first voxel of the line where some image is non-zero.
+      size_t first = lineLength;
+      for(size_t i=0; i<images_.size(); ++i)
       {
-        if ( iterators[i].Get() != 0.f )
-        {
-          idx = iterators[i].GetIndex();
-          nonZeroIndex = idx;
-          nonZeroValue = true;
-          break;
-        }
+        rows[i] = images_[i]->GetBufferPointer() + images_[i]->ComputeOffset(line);
+        size_t x = 0;
+        while(x < first && rows[i][x] == 0) ++x;
+        first = x;
       }
-
-      if (nonZeroValue) 
+      if(first < lineLength)
       {
-        for ( unsigned int i=0; i<idx.GetIndexDimension(); ++i)
+        IndexType idx = line;
+        idx[0] = start[0] + first;
+        box.add(idx);
+        for(size_t x = std::max<long>( first, box.highs[0].back() - start[0] ) + 1; x < lineLength; ++x)
         {
-          if (lower[i] > idx[i]) 
-          {
-            lower[i] = static_cast<long unsigned int>(std::max<long signed int>( static_cast<long signed int>(idx[i] - PAD), 0 ));
-          }
-          if (upper[i] < idx[i]) 
+          for(size_t i=0; i<images_.size(); ++i)
           {
-            upper[i] = static_cast<long unsigned int>(std::min<long signed int>( static_cast<long signed int>(idx[i] + PAD), imgSize[i]-1 ));
+            if(rows[i][x] != 0)
+            {
+              box.highs[0].push_back( start[0] + x );
+              break;
+            }
           }
         }
       }
-
-      // advance all the iterators:
-      for ( unsigned int i=0; i<iterators.size(); ++i )
+      // next line
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
       {
-        ++(iterators[i]);
+        if(++line[d] < start[d] + static_cast<long>(size[d])) break;
+        line[d] = start[d];
       }
     }
+    return box;
+  }
 
-    typename RegionType::SizeType regionSize;
-    for (unsigned int i = 0; i < regionSize.GetSizeDimension(); ++i)
+  Box operator()(const BoxList & boxes)
+  {
+    BoxList pieces( boxes );
+    std::stable_sort( pieces.begin(), pieces.end(), scannedBefore<Box> );
+    Box box;
+    for(typename BoxList::const_iterator it=pieces.begin(); it!=pieces.end(); ++it)
     {
-      regionSize[i] = upper[i] - lower[i] ;
+      box.add( *it );
     }
+    return box;
+  }
+};
 
-    RegionType regionOfInterest;
-    regionOfInterest.SetSize(regionSize);
-    regionOfInterest.SetIndex(lower);
+/**
+ * OverlapMatrix - foreground counts of a list of raters and of every pair of them.
+ */
+struct OverlapMatrix
+{
+  OverlapMatrix(size_t raters = 0)
+  :count(raters, 0),
+   both(raters*raters, 0)
+  {}
 
-    // Further reduce the region to exclude top and bottom N slices, as indicated by the filter.
-    // By top N slices we mean the top and bottom N slices where all images have a value.
-    size_t sliceIndex = 2;
-    typedef itk::ImageSliceConstIteratorWithIndex< ImageType > SliceIteratorType;
-    std::vector< SliceIteratorType > sliceIterators;
-    for( size_t i=0; i<images.size(); ++i )
-    {
-      SliceIteratorType sliceIt( images[i], regionOfInterest );
-      sliceIterators.push_back( sliceIt );
-    }
-    while( (ignoreSlices) > 0 && ! sliceIterators[0].IsAtEnd() )
+  std::vector<unsigned long> count; // foreground voxels of rater i
+  std::vector<unsigned long> both;  // voxels where raters i and j are both foreground, at i*raters+j (i<j)
+
+  size_t raters() const { return count.size(); }
+
+  unsigned long intersection(size_t i, size_t j) const
+  {
+    return i < j ? both[i*raters() + j] : both[j*raters() + i];
+  }
+
+  /** dice overlap of raters i and j. */
+  double overlap(size_t i, size_t j) const
+  {
+    return (2*static_cast<double>(intersection(i,j))) / (count[i] + count[j]);
+  }
+
+  void add(const OverlapMatrix & other)
+  {
+    for(size_t i=0; i<count.size() && i<other.count.size(); ++i) count[i] += other.count[i];
+    for(size_t k=0; k<both.size() && k<other.both.size(); ++k) both[k] += other.both[k];
+  }
+};
+
+/**
+ * OverlapMatrixFunctor - common::reduce functor that fills an OverlapMatrix for a list
+ * of images of the same size in one pass.
+ *
+ * Each line is first turned into one byte mask per rater, then every pair of masks is
+ * intersected over the line, so the inner loops run over contiguous memory.
+ */
+template < class ImageType >
+struct OverlapMatrixFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::RegionType RegionType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef typename ImageType::PixelType PixelType;
+  typedef std::vector<OverlapMatrix> MatrixList;
+
+  const std::vector<ImagePointer> & images_;
+
+  OverlapMatrixFunctor(const std::vector<ImagePointer> & images)
+  :images_(images)
+  {}
+
+  OverlapMatrix operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    const size_t R = images_.size();
+    OverlapMatrix matrix(R);
+    if(threadRegion.GetNumberOfPixels() == 0) return matrix;
+
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    std::vector<unsigned char> masks(R * lineLength);
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
     {
-      std::vector<bool> nonZero(sliceIterators.size());
-      for(size_t i=0; i<sliceIterators.size(); ++i) { nonZero[i] = false; }
-      bool allNonZero = true;
-      while( ! sliceIterators[0].IsAtEndOfSlice() )
+      for(size_t i=0; i<R; ++i)
       {
-        while( ! sliceIterators[0].IsAtEndOfLine() )
+        const PixelType * row = images_[i]->GetBufferPointer() + images_[i]->ComputeOffset(line);
+        unsigned char * mask = &masks[i*lineLength];
+        unsigned long count = 0;
+        for(size_t x=0; x<lineLength; ++x)
         {
-          allNonZero = true;
-          for( size_t i=0; i<sliceIterators.size(); ++i )
-          {
-            // WEIRD: sliceIterators[i].Get() always returns 0... so we do the following
-            // to get the actual value.
-            typename SliceIteratorType::PixelType pix = images[i]->GetPixel( sliceIterators[i].GetIndex() ) ;
-            if ( pix != 0.f )
-            {
-              nonZero[i] = true;
-            }
-            allNonZero = nonZero[i] && allNonZero;
-            ++(sliceIterators[i]);
-          }
-          if ( allNonZero )
-          {
-            break;
-          }
-        }
-        if ( allNonZero )
-        {
-          break;
-        }
-        // advance all the iterators
-        for( size_t i=0; i<sliceIterators.size(); ++i )
-        {
-          sliceIterators[i].NextLine();
+          mask[x] = ( row[x] != 0 );
+          count += mask[x];
         }
+        matrix.count[i] += count;
       }
-      if ( allNonZero )
+      for(size_t i=0; i<R; ++i)
       {
-        // this is the first slice where all images have a value.
-        // advance the iterator to find the Nth slice from here:
-        for( size_t n=0; n<(ignoreSlices); ++n )
+        const unsigned char * a = &masks[i*lineLength];
+        for(size_t j=i+1; j<R; ++j)
         {
-          sliceIterators[0].NextSlice();
+          const unsigned char * b = &masks[j*lineLength];
+          unsigned long both = 0;
+          for(size_t x=0; x<lineLength; ++x) both += a[x] & b[x];
+          matrix.both[i*R + j] += both;
         }
-        // the iterator now points at the first slice we want to include:
-        typename SliceIteratorType::IndexType ind = sliceIterators[0].GetIndex();
-        if( ind[sliceIndex] > lower[sliceIndex] )
-        {
-          lower[sliceIndex] = ind[sliceIndex];
-        }
-        break;
       }
-      // advance all the iterators
-      for( size_t i=0; i<sliceIterators.size(); ++i )
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+    return matrix;
+  }
+
+  OverlapMatrix operator()(const MatrixList & partial)
+  {
+    OverlapMatrix matrix(images_.size());
+    for(size_t t=0; t<partial.size(); ++t) matrix.add(partial[t]);
+    return matrix;
+  }
+};
+
+/**
+ * StapleEngine - which implementation runs the EM.
+ */
+enum StapleEngine
+{
+  ENGINE_ITK,      // itk::STAPLEImageFilter
+  ENGINE_DENSE,    // staple::DenseEngine, one float weight per voxel
+  ENGINE_BITPLANE, // staple::BitPlaneEngine, bit-packed raters, at most 64
+  ENGINE_DISAGREEMENT // staple::DisagreementEngine, EM over the voxels where raters disagree
+};
+
+/**
+ * StapleOptions - settings for runStaple.
+ */
+struct StapleOptions
+{
+  StapleOptions()
+  :round_robin(false),
+   round_robin_threads(1),
+   warm_start(false),
+   engine(ENGINE_ITK),
+   ignore_slices(0),
+   cropped_output(false),
+   load_threads(0),
+   confidence_weight(1.0),
+   multi_label(false),
+   memory_budget(0),
+   out_of_core(false),
+   tolerance_set(false)
+  {}
+
+  bool round_robin;                 // re-run leaving out each rater in turn and compare.
+  unsigned int round_robin_threads; // exclusion runs in flight at once, 0 = one per core.
+  bool warm_start;                  // seed the exclusion runs from the full run.
+  StapleEngine engine;
+  unsigned int ignore_slices;       // drop this many slices past the first/last slice where all inputs have a value.
+  bool cropped_output;              // write only the region of interest, not the full extent.
+  unsigned int load_threads;        // input files read at once, 0 = one per core.
+  staple::Controls controls;        // EM stopping rule.
+  double confidence_weight;         // scales the prior of the foreground.
+  std::string trace_file;           // per-iteration JSON lines go here, if set.
+  bool multi_label;                 // inputs are label maps, run multi-label STAPLE.
+  size_t memory_budget;             // bytes -batch and -outofcore may hold, 0 = their default.
+  bool out_of_core;                 // stream the inputs from disk instead of loading them.
+  bool tolerance_set;               // controls.tolerance was given, not the default.
+
+  /** true when the options ask for something itk::STAPLEImageFilter does not offer. */
+  bool needsNativeEngine() const
+  {
+    return !trace_file.empty() || tolerance_set;
+  }
+
+  /** true when the CSV report has the iteration counts, which runs are only compared by with these options. */
+  bool reportsIterations() const
+  {
+    return warm_start || !trace_file.empty();
+  }
+};
+
+/**
+ * estimateConsensus - run STAPLE on inputs with the engine and settings in options,
+ * stopping and tracing as set in controls.
+ *
+ * If initial is set the run is seeded with it and with the sensitivity/specificity
+ * already in params (a warm start), which the itk filter can not do, so seeded
+ * runs use the dense engine instead, as do runs that need a tolerance or a trace.
+ * The bit-plane engine also falls back to the dense engine past 64 raters.
+ * Returns false if the itk filter failed.
+ */
+template < class ImageType >
+bool estimateConsensus(const std::vector<typename ImageType::Pointer> & inputs, const StapleOptions & options, size_t threads,
+                       const typename staple::DenseEngine<ImageType>::WeightImagePointer & initial,
+                       const staple::Controls & controls,
+                       staple::Parameters & params,
+                       typename staple::DenseEngine<ImageType>::WeightImagePointer & output)
+{
+  typedef typename staple::DenseEngine<ImageType>::WeightImageType WeightImageType;
+
+  StapleEngine engine = options.engine;
+  if ( ( initial.IsNotNull() || options.needsNativeEngine() ) && engine == ENGINE_ITK ) engine = ENGINE_DENSE;
+  if ( inputs.size() > staple::BitPlaneEngine<ImageType>::MaximumRaters && engine == ENGINE_BITPLANE ) engine = ENGINE_DENSE;
+  const double confidence = options.confidence_weight;
+
+  if ( engine == ENGINE_BITPLANE )
+  {
+    staple::BitPlaneEngine<ImageType> bitplanes( inputs, threads, confidence );
+    if ( initial.IsNotNull() ) bitplanes.SetInitialWeights( initial );
+    staple::estimate( bitplanes, params, controls );
+    output = bitplanes.GetOutput();
+    return true;
+  }
+  if ( engine == ENGINE_DISAGREEMENT )
+  {
+    staple::DisagreementEngine<ImageType> disagreement( inputs, threads, confidence );
+    if ( initial.IsNotNull() ) disagreement.SetInitialWeights( initial );
+    staple::estimate( disagreement, params, controls );
+    output = disagreement.GetOutput();
+    return true;
+  }
+  if ( engine == ENGINE_DENSE )
+  {
+    staple::DenseEngine<ImageType> dense( inputs, threads, confidence );
+    if ( initial.IsNotNull() ) dense.SetInitialWeights( initial );
+    staple::estimate( dense, params, controls );
+    output = dense.GetOutput();
+    return true;
+  }
+
+  typedef itk::STAPLEImageFilter< ImageType, WeightImageType > filter_type;
+  typename filter_type::Pointer filter = filter_type::New();
+  for ( size_t i = 0; i < inputs.size() ; ++i )
+  {
+    filter->SetInput( i, inputs[i] );
+  }
+  filter->SetMaximumIterations( controls.maximumIterations );
+  filter->SetConfidenceWeight( confidence );
+  filter->SetNumberOfThreads( threads );
+  // This needs to be in a try/catch statement as certain filters throw exceptions when they
+  // are aborted.
+  try
+  {
+    filter->Update();
+  }
+  catch ( ... )
+  {
+    return false;
+  }
+  output = filter->GetOutput();
+  params.sensitivity.clear();
+  params.specificity.clear();
+  for ( size_t i = 0; i < inputs.size() ; ++i )
+  {
+    params.sensitivity.push_back( filter->GetSensitivity(i) );
+    params.specificity.push_back( filter->GetSpecificity(i) );
+  }
+  params.iterations = filter->GetElapsedIterations();
+  return true;
+}
+
+/**
+ * shareBuffer - a new image over the pixels of image, without its pipeline state.
+ *
+ * A filter sets the requested region and update time of its inputs, so filters
+ * running at once must not share an input image; each can take its own
+ * shareBuffer() of it instead, without copying the pixels.
+ */
+template < class ImageType >
+typename ImageType::Pointer shareBuffer(const typename ImageType::Pointer & image)
+{
+  typename ImageType::Pointer view = ImageType::New();
+  view->CopyInformation( image.GetPointer() );
+  view->SetBufferedRegion( image->GetBufferedRegion() );
+  view->SetRequestedRegion( image->GetRequestedRegion() );
+  view->SetPixelContainer( image->GetPixelContainer() );
+  return view;
+}
+
+/**
+ * RoundRobinFunctor - common::each functor for the leave-one-out comparison.
+ *
+ * Job "excluded" runs STAPLE on all cropped inputs but the excluded one and
+ * compares the excluded rater against the result.  Every run gets its own
+ * shareBuffer() of the inputs it uses, made up front, so the itk filters of
+ * concurrent runs never touch the same image; each run writes its report into
+ * its own slot, and report() prints them afterwards in job order.
+ *
+ * The rater-to-rater overlaps do not depend on the exclusion, they are looked
+ * up in an OverlapMatrix computed once for all raters.
+ */
+template < class ImageType >
+struct RoundRobinFunctor
+{
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef typename staple::DenseEngine<ImageType>::WeightImageType OutputImageType;
+  typedef typename OutputImageType::Pointer OutputImagePointer;
+
+  const std::vector<ImagePointer> & cropped_;
+  std::vector< std::vector<ImagePointer> > inputs_; // the raters of each run
+  const OverlapMatrix & overlaps_;
+  ImagePointer mask_;
+  std::vector<std::string> log_;  // stderr report, per excluded rater
+  std::vector<std::string> csv_;  // stdout report, per excluded rater
+  std::vector<char> ok_;
+
+  const StapleOptions & options_;
+  size_t threads_;  // threads of each run's engine
+  std::ostream * trace_;
+  std::vector<std::string> traces_; // iteration trace, per excluded rater
+
+  // warm start: seed each run from the full run's estimate.
+  OutputImagePointer consensus_;
+  staple::Parameters full_;
+
+  RoundRobinFunctor(const std::vector<ImagePointer> & cropped, const OverlapMatrix & overlaps, ImagePointer mask,
+                    const StapleOptions & options, size_t threads, std::ostream * trace)
+  :cropped_(cropped),
+   inputs_(cropped.size()),
+   overlaps_(overlaps),
+   mask_(mask),
+   log_(cropped.size()),
+   csv_(cropped.size()),
+   ok_(cropped.size(), 0),
+   options_(options),
+   threads_(threads),
+   trace_(trace),
+   traces_(cropped.size())
+  {
+    for ( size_t excluded = 0; excluded < cropped.size(); ++excluded )
+    {
+      for ( size_t i = 0; i < cropped.size(); ++i )
       {
-        sliceIterators[i].NextSlice();
+        if ( i != excluded ) inputs_[excluded].push_back( shareBuffer<ImageType>( cropped[i] ) );
       }
     }
-    // Now we do the same, but from the bottom:
-    for( size_t i=0; i<sliceIterators.size(); ++i )
+  }
+
+  /** start the exclusions from the full run's result. */
+  void SetWarmStart(const OutputImagePointer & consensus, const staple::Parameters & full)
+  {
+    consensus_ = consensus;
+    full_ = full;
+  }
+
+  bool report(size_t excluded, std::ostream & out) const
+  {
+    if ( trace_ ) *trace_ << traces_[excluded];
+    std::cerr << log_[excluded];
+    if ( !ok_[excluded] )
     {
-      sliceIterators[i].GoToReverseBegin();
+      std::cerr <<  "ITK filter failed to complete." << std::endl;
+      return false;
     }
-    while( (ignoreSlices) > 0 && ! sliceIterators[0].IsAtReverseEnd() )
+    out << csv_[excluded];
+    return true;
+  }
+
+  void operator()(size_t excluded)
+  {
+    const std::vector<ImagePointer> & cropped = cropped_;
+    ImagePointer mask = mask_;
+    std::ostringstream log;
+    std::ostringstream csv;
+
+    log << "excluding " << excluded << std::endl;
+
+    const std::vector<ImagePointer> & inputs = inputs_[excluded];
+
+    OutputImagePointer truthImage;
+    staple::Parameters params;
+    if ( consensus_.IsNotNull() )
     {
-      std::vector<bool> nonZero(sliceIterators.size());
-      bool allNonZero = true;
-      while( ! sliceIterators[0].IsAtReverseEndOfSlice() )
+      for ( size_t i = 0; i < cropped.size() ; ++i )
       {
-        while( ! sliceIterators[0].IsAtReverseEndOfLine() )
-        {
-          allNonZero = true;
-          for( size_t i=0; i<sliceIterators.size(); ++i )
-          {
-            typename SliceIteratorType::PixelType pix = images[i]->GetPixel( sliceIterators[i].GetIndex() ) ;
-            if ( pix != 0 )
-            {
-              nonZero[i] = true;
-            }
-            allNonZero = nonZero[i] && allNonZero;
-            //advance iterators
-            --(sliceIterators[i]);
-          }
-          if ( allNonZero )
-          {
-            break;
-          }
-        }
-        if ( allNonZero )
-        {
-          break;
-        }
-        // advance all the iterators
-        for( size_t i=0; i<sliceIterators.size(); ++i )
+        if ( i != excluded )
         {
-          sliceIterators[i].PreviousLine();
+          params.sensitivity.push_back( full_.sensitivity[i] );
+          params.specificity.push_back( full_.specificity[i] );
         }
       }
-      if ( allNonZero )
+    }
+    staple::Controls controls = options_.controls;
+    std::ostringstream trace;
+    std::ostringstream label;
+    label << "excluding " << excluded;
+    controls.label = label.str();
+    controls.trace = trace_ ? &trace : 0;
+    const bool ok = estimateConsensus<ImageType>( inputs, options_, threads_, consensus_, controls, params, truthImage );
+    traces_[excluded] = trace.str();
+    if ( !ok )
+    {
+      log_[excluded] = log.str();
+      return;
+    }
+    const std::vector<double> & sensitivity = params.sensitivity;
+    const std::vector<double> & specificity = params.specificity;
+    const unsigned int iterations = params.iterations;
+
+    // Output specificity and sensitivity
+    size_t inputNumber = 0;
+    log << "excluding image " << excluded << " Specificity, Sensitivity:" << std::endl;
+    for ( size_t i = 0; i<cropped.size(); ++i )
+    {
+      if ( i != excluded )
       {
-        // this is the first slice from the bottom where all images have a value.
-        // advance the iterator to find the Nth slice from here:
-        for( size_t n=0; n<(ignoreSlices); ++n )
-        {
-          sliceIterators[0].PreviousSlice();
-        }
-        // the iterator now points at the first slice we want to include:
-        typename SliceIteratorType::IndexType ind = sliceIterators[0].GetIndex();
-        if( ind[sliceIndex] < upper[sliceIndex] )
-        {
-          upper[sliceIndex] = ind[sliceIndex];
-        }
-        break;
+        log << i << ": " << specificity[inputNumber] << ", " << sensitivity[inputNumber] << std::endl;
+        ++inputNumber;
       }
-      // advance all the iterators
-      for( size_t i=0; i<sliceIterators.size(); ++i )
+    }
+    log << "iterations: " << iterations << std::endl;
+
+    // Compare the excluded image with the resulting image at some threshold,
+    // in a single pass over the candidate, the truth and the mask.
+    float threshold = .9;
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename OutputImageType::PixelType OutputPixelType;
+    const PixelType * candidateBuffer = cropped[excluded]->GetBufferPointer();
+    const PixelType * maskBuffer = mask->GetBufferPointer();
+    const OutputPixelType * truthBuffer = truthImage->GetBufferPointer();
+    const unsigned long total = std::min( cropped[excluded]->GetBufferedRegion().GetNumberOfPixels(),
+                                          truthImage->GetBufferedRegion().GetNumberOfPixels() );
+
+    unsigned long TruePositive = 0;
+    unsigned long FalsePositive = 0;
+    unsigned long TrueNegative = 0;
+    unsigned long FalseNegative = 0;
+    unsigned long maskSize = 0;
+    unsigned long truthOverlapDiff = 0;
+    for ( unsigned long v = 0; v < total; ++v )
+    {
+      const bool candidate = ( candidateBuffer[v] != static_cast<PixelType>(0) );
+      const bool truth = ( truthBuffer[v] >= threshold );
+      const bool inMask = ( maskBuffer[v] > 0 );
+
+      TruePositive += candidate & truth;
+      FalsePositive += candidate & !truth;
+      FalseNegative += !candidate & truth;
+      maskSize += inMask;
+      truthOverlapDiff += inMask & ( candidate != truth );
+    }
+    TrueNegative = total - TruePositive - FalsePositive - FalseNegative;
+    // dice of candidate and truth
+    const unsigned long truthOverlap = TruePositive;
+    const unsigned long truthOverlapTotal = 2*TruePositive + FalsePositive + FalseNegative;
+
+    log << "Stats (Ground Truth thresholded at " << threshold << "):" << std::endl
+              << "True Positive: " << TruePositive << std::endl
+              << "False Positive: " << FalsePositive << std::endl
+              << "True Negative: " << TrueNegative << std::endl
+              << "False Negative: " << FalseNegative << std::endl
+              << "Total: " << total << std::endl;
+    log << "Overlap:" << std::endl;
+    for (size_t i=0; i<cropped.size(); ++i)
+    {
+      if (i!=excluded)
+      {
+        log << i << ": " << overlaps_.overlap( excluded, i ) << std::endl;
+      }
+    }
+    // overlap with ground truth
+    double truth = (2*static_cast<double>(truthOverlap)) / truthOverlapTotal;
+    // overlap difference with ground truth
+    double truthDiff = static_cast<double>(maskSize-truthOverlapDiff) / maskSize;
+    log << "truth: " <<  truth << std::endl;
+    log << "truth diff: " << truthDiff << std::endl;
+    // To make it easier to pipe just numbers into files for compilation into a spreadsheet or db.
+    csv << excluded << "truepositive," << TruePositive << std::endl
+              << excluded <<  "falsepositive," << FalsePositive << std::endl
+              << excluded <<   "truenegative," << TrueNegative << std::endl
+              << excluded <<   "falsenegative," << FalseNegative << std::endl
+              << excluded <<   "total," << total << std::endl << std::endl;
+    for (size_t i=0; i<cropped.size(); ++i)
+    {
+      if (i!=excluded)
       {
-        sliceIterators[i].PreviousSlice();
+        csv << excluded <<   "overlap" << i << "," << overlaps_.overlap( excluded, i ) << std::endl;
+      }
+    }
+    csv << excluded << "truth," << truth << std::endl;
+    csv << excluded << "truthdiff," << truthDiff << std::endl;
+    if ( options_.reportsIterations() ) csv << excluded << "iterations," << iterations << std::endl;
+    csv << std::endl; // space between candidate output
+
+    log_[excluded] = log.str();
+    csv_[excluded] = csv.str();
+    ok_[excluded] = 1;
+  }
+};
+
+/**
+ * trimSlices - further reduce lower..upper to exclude the top and bottom N slices
+ * where all images have a value, first and last being the first and last such slice
+ * (if found).  Returns false, after printing an error, when no slices are left.
+ */
+template < class IndexType >
+bool trimSlices(IndexType & lower, IndexType & upper, unsigned int sliceIndex,
+                bool found, long first, long last, size_t ignoreSlices)
+{
+    if ( found )
+    {
+      // the first slice we want to include, N slices on from the first slice where all images have a value.
+      const long top = first + static_cast<long>(ignoreSlices);
+      if ( top > lower[sliceIndex] )
+      {
+        lower[sliceIndex] = top;
+      }
+      // Now we do the same, but from the bottom:
+      const long bottom = last - static_cast<long>(ignoreSlices);
+      if ( bottom < upper[sliceIndex] )
+      {
+        upper[sliceIndex] = bottom;
+      }
+    }
+    if ( lower[sliceIndex] >= upper[sliceIndex] )
+    {
+      std::cerr << "Error: no slices left after ignoring " << ignoreSlices << " slices at each end." << std::endl;
+      return false;
+    }
+    return true;
+}
+
+/**
+ * cropInputs - crop the raters and the mask (the last image) to the bounding box of
+ * their non-zero voxels, padded, and trimmed by options.ignore_slices.
+ *
+ * Returns false, after printing an error, if there is nothing left to run on.
+ */
+template < class ImageType >
+bool cropInputs(const std::vector<typename ImageType::Pointer> & images, const StapleOptions & options,
+                std::vector<typename ImageType::Pointer> & cropped, typename ImageType::Pointer & mask,
+                typename ImageType::RegionType & regionOfInterest)
+{
+    const size_t ignoreSlices = options.ignore_slices;
+    typedef typename ImageType::RegionType RegionType;
+
+    typename RegionType::SizeType  imgSize   = images[0]->GetLargestPossibleRegion().GetSize();
+
+    const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+    // Search for bounding box.
+    typedef BoundingBoxFunctor<ImageType> BoxFunctorType;
+    typedef typename BoxFunctorType::Box BoxType;
+    BoxFunctorType boxFunctor( images );
+    BoxType box = common::reduce<ImageType,BoxType,BoxFunctorType>::run( images[0].GetPointer(), boxFunctor, numThreads );
+    typename ImageType::IndexType lower;
+    typename ImageType::IndexType upper;
+    if ( !box.bounds( imgSize, lower, upper ) )
+    {
+      std::cerr << "Error: no non-zero voxels found in the inputs." << std::endl;
+      return false;
+    }
+
+    typename RegionType::SizeType regionSize;
+    for (unsigned int i = 0; i < regionSize.GetSizeDimension(); ++i)
+    {
+      regionSize[i] = upper[i] - lower[i] ;
+    }
+
+    regionOfInterest.SetSize(regionSize);
+    regionOfInterest.SetIndex(lower);
+
+    // Further reduce the region to exclude top and bottom N slices, as indicated by the filter.
+    // By top N slices we mean the top and bottom N slices where all images have a value.
+    const unsigned int sliceIndex = 2;
+    if ( ignoreSlices > 0 )
+    {
+      common::SliceOccupancy<ImageType> occupancy( images, regionOfInterest, sliceIndex, numThreads );
+      const size_t first = occupancy.firstAllOccupied();
+      if ( !trimSlices( lower, upper, sliceIndex, first < occupancy.slices(), occupancy.sliceIndex( first ),
+                        occupancy.sliceIndex( occupancy.lastAllOccupied() ), ignoreSlices ) )
+      {
+        return false;
       }
     }
 
@@ -251,8 +791,7 @@ void runStaple(const std::vector<typename ImageType::Pointer> & images, const st
     regionOfInterest.SetIndex(lower);
 
 
-    std::vector<typename ImageType::Pointer> cropped;
-
+    cropped.clear();
     typedef itk::RegionOfInterestImageFilter< ImageType,
       ImageType > RegionFilterType;
     //typedef itk::ExtractImageFilter< ImageType,
@@ -279,299 +818,358 @@ void runStaple(const std::vector<typename ImageType::Pointer> & images, const st
 
   			this->report_error( "ITK filter failed to complete." );
         */
-  			return;
+  			return false;
   		}
 //   		if ( this->check_abort() ) return;
 
-      cropped.push_back( regionFilter->GetOutput() );
+      // detach from the region filter, so concurrent downstream filters
+      // (round robin) do not touch a shared pipeline.
+      typename ImageType::Pointer croppedImage = regionFilter->GetOutput();
+      croppedImage->DisconnectPipeline();
+      cropped.push_back( croppedImage );
     }
 
     // remove the mask from the cropped list..
-    typename ImageType::Pointer mask = cropped.back();
+    mask = cropped.back();
     cropped.pop_back();
+    return true;
+}
 
-    // Define the type of filter that we use.
-		typedef itk::STAPLEImageFilter< 
-			ImageType, ImageType > filter_type;
-			
-		// Create a new ITK filter instantiation.	
-		typename filter_type::Pointer filter = filter_type::New();
-
-		// Setup the filter parameters that we do not want to change.
-    for ( size_t i = 0; i < cropped.size() ; ++i )
-    {
-  		filter->SetInput( i, cropped[i] );
-    }
-
-		// Run the actual ITK filter.
-		// This needs to be in a try/catch statement as certain filters throw exceptions when they
-		// are aborted. In that case we will relay a message to the status bar for information.
-    double progress_value = 0.f;
-    double progress_rate = 1.f/100.f;
-		try 
-		{ 
-			filter->Update(); 
-      //this->dst_layer_->update_progress(25, progress_value, progress_rate);
-      progress_value += 25 * progress_rate;
-		} 
-		catch ( ... ) 
-		{
-      
-			//if ( this->check_abort() )
-			//{
-		//		this->report_error( "Filter was aborted." );
-		//		return;
-		//	}
-
-			//this->report_error( "ITK filter failed to complete." );
-			std::cerr << "ITK filter failed to complete." << std::endl;
-			return;
-		}
-
-		// As ITK filters generate an inconsistent abort behavior, we record our own abort flag
-		// This one is set when the abort button is pressed and an abort is sent to ITK.
-		//if ( this->check_abort() ) return;
-
-    // copy the output of the filter into the full size output image
-    typename ImageType::Pointer output = ImageType::New();
-    output->SetBufferedRegion( images[0]->GetLargestPossibleRegion() );
-    output->Allocate();
-    output->FillBuffer( 0 );
-    output->SetOrigin( images[0]->GetOrigin() );
-    output->SetSpacing( images[0]->GetSpacing() );
-    itk::ImageRegionIterator<ImageType> origOut( filter->GetOutput(), filter->GetOutput()->GetRequestedRegion() );
-    itk::ImageRegionIterator<ImageType> newOut( output, regionOfInterest );
-    for ( ; !origOut.IsAtEnd() && !newOut.IsAtEnd(); ++origOut, ++newOut )
-    {
-      newOut.Set( origOut.Get() );
-    }
-
-    typedef itk::ImageFileWriter< ImageType  >  WriterType;
-    typename WriterType::Pointer writer = WriterType::New();
-    writer->SetInput( output );
-    writer->SetFileName( outname );
-    writer->UseCompressionOn();
-    writer->Update();
-
-    // print overall results:
+
+/**
+ * StapleResult - the consensus of a run and where it goes in the full extent of the inputs.
+ */
+template < class ImageType >
+struct StapleResult
+{
+  typedef typename staple::DenseEngine<ImageType>::WeightImageType OutputImageType;
+
+  typename OutputImageType::Pointer consensus;
+  typename ImageType::RegionType regionOfInterest;
+  typename ImageType::SizeType size;   // full extent of the inputs
+  typename ImageType::PointType origin;
+};
+
+/**
+ * printOverall - the results of the full run, to stderr and as CSV to out, the
+ * iteration count in the CSV only with iterations set.
+ */
+inline void printOverall(const staple::Parameters & full, std::ostream & out, bool iterations)
+{
     std::cerr << "Overall Specificity:" << std::endl;
-    for ( size_t i = 0; i<cropped.size() ; ++i )
+    for ( size_t i = 0; i<full.specificity.size() ; ++i )
     {
-      std::cerr << i << ": " << filter->GetSpecificity(i) << std::endl;
-      std::cout << "overallspecificity" << i << "," << filter->GetSpecificity(i) << std::endl;
+      std::cerr << i << ": " << full.specificity[i] << std::endl;
+      out << "overallspecificity" << i << "," << full.specificity[i] << std::endl;
     }
-    std::cout << std::endl; 
+    out << std::endl; 
 
     std::cerr << "Overall Sensitivity:" << std::endl;
-    for ( size_t i = 0; i<cropped.size() ; ++i )
+    for ( size_t i = 0; i<full.sensitivity.size() ; ++i )
     {
-      std::cerr << i << ": " << filter->GetSensitivity(i) << std::endl;
-      std::cout << "overallsensitivity" << i << "," << filter->GetSensitivity(i) << std::endl;
+      std::cerr << i << ": " << full.sensitivity[i] << std::endl;
+      out << "overallsensitivity" << i << "," << full.sensitivity[i] << std::endl;
     }
-    std::cout << std::endl;
+    std::cerr << "Iterations: " << full.iterations << std::endl;
+    if ( iterations ) out << "overalliterations," << full.iterations << std::endl;
+    out << std::endl;
+}
 
-    if (!round_robin) return; // all done if no round robin comparison required...
+/**
+ * computeStaple - run STAPLE (and the round robin comparison, if asked for) on images,
+ * the raters followed by the mask.  The CSV report goes to out, iteration traces to
+ * trace if set.  Returns false if the run failed; result.consensus is set once the
+ * full run succeeded, even if a round robin run failed afterwards.
+ */
+template < class ImageType >
+bool computeStaple(const std::vector<typename ImageType::Pointer> & images, const StapleOptions & options,
+                   StapleResult<ImageType> & result, std::ostream & out, std::ostream * trace)
+{
+    typedef typename StapleResult<ImageType>::OutputImageType OutputImageType;
 
-    // now re-run in a round-robin fashion:
+    const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
 
-    for ( size_t excluded = 0; excluded < cropped.size(); ++excluded )
+    result.size = images[0]->GetLargestPossibleRegion().GetSize();
+    result.origin = images[0]->GetOrigin();
+
+    std::vector<typename ImageType::Pointer> cropped;
+    typename ImageType::Pointer mask;
+    if ( !cropInputs<ImageType>( images, options, cropped, mask, result.regionOfInterest ) )
     {
-      std::cerr << "excluding " << excluded << std::endl;
-  		// Create a new ITK filter instantiation.	
-	  	filter = filter_type::New();
+      return false;
+    }
 
-	  	// Setup the filter parameters that we do not want to change.
-      size_t inputNumber = 0;
-      for ( size_t i = 0; i < cropped.size() ; ++i )
+    typename OutputImageType::Pointer consensus;
+    typename OutputImageType::Pointer noSeed;
+    if ( options.engine == ENGINE_ITK && options.needsNativeEngine() )
+    {
+      std::cerr << "-tolerance and -trace need a native engine, running with -engine dense." << std::endl;
+    }
+    staple::Controls controls = options.controls;
+    if ( trace )
+    {
+      controls.trace = trace;
+      controls.label = "full";
+    }
+    staple::Parameters full;
+    if ( !estimateConsensus<ImageType>( cropped, options, numThreads, noSeed, controls, full, consensus ) )
+    {
+      std::cerr << "ITK filter failed to complete." << std::endl;
+      return false;
+    }
+    result.consensus = consensus;
+
+    printOverall( full, out, options.reportsIterations() );
+
+    if (!options.round_robin) return true; // all done if no round robin comparison required...
+
+    // now re-run in a round-robin fashion:
+    size_t threads = options.round_robin_threads;
+    if ( threads == 0 ) threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    // split the cores between the exclusion runs in flight.
+    size_t engineThreads = std::max<size_t>( 1, numThreads / threads );
+    // rater-to-rater overlaps are the same in every exclusion, compute them once.
+    typedef OverlapMatrixFunctor<ImageType> OverlapFunctorType;
+    OverlapFunctorType overlapFunctor( cropped );
+    OverlapMatrix overlaps = common::reduce<ImageType,OverlapMatrix,OverlapFunctorType>::run( cropped[0].GetPointer(), overlapFunctor, numThreads );
+
+    typedef RoundRobinFunctor<ImageType> RoundRobinType;
+    RoundRobinType roundRobin( cropped, overlaps, mask, options, engineThreads, controls.trace );
+    if ( options.warm_start )
+    {
+      roundRobin.SetWarmStart( consensus, full );
+    }
+    if ( threads == 1 )
+    {
+      for ( size_t excluded = 0; excluded < cropped.size(); ++excluded )
       {
-        if ( i != excluded )
-        {
-    		  filter->SetInput( inputNumber++, cropped[i] );
-        }
+        roundRobin( excluded );
+        if ( !roundRobin.report( excluded, out ) ) return false;
       }
-	 	
-	  	// Ensure we will have some threads left for doing something else
-	  	//this->limit_number_of_itk_threads( filter );
-
-	  	// Run the actual ITK filter.
-	  	// This needs to be in a try/catch statement as certain filters throw exceptions when they
-	  	// are aborted. In that case we will relay a message to the status bar for information.
-    	try 
-    	{ 
-	  		filter->Update(); 
-	  	} 
-	  	catch ( ... ) 
-	  	{
-      /*
-	  		if ( this->check_abort() )
-	  		{
-	  			this->report_error( "Filter was aborted." );
-	  			return;
-	  		}
-
-	  		this->report_error( "ITK filter failed to complete." );
-        */
-	  		std::cerr <<  "ITK filter failed to complete." << std::endl;
-	  		return;
-	  	}
-
-	  	// As ITK filters generate an inconsistent abort behavior, we record our own abort flag
-	  	// This one is set when the abort button is pressed and an abort is sent to ITK.
-	  	//if ( this->check_abort() ) return;
-
-      // Update progress bar...
-      //this->dst_layer_->update_progress(25, progress_value, progress_rate);
-      progress_value += 25 * progress_rate;
-
-      // Output specificity and sensitivity
-      inputNumber = 0;
-      std::cerr << "excluding image " << excluded << " Specificity, Sensitivity:" << std::endl;
-      for ( size_t i = 0; i<cropped.size(); ++i )
+    }
+    else
+    {
+      common::each<RoundRobinType>::run( roundRobin, cropped.size(), threads );
+      // report in the same order as the serial run.
+      for ( size_t excluded = 0; excluded < cropped.size(); ++excluded )
       {
-        if ( i != excluded )
-        {
-          std::cerr << i << ": " << filter->GetSpecificity(inputNumber) << ", " << filter->GetSensitivity(inputNumber) << std::endl;
-          ++inputNumber;
-        }
+        if ( !roundRobin.report( excluded, out ) ) return false;
       }
+    }
+    return true;
+}
+
+/**
+ * writeStapleResult - write the consensus, either cropped (with the origin of the
+ * region of interest) or streamed into the full extent of the inputs with zeros
+ * around it.
+ */
+template < class ImageType >
+bool writeStapleResult(const std::string & outname, const StapleResult<ImageType> & result, const StapleOptions & options)
+{
+    typedef typename StapleResult<ImageType>::OutputImageType OutputImageType;
+    const OutputImageType * consensus = result.consensus.GetPointer();
+    if ( options.cropped_output )
+    {
+      typename OutputImageType::IndexType placement;
+      placement.Fill( 0 );
+      return common::writePaddedNrrd<OutputImageType>( outname, consensus, placement,
+                                                       consensus->GetBufferedRegion().GetSize(), consensus->GetOrigin() );
+    }
+    return common::writePaddedNrrd<OutputImageType>( outname, consensus, result.regionOfInterest.GetIndex(),
+                                                     result.size, result.origin );
+}
 
-      // Compare the excluded image with the resulting image at some threshold
-      float threshold = .9;
-      typedef itk::ImageRegionIterator<typename filter_type::InputImageType> in_iterator_type;
-      typedef itk::ImageRegionIterator<typename filter_type::OutputImageType> out_iterator_type;
-      in_iterator_type mask_it( mask, mask->GetRequestedRegion() );
-      in_iterator_type candidate_it( cropped[excluded], cropped[excluded]->GetRequestedRegion() );
-      out_iterator_type ground_truth_it( filter->GetOutput() , filter->GetOutput()->GetRequestedRegion() );
-      std::vector<in_iterator_type> otherImages(cropped.size()-1);
-
-      inputNumber = 0;
-      for( size_t i=0; i<cropped.size() ; ++i )
+template < class ImageType >
+void runStaple(const std::vector<typename ImageType::Pointer> & images, const std::string & outname, const StapleOptions & options)
+{
+    std::ofstream traceFile;
+    if ( !options.trace_file.empty() )
+    {
+      traceFile.open( options.trace_file.c_str() );
+      if ( !traceFile )
       {
-        if ( i != excluded )
-        {
-          otherImages[inputNumber++] = in_iterator_type( cropped[i], cropped[i]->GetRequestedRegion() );
-        }
+        std::cerr << "Error: could not open " << options.trace_file << " for writing." << std::endl;
+        return;
       }
+    }
 
-      unsigned long TruePositive = 0;
-      unsigned long FalsePositive = 0;
-      unsigned long TrueNegative = 0;
-      unsigned long FalseNegative = 0;
-      unsigned long total = 0;
-      //unsigned long overlap[3] = {0,0,0};
-      //unsigned long overlapTotal[3] = {0,0,0};
-      std::vector<unsigned long> overlap(cropped.size()-1);
-      std::vector<unsigned long> overlapTotal(cropped.size()-1);
-      unsigned long truthOverlap = 0;
-      unsigned long truthOverlapTotal = 0;
-      unsigned long truthOverlapDiff = 0;
-      unsigned long maskSize = 0;
-      for ( ; !candidate_it.IsAtEnd() && !ground_truth_it.IsAtEnd(); ++candidate_it, ++ground_truth_it, ++mask_it )
-      {
-        typename in_iterator_type::PixelType candidatePixel = candidate_it.Get();
-        typename in_iterator_type::PixelType maskPixel = mask_it.Get();
-        typename out_iterator_type::PixelType truthPixel = ground_truth_it.Get();
+    StapleResult<ImageType> result;
+    std::ostringstream out;
+    computeStaple<ImageType>( images, options, result, out, traceFile.is_open() ? &traceFile : 0 );
+    if ( result.consensus.IsNull() || !writeStapleResult<ImageType>( outname, result, options ) )
+    {
+      return;
+    }
+    std::cout << out.str();
+}
 
-        bool candidate = (candidatePixel != static_cast<typename in_iterator_type::PixelType>(0));
-        bool truth = (truthPixel >= threshold);
+/**
+ * compactLabels - copy label images into a narrower label type, false (after printing
+ * an error) if a voxel is not a label that fits.
+ */
+template < class ImageType, class LabelImageType >
+bool compactLabels(const std::vector<typename ImageType::Pointer> & images,
+                   std::vector<typename LabelImageType::Pointer> & labels)
+{
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename LabelImageType::PixelType LabelType;
+  const double top = itk::NumericTraits<LabelType>::max();
 
-        ++total;
-        if ( candidate && truth )
-        {
-          ++TruePositive;
-        }
-        else if ( candidate )
-        {
-          ++FalsePositive;
-        }
-        else if ( truth )
-        {
-          ++FalseNegative;
-        }
-        else
-        {
-          ++TrueNegative;
-        }
+  labels.clear();
+  for ( size_t i=0; i<images.size(); ++i )
+  {
+    typename LabelImageType::Pointer label = LabelImageType::New();
+    label->SetRegions( images[i]->GetBufferedRegion() );
+    label->Allocate();
+    label->SetOrigin( images[i]->GetOrigin() );
+    label->SetSpacing( images[i]->GetSpacing() );
+    label->SetDirection( images[i]->GetDirection() );
 
-        if ( candidate && truth )
-        {
-          ++truthOverlap;
-          truthOverlapTotal += 2;
-        }
-        else if (candidate || truth )
-        {
-          ++truthOverlapTotal;
-        }
+    const PixelType * in = images[i]->GetBufferPointer();
+    LabelType * out = label->GetBufferPointer();
+    const size_t count = images[i]->GetBufferedRegion().GetNumberOfPixels();
+    for ( size_t v=0; v<count; ++v )
+    {
+      const double value = static_cast<double>( in[v] );
+      if ( value < 0 || value > top || value != static_cast<double>( static_cast<LabelType>( value ) ) )
+      {
+        std::cerr << "Error: input " << i << " has a voxel value of " << value << ", which is not a label." << std::endl;
+        return false;
+      }
+      out[v] = static_cast<LabelType>( value );
+    }
+    labels.push_back( label );
+  }
+  return true;
+}
 
-        if( maskPixel > 0 )
-        {
-          ++maskSize;
-          if( (candidate && !truth) || (!candidate && truth) )
-          {
-            ++truthOverlapDiff;
-          }
-        }
+/**
+ * runMultiLabel - multi-label STAPLE on the cropped label maps, with labels held as
+ * LabelImageType.
+ */
+template < class ImageType, class LabelImageType >
+void runMultiLabel(const std::vector<typename ImageType::Pointer> & cropped, size_t labels,
+                   const typename ImageType::RegionType & regionOfInterest,
+                   const typename ImageType::SizeType & imgSize, const typename ImageType::PointType & imgOrigin,
+                   const std::string & outname, const StapleOptions & options)
+{
+    const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
 
-        // calculate overlap numbers
-        for ( size_t i=0; i<cropped.size()-1; ++i )
-        {
-          bool other = ( (otherImages[i]).Get() != static_cast<typename in_iterator_type::PixelType>(0) );
-          if ( other && candidate )
-          {
-            ++(overlap[i]);
-            (overlapTotal[i])+=2;
-          }
-          else if ( other || candidate )
-          {
-            ++(overlapTotal[i]);
-          }
-          ++(otherImages[i]);
-        }
+    std::vector<typename LabelImageType::Pointer> raters;
+    if ( !compactLabels<ImageType,LabelImageType>( cropped, raters ) )
+    {
+      return;
+    }
+
+    std::ofstream traceFile;
+    staple::Controls controls = options.controls;
+    // the binary default is far tighter than EM on confusion matrices settles to,
+    // use itk::MultiLabelSTAPLEImageFilter's default unless one was given.
+    if ( !options.tolerance_set )
+    {
+      controls.tolerance = 1.0e-5;
+    }
+    if ( !options.trace_file.empty() )
+    {
+      traceFile.open( options.trace_file.c_str() );
+      if ( !traceFile )
+      {
+        std::cerr << "Error: could not open " << options.trace_file << " for writing." << std::endl;
+        return;
       }
+      controls.trace = &traceFile;
+      controls.label = "full";
+    }
 
-      std::cerr << "Stats (Ground Truth thresholded at " << threshold << "):" << std::endl
-                << "True Positive: " << TruePositive << std::endl
-                << "False Positive: " << FalsePositive << std::endl
-                << "True Negative: " << TrueNegative << std::endl
-                << "False Negative: " << FalseNegative << std::endl
-                << "Total: " << total << std::endl;
-      std::cerr << "Overlap:" << std::endl;
-      inputNumber = 0;
-      for (size_t i=0; i<cropped.size(); ++i)
+    staple::MultiLabelEngine<LabelImageType> engine( raters, labels, numThreads );
+    staple::MultiLabelParameters full;
+    engine.estimate( full, controls );
+    typename LabelImageType::Pointer consensus = engine.GetOutput( full );
+
+    if ( options.cropped_output )
+    {
+      typename LabelImageType::IndexType placement;
+      placement.Fill( 0 );
+      if ( !common::writePaddedNrrd<LabelImageType>( outname, consensus, placement,
+                                                     consensus->GetBufferedRegion().GetSize(), consensus->GetOrigin() ) )
       {
-        if (i!=excluded)
-        {
-          std::cerr << i << ": " << (2*static_cast<double>(overlap[inputNumber])) / overlapTotal[inputNumber] << std::endl;
-          ++inputNumber;
-        }
+        return;
       }
-      // overlap with ground truth
-      double truth = (2*static_cast<double>(truthOverlap)) / truthOverlapTotal;
-      // overlap difference with ground truth
-      double truthDiff = static_cast<double>(maskSize-truthOverlapDiff) / maskSize;
-      std::cerr << "truth: " <<  truth << std::endl;
-      std::cerr << "truth diff: " << truthDiff << std::endl;
-      // To make it easier to pipe just numbers into files for compilation into a spreadsheet or db.
-      std::cout << excluded << "truepositive," << TruePositive << std::endl
-                << excluded <<  "falsepositive," << FalsePositive << std::endl
-                << excluded <<   "truenegative," << TrueNegative << std::endl
-                << excluded <<   "falsenegative," << FalseNegative << std::endl
-                << excluded <<   "total," << total << std::endl << std::endl;
-      inputNumber = 0;
-      for (size_t i=0; i<cropped.size(); ++i)
+    }
+    else if ( !common::writePaddedNrrd<LabelImageType>( outname, consensus, regionOfInterest.GetIndex(),
+                                                        imgSize, imgOrigin ) )
+    {
+      return;
+    }
+
+    // print overall results, rows are the rater's label, columns the true label:
+    for ( size_t r = 0; r<raters.size(); ++r )
+    {
+      std::cerr << "Confusion matrix " << r << ":" << std::endl;
+      for ( size_t k = 0; k<labels; ++k )
       {
-        if (i!=excluded)
+        for ( size_t l = 0; l<labels; ++l )
         {
-          std::cout << excluded <<   "overlap" << i << "," << (2*static_cast<double>(overlap[inputNumber])) / overlapTotal[inputNumber] << std::endl;
-          ++inputNumber;
+          std::cerr << ( l ? " " : "" ) << full.theta( r, k, l );
+          std::cout << "overallconfusion" << r << "_" << k << "_" << l << "," << full.theta( r, k, l ) << std::endl;
         }
+        std::cerr << std::endl;
       }
-      std::cout << excluded << "truth," << truth << std::endl;
-      std::cout << excluded << "truthdiff," << truthDiff << std::endl;
-      std::cout << std::endl; // space between candidate output
+    }
+    std::cerr << "Undecided label: " << labels << std::endl;
+    std::cerr << "Iterations: " << full.iterations << std::endl;
+    if ( options.reportsIterations() ) std::cout << "overalliterations," << full.iterations << std::endl;
+    std::cout << std::endl;
+}
 
+/**
+ * runMultiLabelStaple - multi-label STAPLE on label maps, in the same region of
+ * interest as runStaple (the mask only bounds the region).
+ *
+ * Labels are held in an unsigned char image if they fit (with one value left for
+ * the undecided label), an unsigned short one otherwise.
+ */
+template < class ImageType >
+void runMultiLabelStaple(const std::vector<typename ImageType::Pointer> & images, const std::string & outname, const StapleOptions & options)
+{
+    typedef typename ImageType::RegionType RegionType;
+
+    RegionType regionOfInterest;
+    std::vector<typename ImageType::Pointer> cropped;
+    typename ImageType::Pointer mask;
+    if ( !cropInputs<ImageType>( images, options, cropped, mask, regionOfInterest ) )
+    {
+      return;
+    }
+    if ( options.round_robin )
+    {
+      std::cerr << "-rr is not supported with -multilabel, running the full comparison only." << std::endl;
     }
 
-}
+    // labels run from 0 (background) to the largest value in the inputs.
+    double largest = 0;
+    for ( size_t i=0; i<cropped.size(); ++i )
+    {
+      const typename ImageType::PixelType * buffer = cropped[i]->GetBufferPointer();
+      const size_t count = cropped[i]->GetBufferedRegion().GetNumberOfPixels();
+      for ( size_t v=0; v<count; ++v ) largest = std::max( largest, static_cast<double>( buffer[v] ) );
+    }
+    const size_t labels = static_cast<size_t>( largest ) + 1;
 
+    typename RegionType::SizeType imgSize = images[0]->GetLargestPossibleRegion().GetSize();
+    if ( labels < 256 )
+    {
+      runMultiLabel< ImageType, itk::Image<unsigned char, ImageType::ImageDimension> >( cropped, labels, regionOfInterest, imgSize, images[0]->GetOrigin(), outname, options );
+    }
+    else if ( labels < 65536 )
+    {
+      runMultiLabel< ImageType, itk::Image<unsigned short, ImageType::ImageDimension> >( cropped, labels, regionOfInterest, imgSize, images[0]->GetOrigin(), outname, options );
+    }
+    else
+    {
+      std::cerr << "Error: labels up to " << largest << " are too many for -multilabel." << std::endl;
+    }
+}
 
+#endif
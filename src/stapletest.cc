@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+// test that the native staple engines agree with itk::STAPLEImageFilter.
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// itk
+#include <itkImage.h>
+
+// local
+#include "staple.h"
+
+typedef itk::Image<unsigned char,3> ImageType;
+typedef ImageType::Pointer ImagePointer;
+typedef staple::DenseEngine<ImageType>::WeightImagePointer WeightImagePointer;
+
+const unsigned int Size = 24;
+const size_t Threads = 4;
+
+// deterministic noise, so every run tests the same volumes.
+struct Noise
+{
+  Noise(unsigned long seed)
+  :state_(seed)
+  {}
+
+  double operator()()
+  {
+    state_ = state_ * 1103515245UL + 12345UL;
+    return static_cast<double>( ( state_ >> 16 ) & 0x7fff ) / 32768.0;
+  }
+
+  unsigned long state_;
+};
+
+/**
+ * rater - a segmentation of a ball in a Size^3 volume that misses the ball with
+ * probability miss and adds voxels with probability extra, foreground voxels are set
+ * to value.  With strayValue set, background voxels near the ball are set to it with
+ * probability stray, like the other labels of a label map.
+ */
+ImagePointer rater(unsigned long seed, double miss, double extra, unsigned char value,
+                   unsigned char strayValue = 0, double stray = 0)
+{
+  ImageType::RegionType region;
+  ImageType::SizeType size;
+  size.Fill( Size );
+  region.SetSize( size );
+  ImagePointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  Noise noise( seed );
+  const double center = ( Size - 1 ) / 2.0;
+  ImageType::IndexType index;
+  for(index[2]=0; index[2]<static_cast<long>(Size); ++index[2])
+  {
+    for(index[1]=0; index[1]<static_cast<long>(Size); ++index[1])
+    {
+      for(index[0]=0; index[0]<static_cast<long>(Size); ++index[0])
+      {
+        double r2 = 0;
+        for(unsigned int d=0; d<3; ++d) r2 += ( index[d] - center ) * ( index[d] - center );
+        const double r = std::sqrt( r2 );
+        const bool inside = r < Size / 4.0;
+        unsigned char pixel = 0;
+        if(inside) pixel = noise() < miss ? 0 : value;
+        else if(r < Size / 3.0) pixel = noise() < extra ? value : 0;
+        if(!inside && pixel == 0 && strayValue && r < Size / 2.0 && noise() < stray) pixel = strayValue;
+        image->SetPixel( index, pixel );
+      }
+    }
+  }
+  return image;
+}
+
+bool close(double a, double b, double tolerance)
+{
+  if(a != a || b != b) return a != a && b != b; // both undefined
+  return std::fabs( a - b ) <= tolerance;
+}
+
+/** run every engine on inputs and compare it with the itk filter, false if one differs. */
+bool compareEngines(const std::string & name, const std::vector<ImagePointer> & inputs, const staple::Controls & controls)
+{
+  const StapleEngine engines[] = { ENGINE_ITK, ENGINE_DENSE, ENGINE_BITPLANE, ENGINE_DISAGREEMENT };
+  const char * engineNames[] = { "itk", "dense", "bitplane", "disagreement" };
+  const size_t count = sizeof(engines) / sizeof(engines[0]);
+  const double tolerance = 1.0e-6;
+
+  std::vector<staple::Parameters> params( count );
+  std::vector<WeightImagePointer> outputs( count );
+  const WeightImagePointer noSeed;
+  bool ok = true;
+  for(size_t e=0; e<count; ++e)
+  {
+    StapleOptions options;
+    options.engine = engines[e];
+    if( !estimateConsensus<ImageType>( inputs, options, Threads, noSeed, controls, params[e], outputs[e] ) )
+    {
+      std::cerr << name << ", " << engineNames[e] << ": staple failed" << std::endl;
+      ok = false;
+      continue;
+    }
+    if(e == 0) continue;
+
+    double worst = 0;
+    for(size_t i=0; i<inputs.size(); ++i)
+    {
+      if( !close( params[e].sensitivity[i], params[0].sensitivity[i], tolerance ) ||
+          !close( params[e].specificity[i], params[0].specificity[i], tolerance ) )
+      {
+        std::cerr << name << ", " << engineNames[e] << ": rater " << i << " has sensitivity "
+                  << params[e].sensitivity[i] << " specificity " << params[e].specificity[i]
+                  << ", itk " << params[0].sensitivity[i] << " " << params[0].specificity[i] << std::endl;
+        ok = false;
+      }
+    }
+    const float * a = outputs[e]->GetBufferPointer();
+    const float * b = outputs[0]->GetBufferPointer();
+    const size_t voxels = outputs[0]->GetBufferedRegion().GetNumberOfPixels();
+    size_t differ = 0;
+    for(size_t v=0; v<voxels; ++v)
+    {
+      if( close( a[v], b[v], tolerance ) ) continue;
+      if( a[v] == a[v] && b[v] == b[v] ) worst = std::max( worst, std::fabs( static_cast<double>( a[v] ) - b[v] ) );
+      ++differ;
+    }
+    if(differ)
+    {
+      std::cerr << name << ", " << engineNames[e] << ": " << differ << " voxels differ from itk, by up to "
+                << worst << std::endl;
+      ok = false;
+    }
+  }
+  std::cerr << name << ": " << ( ok ? "ok" : "FAILED" ) << std::endl;
+  return ok;
+}
+
+int main(int, char * [])
+{
+  staple::Controls controls;
+  bool ok = true;
+
+  std::vector<ImagePointer> binary;
+  binary.push_back( rater( 1, 0.05, 0.10, 1 ) );
+  binary.push_back( rater( 2, 0.20, 0.02, 1 ) );
+  binary.push_back( rater( 3, 0.02, 0.30, 1 ) );
+  ok &= compareEngines( "0/1 raters", binary, controls );
+
+  // a rater saved as 0/255 never votes for foreground.
+  std::vector<ImagePointer> saturated( binary );
+  saturated.push_back( rater( 4, 0.05, 0.05, 255 ) );
+  ok &= compareEngines( "0/1 and 0/255 raters", saturated, controls );
+
+  // label maps: only label 1 is a vote, label 2 only counts in the E-step.
+  std::vector<ImagePointer> labels;
+  labels.push_back( rater( 5, 0.05, 0.10, 1, 2, 0.3 ) );
+  labels.push_back( rater( 6, 0.20, 0.02, 1, 2, 0.5 ) );
+  labels.push_back( rater( 7, 0.02, 0.30, 1 ) );
+  ok &= compareEngines( "0/1/2 raters", labels, controls );
+
+  // no iterations: the output is the mean vote.
+  staple::Controls none;
+  none.maximumIterations = 0;
+  ok &= compareEngines( "0/1 raters, no iterations", binary, none );
+  ok &= compareEngines( "0/1/2 raters, no iterations", labels, none );
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2013 University of Utah
+ */
+
+/**
+ * surfacedistance - boundary agreement of two masks: the Hausdorff distance, its
+ * 95th percentile and the average symmetric surface distance, in the units of the
+ * voxel spacing (mm).
+ *
+ * The boundary of a mask is its set voxels (> 0) with a 6-neighbour that is not
+ * set, voxels on the image edge included.  The distance of every boundary voxel of
+ * one mask to the other mask's boundary is read from a euclidean distance transform
+ * of that boundary, so no pairs of boundary voxels are ever compared.  The 95th
+ * percentile and the average are taken over the distances of both directions
+ * together.
+ */
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <itkImage.h>
+#include <itkMultiThreader.h>
+
+#include "map.h"
+#include "DistanceTransform.h"
+#include "LoadImages.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
+
+/**
+ * BoundaryFunctor - common::each functor that marks the boundary voxels of a mask,
+ * one slice per job.
+ */
+template < class PixelType >
+struct BoundaryFunctor
+{
+  const PixelType * mask_;
+  const std::vector<size_t> & size_;
+  std::vector<unsigned char> & boundary_;
+
+  BoundaryFunctor(const PixelType * mask, const std::vector<size_t> & size, std::vector<unsigned char> & boundary)
+  :mask_(mask),
+   size_(size),
+   boundary_(boundary)
+  {}
+
+  bool set(size_t x, size_t y, size_t z) const { return mask_[( z * size_[1] + y ) * size_[0] + x] > 0; }
+
+  void operator()(size_t z)
+  {
+    const size_t nx = size_[0], ny = size_[1], nz = size_[2];
+    for(size_t y=0; y<ny; ++y)
+    {
+      for(size_t x=0; x<nx; ++x)
+      {
+        const size_t v = ( z * ny + y ) * nx + x;
+        if(!( mask_[v] > 0 ))
+        {
+          boundary_[v] = 0;
+          continue;
+        }
+        const bool inside = x > 0 && x + 1 < nx && y > 0 && y + 1 < ny && z > 0 && z + 1 < nz &&
+                            set( x-1, y, z ) && set( x+1, y, z ) && set( x, y-1, z ) && set( x, y+1, z ) &&
+                            set( x, y, z-1 ) && set( x, y, z+1 );
+        boundary_[v] = !inside;
+      }
+    }
+  }
+};
+
+/**
+ * SurfaceDistanceFunctor - common::each functor that looks up the distance of each
+ * boundary voxel of one mask in the (squared) distance transform of the other's
+ * boundary, one slice per job into the job's own list.
+ */
+struct SurfaceDistanceFunctor
+{
+  const std::vector<unsigned char> & boundary_;
+  const std::vector<double> & squared_;
+  size_t sliceVoxels_;
+  std::vector< std::vector<double> > distances_; // per slice
+
+  SurfaceDistanceFunctor(const std::vector<unsigned char> & boundary, const std::vector<double> & squared,
+                         size_t sliceVoxels, size_t slices)
+  :boundary_(boundary),
+   squared_(squared),
+   sliceVoxels_(sliceVoxels),
+   distances_(slices)
+  {}
+
+  void operator()(size_t z)
+  {
+    const size_t first = z * sliceVoxels_;
+    for(size_t v=first; v<first+sliceVoxels_; ++v)
+    {
+      if(boundary_[v]) distances_[z].push_back( std::sqrt( squared_[v] ) );
+    }
+  }
+};
+
+/** distances from each boundary voxel of from to the boundary of to. */
+std::vector<double> surfaceDistances(const std::vector<unsigned char> & from, const std::vector<unsigned char> & to,
+                                     const std::vector<size_t> & size, const std::vector<double> & spacing,
+                                     size_t threads)
+{
+  std::vector<double> squared( to.size() );
+  for(size_t v=0; v<to.size(); ++v) squared[v] = to[v] ? 0.0 : std::numeric_limits<double>::infinity();
+  common::distanceTransform( squared, size, spacing, threads );
+
+  SurfaceDistanceFunctor functor( from, squared, size[0] * size[1], size[2] );
+  common::each<SurfaceDistanceFunctor>::run( functor, size[2], threads );
+  std::vector<double> distances;
+  for(size_t z=0; z<size[2]; ++z)
+  {
+    distances.insert( distances.end(), functor.distances_[z].begin(), functor.distances_[z].end() );
+  }
+  return distances;
+}
+
+/** the value at rank ceil(fraction * n) of distances (nearest rank), reorders them. */
+double percentile(std::vector<double> & distances, double fraction)
+{
+  size_t rank = static_cast<size_t>( std::ceil( fraction * distances.size() ) );
+  rank = std::max<size_t>( 1, std::min( rank, distances.size() ) );
+  std::nth_element( distances.begin(), distances.begin() + ( rank - 1 ), distances.end() );
+  return distances[rank - 1];
+}
+
+/**
+ * SurfaceDistanceRun - reads both masks in their stored pixel type and marks their
+ * boundaries, see common::dispatchScalar.
+ */
+struct SurfaceDistanceRun
+{
+  const std::vector<std::string> & filenames_;
+  size_t threads_;
+  std::vector<size_t> size_;
+  std::vector<double> spacing_;
+  std::vector<unsigned char> boundaries_[2];
+
+  SurfaceDistanceRun(const std::vector<std::string> & filenames, size_t threads)
+  :filenames_(filenames),
+   threads_(threads)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    typedef typename InputImageType::PixelType PixelType;
+    std::vector<typename InputImageType::Pointer> images;
+    if( !common::loadImages<InputImageType>( filenames_, images, threads_, false ) ) return 1;
+    common::reportPeakRSS( "after loading" );
+
+    const typename InputImageType::SizeType size = images[0]->GetLargestPossibleRegion().GetSize();
+    if( images[1]->GetLargestPossibleRegion().GetSize() != size )
+    {
+      std::cerr << "Error: sizes (" << size << " ; " << images[1]->GetLargestPossibleRegion().GetSize()
+                << ") do not match." << std::endl;
+      return 1;
+    }
+    for( unsigned int d=0; d<InputImageType::ImageDimension; ++d )
+    {
+      size_.push_back( size[d] );
+      spacing_.push_back( images[0]->GetSpacing()[d] );
+      if( std::fabs( images[1]->GetSpacing()[d] - spacing_[d] ) > 1e-6 * spacing_[d] )
+      {
+        std::cerr << "Warning: spacings differ, using the spacing of " << filenames_[0] << std::endl;
+      }
+    }
+
+    for( size_t i=0; i<2; ++i )
+    {
+      boundaries_[i].resize( images[i]->GetBufferedRegion().GetNumberOfPixels() );
+      BoundaryFunctor<PixelType> functor( images[i]->GetBufferPointer(), size_, boundaries_[i] );
+      common::each< BoundaryFunctor<PixelType> >::run( functor, size_[2], threads_ );
+      images[i] = 0;
+    }
+    return 0;
+  }
+};
+
+int main(int argc, char ** argv)
+{
+  if( argc < 3 )
+  {
+    std::cerr << "usage: " << argv[0] << " [options] image1.nrrd image2.nrrd" << std::endl;
+    std::cerr << "options: -threads N = number of threads (default one per core)" << std::endl;
+    std::cerr << "prints the hausdorff distance, its 95th percentile and the average symmetric surface" << std::endl;
+    std::cerr << "distance of the two masks (> 0) as CSV, in the units of the voxel spacing." << std::endl;
+    return 1;
+  }
+
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  int image_index = 1;
+  while( image_index < argc && argv[image_index][0] == '-' )
+  {
+    std::string option(argv[image_index++]);
+    if( option == "-threads" && image_index < argc )
+    {
+      threads = std::max( 1, atoi(argv[image_index++]) );
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( argc - image_index != 2 )
+  {
+    std::cerr << "Error: need two images." << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> filenames( argv + image_index, argv + argc );
+  SurfaceDistanceRun surfaceDistanceRun( filenames, threads );
+  int result = common::dispatchScalar<3>( common::componentType( filenames ), surfaceDistanceRun );
+  if( result != 0 ) return result;
+
+  const std::vector<unsigned char> & first = surfaceDistanceRun.boundaries_[0];
+  const std::vector<unsigned char> & second = surfaceDistanceRun.boundaries_[1];
+  if( std::find( first.begin(), first.end(), 1 ) == first.end() ||
+      std::find( second.begin(), second.end(), 1 ) == second.end() )
+  {
+    std::cerr << "Error: a mask is empty, its surface distance is undefined." << std::endl;
+    return 1;
+  }
+
+  // directed distances, first to second and second to first.
+  std::vector<double> distances = surfaceDistances( first, second, surfaceDistanceRun.size_, surfaceDistanceRun.spacing_, threads );
+  const size_t firstCount = distances.size();
+  std::vector<double> back = surfaceDistances( second, first, surfaceDistanceRun.size_, surfaceDistanceRun.spacing_, threads );
+  distances.insert( distances.end(), back.begin(), back.end() );
+  common::reportPeakRSS( "after distance transforms" );
+
+  double sum = 0, maximum = 0, firstMaximum = 0;
+  for( size_t k=0; k<distances.size(); ++k )
+  {
+    sum += distances[k];
+    maximum = std::max( maximum, distances[k] );
+    if( k + 1 == firstCount ) firstMaximum = maximum;
+  }
+  const double secondMaximum = *std::max_element( distances.begin() + firstCount, distances.end() );
+
+  std::cerr << "boundary voxels: " << firstCount << " ; " << back.size() << std::endl;
+  std::cout << std::setprecision(6);
+  std::cout << "hausdorff," << maximum << std::endl;
+  std::cout << "hausdorff_1_to_2," << firstMaximum << std::endl;
+  std::cout << "hausdorff_2_to_1," << secondMaximum << std::endl;
+  std::cout << "hausdorff95," << percentile( distances, 0.95 ) << std::endl;
+  std::cout << "assd," << sum / distances.size() << std::endl;
+  common::reportPeakRSS( "at exit" );
+  return 0;
+}
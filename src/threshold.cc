@@ -29,14 +29,21 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
-#include <itkImageRegionIterator.h>
-#include <itkImageRegionIteratorWithIndex.h>
+#include <itkMultiThreader.h>
 #include <itkNumericTraits.h>
 #include <itkExceptionObject.h>
+#include <itkTimeProbe.h>
+
+#include "map.h"
+#include "PixelDispatch.h"
 
 
 enum Operation
@@ -46,6 +53,217 @@ enum Operation
 	BETWEEN
 };
 
+/**
+ * the per-voxel tests, one type each so the test is compiled into the loop.  The
+ * voxel is compared as a float, the way the tool always read its input.
+ */
+struct Above
+{
+  float threshold;
+  bool operator()(float value) const { return value > threshold; }
+};
+
+struct Below
+{
+  float threshold;
+  bool operator()(float value) const { return value < threshold; }
+};
+
+struct Between
+{
+  float lower;
+  float upper;
+  // both compares are always made, so the loop stays branch-free.
+  bool operator()(float value) const { return ( lower < value ) & ( value < upper ); }
+};
+
+typedef char  OutPixelType;
+typedef itk::Image< OutPixelType,  3 >   OutImageType;
+
+/**
+ * ThresholdFunctor - common::map functor that writes kernel(voxel) of a thread's
+ * region, one contiguous line of the raw buffers at a time.
+ */
+template < class ImageType, class Kernel >
+struct ThresholdFunctor
+{
+  typedef typename ImageType::ConstPointer ImageConstPointer;
+  typedef typename ImageType::PixelType PixelType;
+  typedef typename ImageType::IndexType IndexType;
+  typedef typename OutImageType::RegionType RegionType;
+
+  Kernel kernel_;
+  OutImageType::Pointer out_;
+
+  ThresholdFunctor(const Kernel & kernel, const OutImageType::Pointer & out)
+  :kernel_(kernel),
+   out_(out)
+  {}
+
+  void operator()(const ImageConstPointer & in, const RegionType & threadRegion)
+  {
+    if(threadRegion.GetNumberOfPixels() == 0) return;
+    const PixelType * input = in->GetBufferPointer();
+    OutPixelType * output = out_->GetBufferPointer();
+    const Kernel kernel = kernel_;
+    const IndexType start = threadRegion.GetIndex();
+    const size_t lineLength = threadRegion.GetSize()[0];
+    const size_t lines = threadRegion.GetNumberOfPixels() / lineLength;
+    IndexType line = start;
+    for(size_t l=0; l<lines; ++l)
+    {
+      const size_t begin = in->ComputeOffset(line);
+      const PixelType * a = input + begin;
+      OutPixelType * b = output + begin;
+      for(size_t v=0; v<lineLength; ++v) b[v] = kernel( static_cast<float>(a[v]) );
+      for(unsigned int d=1; d<ImageType::ImageDimension; ++d)
+      {
+        if(++line[d] < start[d] + static_cast<long>(threadRegion.GetSize()[d])) break;
+        line[d] = start[d];
+      }
+    }
+  }
+};
+
+/** threshold input into output with kernel over numThreads threads, returns the seconds it took. */
+template < class ImageType, class Kernel >
+double threshold(const typename ImageType::Pointer & input, const OutImageType::Pointer & output,
+                 const Kernel & kernel, size_t numThreads)
+{
+  typedef ThresholdFunctor<ImageType,Kernel> FunctorType;
+  FunctorType functor( kernel, output );
+  itk::TimeProbe probe;
+  probe.Start();
+  common::map<ImageType,OutImageType,FunctorType>::run( input.GetPointer(), functor, numThreads );
+  probe.Stop();
+  return probe.GetTotal();
+}
+
+/**
+ * benchmark - times kernel at 1, 2, 4, ... threads up to one per core (best of a few
+ * runs each) and prints the voxels per second as CSV.
+ */
+template < class ImageType, class Kernel >
+void benchmark(const typename ImageType::Pointer & input, const OutImageType::Pointer & output, const Kernel & kernel)
+{
+  const size_t cores = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  const double voxels = input->GetLargestPossibleRegion().GetNumberOfPixels();
+  std::vector<size_t> counts;
+  for(size_t threads=1; threads<cores; threads*=2) counts.push_back( threads );
+  counts.push_back( cores );
+  std::cout << "threads,seconds,voxels_per_second" << std::endl;
+  for(size_t c=0; c<counts.size(); ++c)
+  {
+    double best = 0;
+    for(int run=0; run<5; ++run)
+    {
+      const double seconds = threshold<ImageType,Kernel>( input, output, kernel, counts[c] );
+      if(run == 0 || seconds < best) best = seconds;
+    }
+    std::cout << counts[c] << "," << best << "," << ( best > 0 ? voxels / best : 0 ) << std::endl;
+  }
+}
+
+/**
+ * ThresholdRun - reads the input in its stored pixel type, thresholds it with the
+ * kernel of the operation (chosen once, here) and writes the mask, see
+ * common::dispatchScalar.
+ */
+struct ThresholdRun
+{
+  Operation operation_;
+  float threshold_;
+  float upperthreshold_;
+  std::string inputfn_;
+  std::string outputfn_;
+  size_t threads_;
+  bool benchmark_;
+
+  ThresholdRun(Operation operation, float threshold, float upperthreshold, const std::string & inputfn,
+               const std::string & outputfn, size_t threads, bool benchmark)
+  :operation_(operation),
+   threshold_(threshold),
+   upperthreshold_(upperthreshold),
+   inputfn_(inputfn),
+   outputfn_(outputfn),
+   threads_(threads),
+   benchmark_(benchmark)
+  {}
+
+  template < class ImageType >
+  int run()
+  {
+    typedef itk::ImageFileReader< ImageType  >  ReaderType;
+
+    // read in the nrrds
+    typename ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileName( inputfn_ );
+    typename ImageType::Pointer input = reader->GetOutput();
+    try
+    {
+      reader->Update();
+    }
+    catch(itk::ExceptionObject e)
+    {
+      std::cerr << "Error reading file " << inputfn_ << ": " << e << std::endl;
+      return 1;
+    }
+
+    // store the results in a nrrd: 
+    OutImageType::Pointer output = OutImageType::New(); 
+    output->SetRegions( input->GetLargestPossibleRegion() ); 
+    output->Allocate();
+    output->SetOrigin( input->GetOrigin() );
+    output->SetSpacing( input->GetSpacing() );
+
+    switch(operation_)
+    {
+      case ABOVE:
+      {
+        Above kernel = { threshold_ };
+        apply<ImageType>( input, output, kernel );
+        break;
+      }
+      case BELOW:
+      {
+        Below kernel = { threshold_ };
+        apply<ImageType>( input, output, kernel );
+        break;
+      }
+      case BETWEEN:
+      {
+        Between kernel = { threshold_, upperthreshold_ };
+        apply<ImageType>( input, output, kernel );
+        break;
+      }
+    }
+
+    // write out the mask:
+    typedef itk::ImageFileWriter< OutImageType > WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput( output );
+    writer->SetFileName( outputfn_ );
+    writer->UseCompressionOn();
+
+    try
+    {
+      writer->Update();
+    }
+    catch(itk::ExceptionObject e)
+    {
+      std::cerr << "Error writing file " << outputfn_ << ": " << e << std::endl;
+    }
+    return 0;
+  }
+
+  template < class ImageType, class Kernel >
+  void apply(const typename ImageType::Pointer & input, const OutImageType::Pointer & output, const Kernel & kernel)
+  {
+    if(benchmark_) benchmark<ImageType,Kernel>( input, output, kernel );
+    else threshold<ImageType,Kernel>( input, output, kernel, threads_ );
+  }
+};
+
 /**
  * thresholds an image creating a binary mask
  */
@@ -54,10 +272,40 @@ int main(int argc, char ** argv)
 
   if( argc == 1 )
   {
-    std::cerr << "usage: " << argv[0] << " <above|below|between> <threshold-value,upper-threshold-value> input.nrrd output.nrrd" << std::endl;
+    std::cerr << "usage: " << argv[0] << " [-threads N] [-benchmark] <above|below|between> <threshold-value,upper-threshold-value> input.nrrd output.nrrd" << std::endl;
 		std::cerr << "      NOTE: only use \"value,value\" syntax when using between.  Upper value ignored otherwise." << std::endl;
+    std::cerr << "      -threads N = number of threads (default one per core)" << std::endl;
+    std::cerr << "      -benchmark = also print the voxels per second at 1, 2, 4, ... threads as CSV" << std::endl;
     return 1;
   }
+
+  size_t threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  bool benchmark = false;
+  int arg = 1;
+  while( arg < argc && argv[arg][0] == '-' )
+  {
+    std::string option(argv[arg++]);
+    if( option == "-threads" && arg < argc )
+    {
+      threads = std::max( 1, atoi(argv[arg++]) );
+    }
+    else if( option == "-benchmark" )
+    {
+      benchmark = true;
+    }
+    else
+    {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if( argc - arg != 4 )
+  {
+    std::cerr << "Error: need an operation, a threshold, an input and an output." << std::endl;
+    return 1;
+  }
+  argv += arg - 1;
+
   std::string operationstr(argv[1]);
 	std::string thold(argv[2]);
   float threshold = 0.f;
@@ -107,74 +355,6 @@ int main(int argc, char ** argv)
     return 1;
   }
 
-  // setup ITK types...
-  typedef float  PixelType;
-  typedef itk::Image< PixelType,  3 >   ImageType;
-  typedef itk::ImageFileReader< ImageType  >  ReaderType;
-
-  typedef char  OutPixelType;
-  typedef itk::Image< OutPixelType,  3 >   OutImageType;
-
-  typedef itk::ImageRegionIteratorWithIndex< ImageType > ImageIterator;
-  typedef itk::ImageRegionIteratorWithIndex< OutImageType > OutImageIterator;
-
-  // read in the nrrds
-  ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName( inputfn );
-  ImageType::Pointer input = reader->GetOutput();
-  try
-  {
-    reader->Update();
-  }
-  catch(itk::ExceptionObject e)
-  {
-    std::cerr << "Error reading file " << inputfn << ": " << e << std::endl;
-    return 1;
-  }
-
-  // store the results in a nrrd: 
-  OutImageType::Pointer output = OutImageType::New(); 
-  output->SetRegions( input->GetLargestPossibleRegion() ); 
-  output->Allocate();
-  output->SetOrigin( input->GetOrigin() );
-  output->SetSpacing( input->GetSpacing() );
-  //output->FillBuffer ( itk::NumericTraits<OutImageType::PixelType>::Zero ); 
-
-  OutImageIterator outputIt( output, output->GetLargestPossibleRegion() );
-  ImageIterator inputIt( input, input->GetLargestPossibleRegion() );
-
-  for( ; !outputIt.IsAtEnd() ; ++outputIt, ++inputIt )
-  {
-    switch(operation)
-    {
-      case ABOVE:
-        outputIt.Set( inputIt.Get() > threshold );
-        break;
-      case BELOW:
-        outputIt.Set( inputIt.Get() < threshold );
-				break;
-      case BETWEEN:
-        outputIt.Set( threshold < inputIt.Get() && inputIt.Get() < upperthreshold );
-        break;
-    }
-  }
-
-  // write out the mask:
-  typedef itk::ImageFileWriter< OutImageType > WriterType;
-  WriterType::Pointer writer = WriterType::New();
-  writer->SetInput( output );
-  writer->SetFileName( outputfn );
-  writer->UseCompressionOn();
-
-  try
-  {
-    writer->Update();
-  }
-  catch(itk::ExceptionObject e)
-  {
-    std::cerr << "Error writing file " << outputfn << ": " << e << std::endl;
-  }
-
-  return 0;
+  ThresholdRun thresholdRun( operation, threshold, upperthreshold, inputfn, outputfn, threads, benchmark );
+  return common::dispatchScalar<3>( common::componentType( inputfn ), thresholdRun );
 }
-
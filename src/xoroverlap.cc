@@ -28,11 +28,20 @@
 #include <vector>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
 
 #include <itkImage.h>
 #include <itkImageFileReader.h>
 #include <itkNrrdImageIO.h>
 #include <itkImageRegionConstIterator.h>
+#include <itkMultiThreader.h>
+
+#include "RunLength.h"
+#include "LoadImages.h"
+#include "PixelDispatch.h"
+#include "MemoryUsage.h"
 
 /**
  * XOR Overlap
@@ -94,38 +103,212 @@ double get_xor_overlap(
 }
 
 
+/**
+ * get_rle_xor_overlap - the same as get_xor_overlap, from the run-length encoded
+ * masks: only the runs of both images inside the runs of the mask are walked.  The
+ * runs of the negative voxels are kept too, as a voxel that is > 0 in one image and
+ * negative in the other is not counted.
+ */
+double get_rle_xor_overlap(const std::vector<std::string> &filenames, bool sidecar) {
+
+  const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::vector<common::RunLengthMask> masks;
+  std::vector<common::RunLengthMask> negatives;
+  if(!common::loadRunLengths(filenames, masks, numThreads, sidecar, true, &negatives)) exit(1);
+  common::reportPeakRSS( "after loading" );
+
+  if(masks[1].size() != masks[0].size() || masks[2].size() != masks[0].size())
+  {
+    std::cerr << "Error: sizes of the mask and images do not match." << std::endl;
+    exit(1);
+  }
 
-int main(int argc, char ** argv) {
+  // counted within the mask: first/second = image voxels in the mask, both = in both.
+  common::OverlapCounts counts = common::countOverlap( masks[1], masks[2], numThreads, &masks[0] );
+  long long num_mask = masks[0].count();
+  long long num_pixel1_xor_pixel2 = counts.first + counts.second - 2 * counts.both;
+  // less the voxels > 0 in one image and negative in the other.
+  if(negatives[2].count() > 0)
+    num_pixel1_xor_pixel2 -= common::countOverlap( masks[1], negatives[2], numThreads, &masks[0] ).both;
+  if(negatives[1].count() > 0)
+    num_pixel1_xor_pixel2 -= common::countOverlap( negatives[1], masks[2], numThreads, &masks[0] ).both;
 
-  if (argc != 4) {
-    std::cerr << "usage: " << argv[0] << " mask.nrrd image1.nrrd image2.nrrd" << std::endl;
-    std::cerr << "where mask is " << std::endl;
+  double xor_overlap = static_cast<double>(num_mask-num_pixel1_xor_pixel2) / num_mask;
+
+  return xor_overlap * 100.0;
+}
+
+
+/**
+ * XorBatchRun - reads one pair of images in their stored pixel type and scores it
+ * over the spans of the mask, see common::dispatchScalar.
+ */
+struct XorBatchRun
+{
+  const std::vector<common::Span> &spans_;
+  const std::vector<size_t> &size_;
+  long long num_mask_;
+  std::vector<std::string> pair_;
+  size_t threads_;
+  double overlap_;
+
+  XorBatchRun(const std::vector<common::Span> &spans, const std::vector<size_t> &size, long long num_mask,
+              const std::vector<std::string> &pair, size_t threads)
+  :spans_(spans),
+   size_(size),
+   num_mask_(num_mask),
+   pair_(pair),
+   threads_(threads),
+   overlap_(0)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    std::vector<typename InputImageType::Pointer> images;
+    if( !common::loadImages<InputImageType>( pair_, images, 2, false ) ) return 1;
+    for( size_t i=0; i<2; ++i ) {
+      typename InputImageType::SizeType size = images[i]->GetLargestPossibleRegion().GetSize();
+      for( unsigned int d=0; d<InputImageType::ImageDimension; ++d ) {
+        if( size[d] != size_[d] ) {
+          std::cerr << "Error: size of " << pair_[i] << " does not match the mask." << std::endl;
+          return 1;
+        }
+      }
+    }
+
+    long long num_pixel1_xor_pixel2 = common::countXor<InputImageType>( spans_, images[0], images[1], threads_ );
+    overlap_ = static_cast<double>(num_mask_-num_pixel1_xor_pixel2) / num_mask_ * 100.0;
+    return 0;
+  }
+};
+
+/**
+ * run_batch - xor overlap of every pair of images listed in pairs (two files a line,
+ * # starts a comment) within one mask.  The mask is read once and kept as the spans
+ * of its set voxels, each pair is then only looked at inside those spans.  Prints
+ * one CSV line per pair, returns the number of pairs that failed.
+ */
+int run_batch(const std::string &pairs, const std::string &mask, bool sidecar) {
+
+  std::ifstream in( pairs.c_str() );
+  if (!in) {
+    std::cerr << "Error: could not open " << pairs << std::endl;
     return 1;
   }
-  
-  // setup ITK types...
-  typedef float InputPixelType;
-  typedef itk::Image< InputPixelType,  3 >   InputImageType;
-  typedef itk::ImageFileReader< InputImageType  >  ReaderType;
-
-  // read in the images...
-  std::vector<InputImageType::Pointer> images;
-
-  for( int i=1; i<argc; ++i ) {
-    ReaderType::Pointer reader = ReaderType::New();
-    reader->SetFileName( argv[i] );
-    InputImageType::Pointer image = reader->GetOutput();
-    reader->Update();
-    images.push_back(image);
+
+  const size_t numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::vector<common::RunLengthMask> masks;
+  if(!common::loadRunLengths(std::vector<std::string>(1, mask), masks, numThreads, sidecar, true)) return 1;
+  const std::vector<common::Span> spans = common::spans( masks[0] );
+  const long long num_mask = masks[0].count();
+  std::cerr << "mask: " << num_mask << " voxels in " << spans.size() << " spans" << std::endl;
+
+  std::cout << "image1,image2,xor_overlap" << std::endl;
+  int failed = 0;
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline( in, line )) {
+    ++lineNumber;
+    std::istringstream fields( line );
+    std::vector<std::string> pair;
+    std::string file;
+    while (fields >> file) pair.push_back( file );
+    if (pair.empty() || pair[0][0] == '#') continue;
+    if (pair.size() != 2) {
+      std::cerr << "Error: line " << lineNumber << " of " << pairs << " needs two images." << std::endl;
+      ++failed;
+      continue;
+    }
+
+    XorBatchRun batchRun( spans, masks[0].size(), num_mask, pair, numThreads );
+    if (common::dispatchScalar<3>( common::componentType( pair ), batchRun ) != 0) {
+      ++failed;
+      continue;
+    }
+    std::cout << pair[0] << "," << pair[1] << "," << std::setprecision(4) << batchRun.overlap_ << std::endl;
   }
+  common::reportPeakRSS( "at exit" );
+  return failed;
+}
 
 
-  double overlap = get_xor_overlap<InputImageType>(images[0], images[1], images[2]);
+/**
+ * XorOverlapRun - reads the mask and both images in their stored pixel type and
+ * prints the xor overlap, see common::dispatchScalar.
+ */
+struct XorOverlapRun
+{
+  char ** argv_;
+
+  XorOverlapRun(char ** argv)
+  :argv_(argv)
+  {}
+
+  template < class InputImageType >
+  int run()
+  {
+    typedef itk::ImageFileReader< InputImageType  >  ReaderType;
+
+    // read in the images...
+    std::vector<typename InputImageType::Pointer> images;
+
+    for( int i=1; i<4; ++i ) {
+      typename ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName( argv_[i] );
+      typename InputImageType::Pointer image = reader->GetOutput();
+      reader->Update();
+      images.push_back(image);
+    }
+    common::reportPeakRSS( "after loading" );
 
-  //std::cout << std::setprecision(4) << overlap << std::endl;
-  std::cout << std::setprecision(4) << overlap;
+    double overlap = get_xor_overlap<InputImageType>(images[0], images[1], images[2]);
 
-  return 0;
-}
+    //std::cout << std::setprecision(4) << overlap << std::endl;
+    std::cout << std::setprecision(4) << overlap;
+    common::reportPeakRSS( "at exit" );
+    return 0;
+  }
+};
+
+int main(int argc, char ** argv) {
 
+  bool rle = false;
+  bool sidecar = false;
+  std::string batch;
+  int image_index = 1;
+  while (image_index < argc && argv[image_index][0] == '-') {
+    std::string option(argv[image_index++]);
+    if (option == "-rle") rle = true;
+    else if (option == "-sidecar") rle = sidecar = true;
+    else if (option == "-batch" && image_index < argc) batch = argv[image_index++];
+    else {
+      std::cerr << "Error: unrecognized option " << option << std::endl;
+      return 1;
+    }
+  }
+  if (!batch.empty() && argc - image_index == 1) {
+    return run_batch(batch, argv[image_index], sidecar) == 0 ? 0 : 1;
+  }
+  if (argc - image_index != 3 || !batch.empty()) {
+    std::cerr << "usage: " << argv[0] << " [-rle | -sidecar] mask.nrrd image1.nrrd image2.nrrd" << std::endl;
+    std::cerr << "       " << argv[0] << " -batch pairs.txt [-sidecar] mask.nrrd" << std::endl;
+    std::cerr << "where mask is " << std::endl;
+    std::cerr << "       -rle = count the overlap from the run-length encoded masks" << std::endl;
+    std::cerr << "       -sidecar = like -rle, keeping each mask's runs in image.nrrd.rle (its negative voxels in image.nrrd.neg.rle) for the next run" << std::endl;
+    std::cerr << "       -batch pairs.txt = score every pair of images (two a line) in pairs.txt against one mask, as CSV" << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> filenames( argv+image_index, argv+image_index+3 );
+  if (rle) {
+    double overlap = get_rle_xor_overlap(filenames, sidecar);
+    std::cout << std::setprecision(4) << overlap;
+    common::reportPeakRSS( "at exit" );
+    return 0;
+  }
+
+  XorOverlapRun xorOverlapRun( argv+image_index-1 );
+  return common::dispatchScalar<3>( common::componentType( filenames ), xorOverlapRun );
+}
 